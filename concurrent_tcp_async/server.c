@@ -11,10 +11,57 @@
 #include <fcntl.h>
 #include <time.h>
 #include <getopt.h> // Added for getopt_long
+#include <signal.h> // Deregister from the gateway on SIGINT/SIGTERM
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "../json_rpc/calc_proto.h" // Binary requests from the gateway
 
 // #define PORT 8080 // Will be set by command line argument
-#define MAX_EVENTS 10
+#define MAX_EVENTS 64
+#define MAX_THREADS 64
 #define BUF_SIZE 1024
+#define DEFAULT_HEARTBEAT_MS 3000 // How often the registration is re-sent to the gateway
+#define LEASE_HEARTBEATS 3 // The gateway drops this server after missing this many heartbeats
+#define MAX_CLIENT_FDS 4096 // Connections are tracked by fd; higher fds are refused
+#define FRAME_OUT_SIZE 65536 // Replies buffered per bin1 connection while the socket is full
+#define FRAME_IN_SIZE (CALC_MAX_REQUEST_SIZE + BUF_SIZE) // A partial frame plus one read
+#define FRAME_OUT_RESERVE FRAME_IN_SIZE // Replies one read can produce; no reply is larger than its request
+
+static volatile sig_atomic_t stop_requested = 0;
+static int stop_fd = -1; // eventfd, readable once the event loops are to exit
+
+// A connection the gateway multiplexes bin1 requests over. It writes frames
+// back to back without waiting for replies, so a read can end inside a
+// frame, and replies may have to wait for room in the socket.
+typedef struct {
+    unsigned char in[FRAME_IN_SIZE]; // Unanswered bytes, at most one partial frame between reads
+    size_t in_len;
+    unsigned char out[FRAME_OUT_SIZE];
+    size_t out_len;
+    uint32_t events; // EPOLLIN/EPOLLOUT as registered, alongside EPOLLET
+} FrameConn;
+
+// One thread's epoll instance. A connection is accepted by one loop and
+// served by it until it closes.
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd; // Shared by all loops, or this loop's own with --reuseport
+    FrameConn *frame_conns[MAX_CLIENT_FDS]; // By fd; NULL until a connection sends a frame
+} EventLoop;
+
+void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 void set_nonblocking(int sockfd) {
     int flags = fcntl(sockfd, F_GETFL, 0);
@@ -23,9 +70,10 @@ void set_nonblocking(int sockfd) {
 
 void log_with_timestamp(const char *msg) {
     time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+    struct tm t;
+    localtime_r(&now, &t);
     char buf[64];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", t);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &t);
     printf("[%s] %s\n", buf, msg);
 }
 
@@ -66,16 +114,200 @@ void handle_calculation(const char *input, char *response, size_t resp_size) {
     }
 }
 
+void close_client(EventLoop *loop, int client) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client, NULL);
+    free(loop->frame_conns[client]);
+    loop->frame_conns[client] = NULL;
+    close(client);
+}
+
+// Sends buffered replies until the socket is full. Reading pauses while the
+// buffer is too full to take the replies of another read; re-enabling it
+// reports any data that arrived meanwhile as a new edge.
+int flush_frames(int epoll_fd, int client, FrameConn *conn) {
+    size_t sent = 0;
+    while (sent < conn->out_len) {
+        ssize_t n = send(client, conn->out + sent, conn->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+
+    uint32_t events = 0;
+    if (conn->out_len > 0) events |= EPOLLOUT;
+    if (conn->out_len <= FRAME_OUT_SIZE - FRAME_OUT_RESERVE) events |= EPOLLIN;
+    if (events != conn->events) {
+        struct epoll_event event;
+        event.data.fd = client;
+        event.events = events | EPOLLET;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client, &event);
+        conn->events = events;
+    }
+    return 0;
+}
+
+// Answers every complete request frame, single or batch, in the bytes read
+// so far and keeps a trailing partial one. Returns -1 if the stream holds
+// something other than bin1 frames, after which it cannot be resynchronized.
+int handle_frames(FrameConn *conn, const unsigned char *data, size_t len) {
+    memcpy(conn->in + conn->in_len, data, len);
+    conn->in_len += len;
+    size_t used = 0;
+    for (;;) {
+        long size = calc_request_frame_size(conn->in + used, conn->in_len - used);
+        if (size < 0) return -1;
+        if (size == 0 || (size_t)size > conn->in_len - used) break;
+        conn->out_len += calc_handle_frame(conn->in + used, size, conn->out + conn->out_len);
+        used += size;
+    }
+    conn->in_len -= used;
+    memmove(conn->in, conn->in + used, conn->in_len);
+    return 0;
+}
+
+void accept_client(EventLoop *loop) {
+    int client_fd = accept(loop->listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+        // Another loop woken for the same connection took it first
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+        return;
+    }
+    if (client_fd >= MAX_CLIENT_FDS) {
+        log_with_timestamp("Too many clients; refusing connection.");
+        close(client_fd);
+        return;
+    }
+    set_nonblocking(client_fd);
+    struct epoll_event event;
+    event.data.fd = client_fd;
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+    log_with_timestamp("New client connected.");
+}
+
+// Reads until the socket is drained, as edge-triggered epoll reports new
+// data only once. Stops early while a bin1 connection's replies wait for
+// room; flush_frames resumes it.
+void read_client(EventLoop *loop, int client) {
+    char buf[BUF_SIZE], response[BUF_SIZE];
+
+    for (;;) {
+        FrameConn *conn = loop->frame_conns[client];
+        if (conn && !(conn->events & EPOLLIN)) return;
+        int bytes = recv(client, buf, BUF_SIZE - 1, 0);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (bytes <= 0) {
+            close_client(loop, client);
+            log_with_timestamp("Client disconnected.");
+            return;
+        } else if (conn || calc_is_binary(buf, bytes)) {
+            // bin1 frames from the gateway, possibly many in flight;
+            // text clients never send the magic byte
+            if (!conn && !(conn = loop->frame_conns[client] = calloc(1, sizeof(FrameConn)))) {
+                close_client(loop, client);
+                log_with_timestamp("Out of memory; dropped client.");
+                return;
+            }
+            if (!conn->events) conn->events = EPOLLIN;
+            log_with_timestamp("Received binary requests.");
+            if (handle_frames(conn, (const unsigned char *)buf, bytes) < 0) {
+                close_client(loop, client);
+                log_with_timestamp("Bad binary frame; dropped client.");
+                return;
+            } else if (flush_frames(loop->epoll_fd, client, conn) < 0) {
+                close_client(loop, client);
+                log_with_timestamp("Client disconnected.");
+                return;
+            }
+        } else {
+            buf[bytes] = '\0';
+            log_with_timestamp("Received client message.");
+            handle_calculation(buf, response, BUF_SIZE);
+            send(client, response, strlen(response), MSG_NOSIGNAL);
+
+            // Close client if choice 5 (exit)
+            if (strncmp(buf, "5", 1) == 0) {
+                close_client(loop, client);
+                log_with_timestamp("Client requested exit.");
+                return;
+            }
+        }
+    }
+}
+
+void *run_event_loop(void *arg) {
+    EventLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == stop_fd) return NULL;
+            if (fd == loop->listen_fd) {
+                accept_client(loop);
+                continue;
+            }
+            FrameConn *conn = loop->frame_conns[fd];
+            if (conn && (events[i].events & EPOLLOUT) && flush_frames(loop->epoll_fd, fd, conn) < 0) {
+                close_client(loop, fd);
+                log_with_timestamp("Client disconnected.");
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) read_client(loop, fd);
+        }
+    }
+}
+
+// A non-blocking listening socket on addr, or -1. With reuseport, several
+// such sockets can share the port and the kernel spreads connections over
+// them.
+int open_listener(const struct sockaddr_in *addr, int reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    set_nonblocking(fd);
+
+    // The gateway keeps connections open, so a restarted server must be able
+    // to rebind while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuseport) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("Bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 int main(int argc, char *argv[]) { // Added argc and argv
-    int server_fd, client_fd, epoll_fd;
+    int server_fd;
     struct sockaddr_in addr;
-    struct epoll_event event, events[MAX_EVENTS];
+    struct epoll_event event;
 
     char *gateway_host = NULL;
     int gateway_port = -1;
     char *my_host = NULL;
     int my_port = -1;
     char *server_name = NULL;
+    int heartbeat_ms = DEFAULT_HEARTBEAT_MS;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores < 1 ? 1 : cores > MAX_THREADS ? MAX_THREADS : (int)cores;
+    int reuseport = 0;
 
     // Parse command line arguments
     struct option long_options[] = {
@@ -84,11 +316,14 @@ int main(int argc, char *argv[]) { // Added argc and argv
         {"my-host", required_argument, 0, 'h'},
         {"my-port", required_argument, 0, 'm'},
         {"server-name", required_argument, 0, 's'},
+        {"heartbeat-ms", required_argument, 0, 'b'},
+        {"threads", required_argument, 0, 't'},
+        {"reuseport", no_argument, 0, 'r'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "g:p:h:m:s:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "g:p:h:m:s:b:t:r", long_options, NULL)) != -1) {
         switch (opt) {
             case 'g':
                 gateway_host = optarg;
@@ -105,29 +340,34 @@ int main(int argc, char *argv[]) { // Added argc and argv
             case 's':
                 server_name = optarg;
                 break;
+            case 'b':
+                heartbeat_ms = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'r':
+                reuseport = 1;
+                break;
             default:
-                fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name>\n", argv[0]);
+                fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name> [--heartbeat-ms <ms>] [--threads <n>] [--reuseport]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    if (!gateway_host || gateway_port == -1 || !my_host || my_port == -1 || !server_name) {
+    if (!gateway_host || gateway_port == -1 || !my_host || my_port == -1 || !server_name || heartbeat_ms < 0 ||
+        threads < 1 || threads > MAX_THREADS) {
         fprintf(stderr, "Missing required arguments.\n");
-        fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name> [--heartbeat-ms <ms>] [--threads <n>] [--reuseport]\n", argv[0]);
+        fprintf(stderr, "  --heartbeat-ms  Re-send the registration this often, 0 to register only once (default %d)\n", DEFAULT_HEARTBEAT_MS);
+        fprintf(stderr, "  --threads       Event loop threads, each with its own epoll instance, 1-%d (default: one per core)\n", MAX_THREADS);
+        fprintf(stderr, "  --reuseport     Give each thread its own listening socket (SO_REUSEPORT) instead of sharing one\n");
         exit(EXIT_FAILURE);
     }
 
     log_with_timestamp("Server starting with provided arguments.");
 
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    set_nonblocking(server_fd);
-
     addr.sin_family = AF_INET;
     addr.sin_port = htons(my_port); // Use my_port from command line
     // addr.sin_addr.s_addr = INADDR_ANY; // Listen on all interfaces initially
@@ -141,29 +381,35 @@ int main(int argc, char *argv[]) { // Added argc and argv
     }
 
 
-    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("Bind failed");
+    server_fd = open_listener(&addr, reuseport);
+    if (server_fd < 0) {
         // If specific my_host bind fails, try INADDR_ANY as a fallback for listening
         log_with_timestamp("Bind to specific my_host failed, trying INADDR_ANY.");
         addr.sin_addr.s_addr = INADDR_ANY;
-        if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-            perror("Bind failed on INADDR_ANY as well");
+        server_fd = open_listener(&addr, reuseport);
+        if (server_fd < 0) {
+            log_with_timestamp("Bind failed on INADDR_ANY as well.");
             exit(EXIT_FAILURE);
         }
     }
 
-    listen(server_fd, SOMAXCONN);
     char log_msg[256];
-    snprintf(log_msg, sizeof(log_msg), "TCP server listening on %s:%d...", my_host, my_port);
+    snprintf(log_msg, sizeof(log_msg), "TCP server listening on %s:%d with %d event loop threads%s...", my_host, my_port,
+             threads, reuseport ? " (SO_REUSEPORT)" : "");
     log_with_timestamp(log_msg);
 
-    // Register with gateway
+    // Register with gateway. The socket stays open for heartbeats and the
+    // deregistration on shutdown.
     int reg_sock;
     struct sockaddr_in gateway_addr;
     char reg_msg[512];
+    char dereg_msg[256];
 
-    snprintf(reg_msg, sizeof(reg_msg), "type=TCP;host=%s;port=%d;name=%s;ops=add,subtract,multiply,divide",
-             my_host, my_port, server_name);
+    // With heartbeats on, the gateway expires the registration (its lease)
+    // once LEASE_HEARTBEATS of them in a row are missing
+    snprintf(reg_msg, sizeof(reg_msg), "type=TCP;host=%s;port=%d;name=%s;ops=add,subtract,multiply,divide;lease_ms=%lld;proto=%s;batch=%d",
+             my_host, my_port, server_name, (long long)heartbeat_ms * LEASE_HEARTBEATS, CALC_PROTO_NAME, CALC_BATCH_MAX);
+    snprintf(dereg_msg, sizeof(dereg_msg), "action=deregister;name=%s", server_name);
 
     if ((reg_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("UDP socket creation for registration failed");
@@ -176,6 +422,7 @@ int main(int argc, char *argv[]) { // Added argc and argv
         if (inet_pton(AF_INET, gateway_host, &gateway_addr.sin_addr) <= 0) {
             perror("Invalid gateway address for registration");
             close(reg_sock); // Close the created socket
+            reg_sock = -1;
         } else {
             log_with_timestamp("Attempting to register with gateway...");
             if (sendto(reg_sock, reg_msg, strlen(reg_msg), 0, (const struct sockaddr *)&gateway_addr, sizeof(gateway_addr)) < 0) {
@@ -187,61 +434,85 @@ int main(int argc, char *argv[]) { // Added argc and argv
                 snprintf(log_msg, sizeof(log_msg), "Registration message sent to %s:%d: %s", gateway_host, gateway_port, reg_msg);
                 log_with_timestamp(log_msg);
             }
-            close(reg_sock);
         }
     }
+    long long next_heartbeat_ms = monotonic_ms() + heartbeat_ms;
 
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
-        perror("epoll_create1");
+    // No SA_RESTART: the signal interrupts the heartbeat wait so the server can exit
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    stop_fd = eventfd(0, EFD_NONBLOCK);
+    EventLoop *loops = calloc(threads, sizeof(EventLoop));
+    if (stop_fd < 0 || !loops) {
+        perror("Event loop setup failed");
         exit(EXIT_FAILURE);
     }
 
-    event.data.fd = server_fd;
-    event.events = EPOLLIN;
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+    // Only this thread takes SIGINT/SIGTERM, so they interrupt its wait
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
 
-    while (1) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-        for (int i = 0; i < n; i++) {
-            if (events[i].data.fd == server_fd) {
-                // Accept new client
-                client_fd = accept(server_fd, NULL, NULL);
-                if (client_fd < 0) {
-                    perror("accept");
-                    continue;
-                }
-                set_nonblocking(client_fd);
-                event.data.fd = client_fd;
-                event.events = EPOLLIN;
-                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
-                log_with_timestamp("New client connected.");
-            } else {
-                char buf[BUF_SIZE], response[BUF_SIZE];
-                int client = events[i].data.fd;
-                int bytes = recv(client, buf, BUF_SIZE - 1, 0);
-
-                if (bytes <= 0) {
-                    close(client);
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client, NULL);
-                    log_with_timestamp("Client disconnected.");
-                } else {
-                    buf[bytes] = '\0';
-                    log_with_timestamp("Received client message.");
-                    handle_calculation(buf, response, BUF_SIZE);
-                    send(client, response, strlen(response), 0);
-
-                    // Close client if choice 5 (exit)
-                    if (strncmp(buf, "5", 1) == 0) {
-                        close(client);
-                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client, NULL);
-                        log_with_timestamp("Client requested exit.");
-                    }
+    for (int t = 0; t < threads; t++) {
+        EventLoop *loop = &loops[t];
+        loop->epoll_fd = epoll_create1(0);
+        if (loop->epoll_fd == -1) {
+            perror("epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+        loop->listen_fd = reuseport && t > 0 ? open_listener(&addr, 1) : server_fd;
+        if (loop->listen_fd < 0) exit(EXIT_FAILURE);
+
+        // A shared listener wakes one of the waiting loops per connection,
+        // not all of them
+        event.data.fd = loop->listen_fd;
+        event.events = reuseport ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &event);
+        event.data.fd = stop_fd;
+        event.events = EPOLLIN;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, stop_fd, &event);
+
+        if (pthread_create(&loop->thread, NULL, run_event_loop, loop) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    while (!stop_requested) {
+        int timeout = -1;
+        if (reg_sock >= 0 && heartbeat_ms > 0) {
+            long long now = monotonic_ms();
+            if (now >= next_heartbeat_ms) {
+                if (sendto(reg_sock, reg_msg, strlen(reg_msg), 0, (const struct sockaddr *)&gateway_addr, sizeof(gateway_addr)) < 0) {
+                    snprintf(log_msg, sizeof(log_msg), "Failed to send heartbeat to %s:%d. Error: %s", gateway_host, gateway_port, strerror(errno));
+                    log_with_timestamp(log_msg);
                 }
+                next_heartbeat_ms = now + heartbeat_ms;
             }
+            timeout = (int)(next_heartbeat_ms - now);
         }
+        poll(NULL, 0, timeout);
     }
 
+    uint64_t stop = 1;
+    write(stop_fd, &stop, sizeof(stop));
+    for (int t = 0; t < threads; t++) {
+        pthread_join(loops[t].thread, NULL);
+        if (loops[t].listen_fd != server_fd) close(loops[t].listen_fd);
+    }
+
+    if (reg_sock >= 0) {
+        log_with_timestamp("Shutting down; deregistering from gateway.");
+        sendto(reg_sock, dereg_msg, strlen(dereg_msg), 0, (const struct sockaddr *)&gateway_addr, sizeof(gateway_addr));
+        close(reg_sock);
+    }
     close(server_fd);
     return 0;
 }
@@ -4,16 +4,27 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 #define PORT 8080
 #define BUF_SIZE 1024
+#define DEFAULT_WORKERS 8
+#define MAX_WORKERS 256
+#define RESPAWN_MIN_LIFETIME 1 // Seconds; a worker that crashes sooner is respawned this much later
 
 int client_count = 0;
+static _Atomic int *shared_client_count; // Session ids across pre-forked workers
+static volatile sig_atomic_t stop_requested = 0;
 
 void log_to_file(const char *message) {
     FILE *logfile = fopen("server.log", "a");
@@ -31,8 +42,11 @@ char *get_timestamp() {
     return buffer;
 }
 
-void handle_client(int client_sock, int session_id, const char *client_ip, int client_port) {
+// Serves one client until it disconnects or exits. Returns how many requests
+// it made.
+int serve_client(int client_sock, int session_id, const char *client_ip, int client_port) {
     char buffer[BUF_SIZE];
+    int requests = 0;
 
     char msg[256];
     snprintf(msg, sizeof(msg), "[%s] [Client #%d | PID %d] Connected: %s:%d",
@@ -51,6 +65,7 @@ void handle_client(int client_sock, int session_id, const char *client_ip, int c
             break;
         }
 
+        requests++;
         int choice;
         double a, b, result;
         sscanf(buffer, "%d %lf %lf", &choice, &a, &b);
@@ -77,15 +92,182 @@ void handle_client(int client_sock, int session_id, const char *client_ip, int c
     }
 
     close(client_sock);
+    return requests;
+}
+
+void handle_client(int client_sock, int session_id, const char *client_ip, int client_port) {
+    serve_client(client_sock, session_id, client_ip, client_port);
     exit(0); // End child
 }
 
-int main() {
+// Pre-forked worker: accepts and serves clients one at a time on the shared
+// listening socket. Exits after max_requests requests (0 for no limit) once
+// the client it is serving disconnects, so the supervisor can replace it.
+void worker_main(int server_fd, int max_requests) {
+    int served = 0;
+
+    signal(SIGPIPE, SIG_IGN); // A vanished client must not take the worker with it
+    while (!max_requests || served < max_requests) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int client_sock = accept(server_fd, (struct sockaddr *)&address, &addrlen);
+        if (client_sock < 0) {
+            if (errno != EINTR) perror("Accept failed");
+            continue;
+        }
+
+        int session_id = atomic_fetch_add(shared_client_count, 1) + 1;
+        served += serve_client(client_sock, session_id, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+    }
+    exit(0);
+}
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void wake_supervisor(int sig) {
+    (void)sig;
+}
+
+static pid_t spawn_worker(int server_fd, int max_requests, const sigset_t *worker_mask) {
+    pid_t supervisor = getpid();
+    fflush(stdout); // Not to be repeated by the worker
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        sigprocmask(SIG_SETMASK, worker_mask, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // Do not outlive the supervisor
+        if (getppid() != supervisor) exit(0);
+        setvbuf(stdout, NULL, _IOLBF, 0); // Whole lines, when workers share a redirected stdout
+        worker_main(server_fd, max_requests);
+    }
+    if (pid < 0) perror("Fork failed");
+    return pid;
+}
+
+// Supervisor: keeps `workers` processes accepting on server_fd, replacing
+// any that exit (recycled after max_requests, or crashed). Stops them all on
+// SIGTERM or SIGINT.
+void supervise(int server_fd, int workers, int max_requests) {
+    pid_t pids[MAX_WORKERS] = {0};
+    time_t started[MAX_WORKERS], respawn_at[MAX_WORKERS] = {0};
+
+    // The signals that end a wait stay blocked except inside sigsuspend, so
+    // one that arrives while the loop is busy is taken by the next wait
+    // instead of being lost
+    sigset_t wake_signals, old_mask;
+    sigemptyset(&wake_signals);
+    sigaddset(&wake_signals, SIGCHLD);
+    sigaddset(&wake_signals, SIGALRM);
+    sigaddset(&wake_signals, SIGTERM);
+    sigaddset(&wake_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &wake_signals, &old_mask);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = wake_supervisor; // A worker exited, or a delayed respawn is due
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+
+    for (;;) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < workers; ++i) {
+                if (pids[i] != pid) continue;
+                pids[i] = 0;
+                respawn_at[i] = 0;
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0) break; // Recycled
+
+                char msg[128];
+                if (WIFSIGNALED(status)) {
+                    snprintf(msg, sizeof(msg), "[%s] Worker PID %d killed by signal %d, respawning",
+                             get_timestamp(), pid, WTERMSIG(status));
+                } else {
+                    snprintf(msg, sizeof(msg), "[%s] Worker PID %d exited with status %d, respawning",
+                             get_timestamp(), pid, WEXITSTATUS(status));
+                }
+                printf("%s\n", msg);
+                log_to_file(msg);
+                // Do not spin on a worker that crashes at once
+                if (time(NULL) - started[i] < RESPAWN_MIN_LIFETIME) respawn_at[i] = time(NULL) + RESPAWN_MIN_LIFETIME;
+                break;
+            }
+        }
+        if (stop_requested) break;
+
+        int vacant = 0;
+        time_t now = time(NULL);
+        for (int i = 0; i < workers; ++i) {
+            if (pids[i] > 0) continue;
+            if (now >= respawn_at[i]) {
+                pids[i] = spawn_worker(server_fd, max_requests, &old_mask);
+                started[i] = now;
+                respawn_at[i] = now + 1; // If the fork failed
+            }
+            if (pids[i] <= 0) vacant = 1;
+        }
+
+        if (vacant) alarm(1);
+        sigsuspend(&old_mask);
+        alarm(0);
+    }
+
+    for (int i = 0; i < workers; ++i) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0) {
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+int main(int argc, char *argv[]) {
     int server_fd, new_socket;
     struct sockaddr_in address;
     socklen_t addrlen = sizeof(address);
+    int workers = DEFAULT_WORKERS, max_requests = 0, prefork = 0;
+
+    struct option long_options[] = {
+        {"workers", required_argument, 0, 'w'},
+        {"max-requests", required_argument, 0, 'm'},
+        {"prefork", no_argument, 0, 'P'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:m:P", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'm':
+                max_requests = atoi(optarg);
+                break;
+            case 'P':
+                prefork = 1;
+                break;
+            default:
+                workers = 0;
+        }
+    }
+    if (workers < 1 || workers > MAX_WORKERS || max_requests < 0) {
+        fprintf(stderr, "Usage: %s [--prefork [--workers <n>] [--max-requests <n>]]\n", argv[0]);
+        fprintf(stderr, "  --prefork       Serve from a pool of pre-forked workers instead of forking for every connection\n");
+        fprintf(stderr, "  --workers       Pre-forked processes, 1-%d (default %d). Each serves one client at a time, so\n",
+                MAX_WORKERS, DEFAULT_WORKERS);
+        fprintf(stderr, "                  this many sessions run at once and further clients wait for one to end\n");
+        fprintf(stderr, "  --max-requests  Requests a worker serves before it is replaced (default 0, no limit)\n");
+        exit(1);
+    }
 
-    signal(SIGCHLD, SIG_IGN); // Prevent zombies
+    if (!prefork) signal(SIGCHLD, SIG_IGN); // Prevent zombies
 
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == 0) {
@@ -103,7 +285,7 @@ int main() {
         exit(1);
     }
 
-    if (listen(server_fd, 5) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
         close(server_fd);
         exit(1);
@@ -111,6 +293,19 @@ int main() {
 
     printf("Concurrent TCP Calculator Server listening on port %d...\n", PORT);
 
+    if (prefork) {
+        shared_client_count = mmap(NULL, sizeof(*shared_client_count), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared_client_count == MAP_FAILED) {
+            perror("mmap failed");
+            exit(1);
+        }
+        printf("Serving with %d pre-forked workers.\n", workers);
+        supervise(server_fd, workers, max_requests);
+        close(server_fd);
+        return 0;
+    }
+
     while (1) {
         new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
         if (new_socket < 0) {
@@ -1,4 +1,5 @@
 // aio_udp_server.c
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,11 +7,15 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <time.h>
+#include <errno.h>
+#include <getopt.h>
 
 #define PORT 9090
 #define BUF_SIZE 1024
 #define MAX_EVENTS 10
+#define MAX_BATCH_IO 64 // Most datagrams one recvmmsg/sendmmsg call moves
 
 void log_message(const char *msg) {
     FILE *logfile = fopen("server.log", "a");
@@ -30,9 +35,110 @@ int make_socket_non_blocking(int sockfd) {
     return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
 }
 
-int main() {
+// Answers one "<choice> <a> <b>" request into response (BUF_SIZE bytes)
+void answer_request(const char *buffer, char *response) {
+    int choice;
+    double a, b, result;
+
+    sscanf(buffer, "%d %lf %lf", &choice, &a, &b);
+
+    if (choice == 5) {
+        snprintf(response, BUF_SIZE, "Goodbye!");
+        return;
+    }
+    switch (choice) {
+        case 1: result = a + b; break;
+        case 2: result = a - b; break;
+        case 3: result = a * b; break;
+        case 4:
+            if (b == 0) {
+                snprintf(response, BUF_SIZE, "Division by zero!");
+                return;
+            }
+            result = a / b;
+            break;
+        default:
+            snprintf(response, BUF_SIZE, "Invalid operation");
+            return;
+    }
+    snprintf(response, BUF_SIZE, "Result: %.2lf", result);
+}
+
+// Reads up to batch_io waiting datagrams with one recvmmsg, answers them and
+// sends the replies with one sendmmsg. Logs once per batch rather than once
+// per request. Returns how many were answered.
+int serve_batch(int sockfd, int batch_io) {
+    static char buffers[MAX_BATCH_IO][BUF_SIZE];
+    static char responses[MAX_BATCH_IO][BUF_SIZE];
+    struct sockaddr_in addrs[MAX_BATCH_IO];
+    struct iovec in_iov[MAX_BATCH_IO], out_iov[MAX_BATCH_IO];
+    struct mmsghdr in_msgs[MAX_BATCH_IO], out_msgs[MAX_BATCH_IO];
+
+    memset(in_msgs, 0, batch_io * sizeof(in_msgs[0]));
+    for (int i = 0; i < batch_io; ++i) {
+        in_iov[i].iov_base = buffers[i];
+        in_iov[i].iov_len = BUF_SIZE - 1;
+        in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+        in_msgs[i].msg_hdr.msg_iovlen = 1;
+        in_msgs[i].msg_hdr.msg_name = &addrs[i];
+        in_msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    int received = recvmmsg(sockfd, in_msgs, batch_io, 0, NULL);
+    if (received <= 0) return 0;
+
+    memset(out_msgs, 0, received * sizeof(out_msgs[0]));
+    for (int i = 0; i < received; ++i) {
+        buffers[i][in_msgs[i].msg_len] = '\0';
+        answer_request(buffers[i], responses[i]);
+        out_iov[i].iov_base = responses[i];
+        out_iov[i].iov_len = strlen(responses[i]);
+        out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+        out_msgs[i].msg_hdr.msg_name = &addrs[i];
+        out_msgs[i].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+    }
+    // sendmmsg stops at the first reply it cannot send; that one is dropped,
+    // like a lost datagram, and the rest still go out
+    for (int sent = 0; sent < received;) {
+        int n = sendmmsg(sockfd, out_msgs + sent, received - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            n = 1;
+        }
+        sent += n;
+    }
+
+    char logbuf[64];
+    snprintf(logbuf, sizeof(logbuf), "Answered a batch of %d requests", received);
+    log_message(logbuf);
+    return received;
+}
+
+int main(int argc, char *argv[]) {
     int sockfd, epfd;
     struct sockaddr_in server_addr;
+    int batch_io = 1;
+
+    struct option long_options[] = {
+        {"batch-io", required_argument, 0, 'n'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:", long_options, NULL)) != -1) {
+        if (opt == 'n') {
+            batch_io = atoi(optarg);
+        } else {
+            batch_io = 0;
+            break;
+        }
+    }
+    if (batch_io < 1 || batch_io > MAX_BATCH_IO) {
+        fprintf(stderr, "Usage: %s [--batch-io <n>]\n", argv[0]);
+        fprintf(stderr, "  --batch-io  Datagrams read per recvmmsg and answered per sendmmsg, 1-%d;\n"
+                        "              1 uses recvfrom/sendto and logs every request (default 1)\n", MAX_BATCH_IO);
+        exit(1);
+    }
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
@@ -65,12 +171,15 @@ int main() {
     epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
 
     printf("Async UDP server using epoll running on port %d...\n", PORT);
+    if (batch_io > 1) printf("Batched I/O: up to %d datagrams per recvmmsg/sendmmsg.\n", batch_io);
     log_message("Async server started.");
 
     while (1) {
         int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
         for (int i = 0; i < n; ++i) {
-            if (events[i].data.fd == sockfd) {
+            if (events[i].data.fd == sockfd && batch_io > 1) {
+                serve_batch(sockfd, batch_io);
+            } else if (events[i].data.fd == sockfd) {
                 char buffer[BUF_SIZE];
                 struct sockaddr_in client_addr;
                 socklen_t addr_len = sizeof(client_addr);
@@ -81,34 +190,9 @@ int main() {
 
                 buffer[bytes] = '\0';
 
-                int choice;
-                double a, b, result;
                 char response[BUF_SIZE];
+                answer_request(buffer, response);
 
-                sscanf(buffer, "%d %lf %lf", &choice, &a, &b);
-
-                if (choice == 5) {
-                    snprintf(response, sizeof(response), "Goodbye!");
-                } else {
-                    switch (choice) {
-                        case 1: result = a + b; break;
-                        case 2: result = a - b; break;
-                        case 3: result = a * b; break;
-                        case 4:
-                            if (b == 0) {
-                                snprintf(response, sizeof(response), "Division by zero!");
-                                goto send;
-                            }
-                            result = a / b;
-                            break;
-                        default:
-                            snprintf(response, sizeof(response), "Invalid operation");
-                            goto send;
-                    }
-                    snprintf(response, sizeof(response), "Result: %.2lf", result);
-                }
-
-            send:
                 sendto(sockfd, response, strlen(response), 0,
                        (struct sockaddr *)&client_addr, addr_len);
 
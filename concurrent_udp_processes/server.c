@@ -3,7 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -11,14 +17,53 @@
 
 #define PORT 9090
 #define BUF_SIZE 1024
+#define MAX_WORKERS 256
+#define RESPAWN_MIN_LIFETIME 1 // Seconds; a worker that crashes sooner is respawned this much later
+
+static _Atomic int *shared_client_count; // Client ids across pre-forked workers
+static volatile sig_atomic_t stop_requested = 0;
 
 void handle_client(struct sockaddr_in client_addr, char *initial_msg);
+void supervise(int sockfd, int workers, int max_requests);
 
-int main() {
+int main(int argc, char *argv[]) {
     int sockfd;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_len = sizeof(client_addr);
     char buffer[BUF_SIZE];
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores < 1 ? 1 : cores > MAX_WORKERS ? MAX_WORKERS : (int)cores;
+    int max_requests = 0, prefork = 0;
+
+    struct option long_options[] = {
+        {"workers", required_argument, 0, 'w'},
+        {"max-requests", required_argument, 0, 'm'},
+        {"prefork", no_argument, 0, 'P'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:m:P", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'm':
+                max_requests = atoi(optarg);
+                break;
+            case 'P':
+                prefork = 1;
+                break;
+            default:
+                workers = 0;
+        }
+    }
+    if (workers < 1 || workers > MAX_WORKERS || max_requests < 0) {
+        fprintf(stderr, "Usage: %s [--prefork [--workers <n>] [--max-requests <n>]]\n", argv[0]);
+        fprintf(stderr, "  --prefork       Answer from a pool of pre-forked workers instead of forking for every datagram\n");
+        fprintf(stderr, "  --workers       Pre-forked processes sharing the socket, 1-%d (default: one per core)\n", MAX_WORKERS);
+        fprintf(stderr, "  --max-requests  Requests a worker answers before it is replaced (default 0, no limit)\n");
+        exit(1);
+    }
 
     // Create UDP socket
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -39,6 +84,19 @@ int main() {
 
     printf("UDP Server listening on port %d...\n", PORT);
 
+    if (prefork) {
+        shared_client_count = mmap(NULL, sizeof(*shared_client_count), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared_client_count == MAP_FAILED) {
+            perror("mmap failed");
+            exit(1);
+        }
+        printf("Answering with %d pre-forked workers.\n", workers);
+        supervise(sockfd, workers, max_requests);
+        close(sockfd);
+        return 0;
+    }
+
     while (1) {
         int n = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
         if (n < 0) continue;
@@ -57,6 +115,36 @@ int main() {
     return 0;
 }
 
+// Writes the reply to one request into buffer. Returns 1 if the client asked
+// to end its session.
+int answer_request(const char *msg, char *buffer, int client_id) {
+    int choice;
+    double a, b, result;
+    sscanf(msg, "%d %lf %lf", &choice, &a, &b);
+
+    switch (choice) {
+        case 1: result = a + b; break;
+        case 2: result = a - b; break;
+        case 3: result = a * b; break;
+        case 4:
+            if (b == 0) {
+                snprintf(buffer, BUF_SIZE, "Error: Division by zero.");
+                return 0;
+            }
+            result = a / b;
+            break;
+        case 5:
+            snprintf(buffer, BUF_SIZE, "Client #%d disconnected gracefully.", client_id);
+            return 1;
+        default:
+            snprintf(buffer, BUF_SIZE, "Invalid operation.");
+            return 0;
+    }
+
+    snprintf(buffer, BUF_SIZE, "Client #%d result: %.2lf", client_id, result);
+    return 0;
+}
+
 void handle_client(struct sockaddr_in client_addr, char *initial_msg) {
     char buffer[BUF_SIZE];
     int sockfd;
@@ -75,39 +163,10 @@ void handle_client(struct sockaddr_in client_addr, char *initial_msg) {
            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
     while (1) {
-        int choice;
-        double a, b, result;
-        sscanf(initial_msg, "%d %lf %lf", &choice, &a, &b);
-
-        if (choice == 5) {
-            snprintf(buffer, BUF_SIZE, "Client #%d disconnected gracefully.", client_id);
-            sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
-            break;
-        }
-
-        switch (choice) {
-            case 1: result = a + b; break;
-            case 2: result = a - b; break;
-            case 3: result = a * b; break;
-            case 4:
-                if (b == 0) {
-                    snprintf(buffer, BUF_SIZE, "Error: Division by zero.");
-                    sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
-                    goto receive_next;
-                } else {
-                    result = a / b;
-                }
-                break;
-            default:
-                snprintf(buffer, BUF_SIZE, "Invalid operation.");
-                sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
-                goto receive_next;
-        }
-
-        snprintf(buffer, BUF_SIZE, "Client #%d result: %.2lf", client_id, result);
+        int done = answer_request(initial_msg, buffer, client_id);
         sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
+        if (done) break;
 
-    receive_next:
         int n = recvfrom(sockfd, buffer, BUF_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
         if (n <= 0) break;
         buffer[n] = '\0';
@@ -119,3 +178,130 @@ void handle_client(struct sockaddr_in client_addr, char *initial_msg) {
     printf("Client #%d session ended. Duration: %.0f seconds.\n", client_id, duration);
     close(sockfd);
 }
+
+// Pre-forked worker: answers datagrams from the shared socket, replying from
+// it as well. Exits after max_requests requests (0 for no limit) so the
+// supervisor can replace it.
+void worker_main(int sockfd, int max_requests) {
+    char buffer[BUF_SIZE], reply[BUF_SIZE];
+    struct sockaddr_in client_addr;
+
+    int served = 0;
+
+    while (!max_requests || served < max_requests) {
+        socklen_t addr_len = sizeof(client_addr);
+        int n = recvfrom(sockfd, buffer, BUF_SIZE - 1, 0, (struct sockaddr *)&client_addr, &addr_len);
+        if (n < 0) continue;
+        buffer[n] = '\0';
+        served++;
+
+        int client_id = atomic_fetch_add(shared_client_count, 1) + 1;
+        printf("Client #%d connected [%s:%d] (PID %d)\n", client_id,
+               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), getpid());
+        answer_request(buffer, reply, client_id);
+        sendto(sockfd, reply, strlen(reply), 0, (struct sockaddr *)&client_addr, addr_len);
+    }
+    exit(0);
+}
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void wake_supervisor(int sig) {
+    (void)sig;
+}
+
+static pid_t spawn_worker(int sockfd, int max_requests, const sigset_t *worker_mask) {
+    pid_t supervisor = getpid();
+    fflush(stdout); // Not to be repeated by the worker
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        sigprocmask(SIG_SETMASK, worker_mask, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // Do not outlive the supervisor
+        if (getppid() != supervisor) exit(0);
+        setvbuf(stdout, NULL, _IOLBF, 0); // Whole lines, when workers share a redirected stdout
+        worker_main(sockfd, max_requests);
+    }
+    if (pid < 0) perror("Fork failed");
+    return pid;
+}
+
+// Supervisor: keeps `workers` processes reading sockfd, replacing any that
+// exit (recycled after max_requests, or crashed). Stops them all on SIGTERM
+// or SIGINT.
+void supervise(int sockfd, int workers, int max_requests) {
+    pid_t pids[MAX_WORKERS] = {0};
+    time_t started[MAX_WORKERS], respawn_at[MAX_WORKERS] = {0};
+
+    // The signals that end a wait stay blocked except inside sigsuspend, so
+    // one that arrives while the loop is busy is taken by the next wait
+    // instead of being lost
+    sigset_t wake_signals, old_mask;
+    sigemptyset(&wake_signals);
+    sigaddset(&wake_signals, SIGCHLD);
+    sigaddset(&wake_signals, SIGALRM);
+    sigaddset(&wake_signals, SIGTERM);
+    sigaddset(&wake_signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &wake_signals, &old_mask);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = wake_supervisor; // A worker exited, or a delayed respawn is due
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+
+    for (;;) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < workers; ++i) {
+                if (pids[i] != pid) continue;
+                pids[i] = 0;
+                respawn_at[i] = 0;
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0) break; // Recycled
+
+                if (WIFSIGNALED(status)) {
+                    printf("Worker PID %d killed by signal %d, respawning\n", pid, WTERMSIG(status));
+                } else {
+                    printf("Worker PID %d exited with status %d, respawning\n", pid, WEXITSTATUS(status));
+                }
+                // Do not spin on a worker that crashes at once
+                if (time(NULL) - started[i] < RESPAWN_MIN_LIFETIME) respawn_at[i] = time(NULL) + RESPAWN_MIN_LIFETIME;
+                break;
+            }
+        }
+        if (stop_requested) break;
+
+        int vacant = 0;
+        time_t now = time(NULL);
+        for (int i = 0; i < workers; ++i) {
+            if (pids[i] > 0) continue;
+            if (now >= respawn_at[i]) {
+                pids[i] = spawn_worker(sockfd, max_requests, &old_mask);
+                started[i] = now;
+                respawn_at[i] = now + 1; // If the fork failed
+            }
+            if (pids[i] <= 0) vacant = 1;
+        }
+
+        if (vacant) alarm(1);
+        sigsuspend(&old_mask);
+        alarm(0);
+    }
+
+    for (int i = 0; i < workers; ++i) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0) {
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
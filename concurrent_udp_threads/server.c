@@ -4,11 +4,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 #include <time.h>
 
 #define PORT 9090
 #define BUF_SIZE 1024
+#define REQUEST_POOL_SIZE 1024 // Requests received and not yet answered; a power of two
+#define MAX_WORKERS 256
+#define CACHE_LINE 64
 
 typedef struct {
     struct sockaddr_in client_addr;
@@ -18,9 +27,32 @@ typedef struct {
     int sockfd;  // Socket descriptor passed to thread
 } ClientRequest;
 
+// Bounded MPMC queue of requests (D. Vyukov's array queue). Each cell's
+// sequence number says whether it is ready to be written or read for a given
+// position, so producers and consumers claim positions with one CAS and
+// never take a lock. The semaphore counts queued requests, letting an empty
+// queue's consumers sleep instead of spin.
+typedef struct {
+    _Atomic size_t sequence;
+    ClientRequest *request;
+} RingCell;
+
+typedef struct {
+    RingCell cells[REQUEST_POOL_SIZE];
+    _Alignas(CACHE_LINE) _Atomic size_t enqueue_pos;
+    _Alignas(CACHE_LINE) _Atomic size_t dequeue_pos;
+    sem_t items;
+} RequestRing;
+
+_Static_assert((REQUEST_POOL_SIZE & (REQUEST_POOL_SIZE - 1)) == 0, "REQUEST_POOL_SIZE must be a power of two");
+
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 int client_counter = 0;
 
+static ClientRequest request_pool[REQUEST_POOL_SIZE]; // Every request the pool mode ever uses
+static RequestRing free_ring; // Pool requests ready to receive into
+static RequestRing work_ring; // Received requests waiting for a worker
+
 void log_message(const char *msg) {
     pthread_mutex_lock(&log_mutex);
 
@@ -43,9 +75,74 @@ void log_message(const char *msg) {
     pthread_mutex_unlock(&log_mutex);
 }
 
-void *handle_request(void *arg) {
-    ClientRequest *req = (ClientRequest *)arg;
+void ring_init(RequestRing *ring) {
+    for (size_t i = 0; i < REQUEST_POOL_SIZE; ++i) atomic_init(&ring->cells[i].sequence, i);
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    sem_init(&ring->items, 0, 0);
+}
+
+// Returns -1 if the ring is full
+int ring_try_push(RequestRing *ring, ClientRequest *req) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    RingCell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & (REQUEST_POOL_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->request = req;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
 
+// Returns NULL if the ring is empty, or its next request is still being written
+ClientRequest *ring_try_pop(RequestRing *ring) {
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    RingCell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & (REQUEST_POOL_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    ClientRequest *req = cell->request;
+    atomic_store_explicit(&cell->sequence, pos + REQUEST_POOL_SIZE, memory_order_release);
+    return req;
+}
+
+// Both rings hold at most the REQUEST_POOL_SIZE pool requests, so a push
+// only finds the ring full while a pop of the same cell is finishing
+void ring_put(RequestRing *ring, ClientRequest *req) {
+    while (ring_try_push(ring, req) < 0) sched_yield();
+    sem_post(&ring->items);
+}
+
+// Waits for a request. The semaphore guarantees one is queued; a pop can
+// still miss it briefly while its producer finishes writing the cell.
+ClientRequest *ring_take(RequestRing *ring) {
+    while (sem_wait(&ring->items) < 0 && errno == EINTR) {
+    }
+    ClientRequest *req;
+    while (!(req = ring_try_pop(ring))) sched_yield();
+    return req;
+}
+
+// Answers one request and logs it. Returns 1 if the client asked to exit.
+int process_request(ClientRequest *req) {
     int choice;
     double a, b, result;
     char response[BUF_SIZE];
@@ -68,9 +165,7 @@ void *handle_request(void *arg) {
                  "Client #%d exited gracefully. Duration: %.2f seconds.",
                  req->client_id, duration);
         log_message(logbuf);
-
-        free(req);
-        pthread_exit(NULL);
+        return 1;
     }
 
     switch (choice) {
@@ -110,15 +205,96 @@ void *handle_request(void *arg) {
              "Request from Client #%d (%s:%d): \"%s\" -> %s",
              req->client_id, client_ip, client_port, req->buffer, response);
     log_message(logbuf);
+    return 0;
+}
 
+// Thread-per-request mode: a detached thread for one malloc'd request
+void *handle_request(void *arg) {
+    ClientRequest *req = (ClientRequest *)arg;
+    process_request(req);
     free(req);
     pthread_exit(NULL);
 }
 
-int main() {
+// Pool mode: answers queued requests and returns them to the pool
+void *worker_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        ClientRequest *req = ring_take(&work_ring);
+        process_request(req);
+        ring_put(&free_ring, req);
+    }
+    return NULL;
+}
+
+// Receive loop for pool mode. Blocks while every pool request is queued or
+// being answered, leaving new datagrams in the socket buffer.
+void serve_with_pool(int sockfd, int workers) {
+    ring_init(&free_ring);
+    ring_init(&work_ring);
+    for (int i = 0; i < REQUEST_POOL_SIZE; ++i) ring_put(&free_ring, &request_pool[i]);
+
+    for (int i = 0; i < workers; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+            perror("Failed to create worker thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+
+    while (1) {
+        ClientRequest *req = ring_take(&free_ring);
+        socklen_t addr_len = sizeof(req->client_addr);
+        int n = recvfrom(sockfd, req->buffer, BUF_SIZE - 1, 0,
+                         (struct sockaddr *)&req->client_addr, &addr_len);
+        if (n < 0) {
+            perror("recvfrom error");
+            ring_put(&free_ring, req);
+            continue;
+        }
+
+        req->buffer[n] = '\0'; // Null terminate
+        req->start_time = time(NULL);
+        req->sockfd = sockfd;
+        // Only this thread assigns ids
+        req->client_id = ++client_counter;
+        ring_put(&work_ring, req);
+    }
+}
+
+int main(int argc, char *argv[]) {
     int sockfd;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_len = sizeof(client_addr);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores < 1 ? 1 : cores > MAX_WORKERS ? MAX_WORKERS : (int)cores;
+    int thread_per_request = 0;
+
+    struct option long_options[] = {
+        {"workers", required_argument, 0, 'w'},
+        {"thread-per-request", no_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:t", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 't':
+                thread_per_request = 1;
+                break;
+            default:
+                workers = 0;
+        }
+    }
+    if (workers < 1 || workers > MAX_WORKERS) {
+        fprintf(stderr, "Usage: %s [--workers <n>] [--thread-per-request]\n", argv[0]);
+        fprintf(stderr, "  --workers             Threads answering requests, 1-%d (default: one per core)\n", MAX_WORKERS);
+        fprintf(stderr, "  --thread-per-request  Start a thread for every datagram instead, as before the pool\n");
+        exit(EXIT_FAILURE);
+    }
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
@@ -140,6 +316,11 @@ int main() {
     printf("UDP Concurrent Server running on port %d...\n", PORT);
     log_message("Server started.");
 
+    if (!thread_per_request) {
+        printf("Answering with %d worker threads.\n", workers);
+        serve_with_pool(sockfd, workers);
+    }
+
     while (1) {
         ClientRequest *req = malloc(sizeof(ClientRequest));
         if (!req) {
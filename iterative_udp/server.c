@@ -1,4 +1,5 @@
 // udp_server.c
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +8,32 @@
 #include <getopt.h> // Added for getopt_long
 #include <errno.h> // Added for errno
 #include <time.h>   // Added for timestamp logging
+#include <poll.h>   // Wait for requests or the next heartbeat
+#include <signal.h> // Deregister from the gateway on SIGINT/SIGTERM
+#include <sys/socket.h>
+#include "../json_rpc/calc_proto.h" // Binary requests from the gateway
 
 // #define PORT 8080 // Will be set by command line argument
-#define BUF_SIZE 1024
+#define BUF_SIZE 2048 // Fits a full bin1 batch request datagram
+#define DEFAULT_HEARTBEAT_MS 3000 // How often the registration is re-sent to the gateway
+#define LEASE_HEARTBEATS 3 // The gateway drops this server after missing this many heartbeats
+#define MAX_BATCH_IO 64 // Most datagrams one recvmmsg/sendmmsg call moves
+#define REPLY_SIZE (CALC_MAX_REPLY_SIZE > 128 ? CALC_MAX_REPLY_SIZE : 128) // Largest bin1 or text reply
+
+_Static_assert(BUF_SIZE - 1 >= CALC_MAX_REQUEST_SIZE, "receive buffer must hold a batch request");
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 // Function for logging with timestamp (similar to TCP server)
 void log_with_timestamp(const char *msg) {
@@ -20,6 +44,104 @@ void log_with_timestamp(const char *msg) {
     printf("[%s] %s\n", buf, msg);
 }
 
+// Answers one request datagram, bin1 or text, into reply (REPLY_SIZE bytes)
+// and returns the reply length. Verbose logs each step, as the one-datagram
+// path always has; the batched path logs per batch instead.
+size_t answer_datagram(const char *buffer, int n, char *reply, int verbose) {
+    if (calc_is_binary(buffer, n)) {
+        // A bin1 frame from the gateway; text clients never send the magic byte
+        return calc_handle_frame((const unsigned char *)buffer, n, (unsigned char *)reply);
+    }
+
+    int choice;
+    double a, b, result;
+    if (sscanf(buffer, "%d %lf %lf", &choice, &a, &b) != 3) {
+        if (verbose) log_with_timestamp("Sending error response for invalid input format.");
+        return snprintf(reply, REPLY_SIZE, "Invalid input format. Expected: <choice> <num1> <num2>");
+    }
+
+    // Handle operation
+    if (choice == 5) {
+        if (verbose) log_with_timestamp("Client requested exit.");
+        return snprintf(reply, REPLY_SIZE, "Goodbye.");
+    }
+
+    if (verbose) {
+        char calc_log[100];
+        snprintf(calc_log, sizeof(calc_log), "Performing operation %d for %lf and %lf", choice, a,b);
+        log_with_timestamp(calc_log);
+    }
+
+    switch (choice) {
+        case 1: result = a + b; break;
+        case 2: result = a - b; break;
+        case 3: result = a * b; break;
+        case 4:
+            if (b == 0) {
+                if (verbose) log_with_timestamp("Error: Division by zero.");
+                return snprintf(reply, REPLY_SIZE, "Error: Division by zero");
+            }
+            result = a / b;
+            break;
+        default:
+            if (verbose) log_with_timestamp("Invalid operation choice received.");
+            return snprintf(reply, REPLY_SIZE, "Invalid operation choice.");
+    }
+
+    // Send result
+    if (verbose) log_with_timestamp("Sending result to client.");
+    return snprintf(reply, REPLY_SIZE, "Result: %.2lf", result);
+}
+
+// Reads every datagram waiting, up to batch_io of them, with one recvmmsg,
+// answers them and sends the replies with one sendmmsg. Returns how many
+// were answered.
+int serve_batch(int sockfd, int batch_io) {
+    static char buffers[MAX_BATCH_IO][BUF_SIZE];
+    static char replies[MAX_BATCH_IO][REPLY_SIZE];
+    struct sockaddr_in addrs[MAX_BATCH_IO];
+    struct iovec in_iov[MAX_BATCH_IO], out_iov[MAX_BATCH_IO];
+    struct mmsghdr in_msgs[MAX_BATCH_IO], out_msgs[MAX_BATCH_IO];
+
+    memset(in_msgs, 0, batch_io * sizeof(in_msgs[0]));
+    for (int i = 0; i < batch_io; ++i) {
+        in_iov[i].iov_base = buffers[i];
+        in_iov[i].iov_len = BUF_SIZE - 1;
+        in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+        in_msgs[i].msg_hdr.msg_iovlen = 1;
+        in_msgs[i].msg_hdr.msg_name = &addrs[i];
+        in_msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    int received = recvmmsg(sockfd, in_msgs, batch_io, MSG_DONTWAIT, NULL);
+    if (received <= 0) {
+        if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("recvmmsg error");
+        return 0;
+    }
+
+    memset(out_msgs, 0, received * sizeof(out_msgs[0]));
+    for (int i = 0; i < received; ++i) {
+        int n = in_msgs[i].msg_len;
+        buffers[i][n] = '\0';
+        out_iov[i].iov_base = replies[i];
+        out_iov[i].iov_len = answer_datagram(buffers[i], n, replies[i], 0);
+        out_msgs[i].msg_hdr.msg_iov = &out_iov[i];
+        out_msgs[i].msg_hdr.msg_iovlen = 1;
+        out_msgs[i].msg_hdr.msg_name = &addrs[i];
+        out_msgs[i].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+    }
+    // sendmmsg stops at the first reply it cannot send; that one is dropped,
+    // like a lost datagram, and the rest still go out
+    for (int sent = 0; sent < received;) {
+        int n = sendmmsg(sockfd, out_msgs + sent, received - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("sendmmsg error");
+            n = 1;
+        }
+        sent += n;
+    }
+    return received;
+}
 
 int main(int argc, char *argv[]) { // Added argc and argv
     int sockfd;
@@ -32,6 +154,8 @@ int main(int argc, char *argv[]) { // Added argc and argv
     char *my_host = NULL;
     int my_port = -1;
     char *server_name = NULL;
+    int heartbeat_ms = DEFAULT_HEARTBEAT_MS;
+    int batch_io = 1;
 
     // Parse command line arguments
     struct option long_options[] = {
@@ -40,11 +164,13 @@ int main(int argc, char *argv[]) { // Added argc and argv
         {"my-host", required_argument, 0, 'h'},
         {"my-port", required_argument, 0, 'm'},
         {"server-name", required_argument, 0, 's'},
+        {"heartbeat-ms", required_argument, 0, 'b'},
+        {"batch-io", required_argument, 0, 'n'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "g:p:h:m:s:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "g:p:h:m:s:b:n:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'g':
                 gateway_host = optarg;
@@ -61,15 +187,25 @@ int main(int argc, char *argv[]) { // Added argc and argv
             case 's':
                 server_name = optarg;
                 break;
+            case 'b':
+                heartbeat_ms = atoi(optarg);
+                break;
+            case 'n':
+                batch_io = atoi(optarg);
+                break;
             default:
-                fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name>\n", argv[0]);
+                fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name> [--heartbeat-ms <ms>] [--batch-io <n>]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    if (!gateway_host || gateway_port == -1 || !my_host || my_port == -1 || !server_name) {
+    if (!gateway_host || gateway_port == -1 || !my_host || my_port == -1 || !server_name || heartbeat_ms < 0 ||
+        batch_io < 1 || batch_io > MAX_BATCH_IO) {
         fprintf(stderr, "Missing required arguments.\n");
-        fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s --gateway-host <host> --gateway-port <port> --my-host <host> --my-port <port> --server-name <name> [--heartbeat-ms <ms>] [--batch-io <n>]\n", argv[0]);
+        fprintf(stderr, "  --heartbeat-ms  Re-send the registration this often, 0 to register only once (default %d)\n", DEFAULT_HEARTBEAT_MS);
+        fprintf(stderr, "  --batch-io      Datagrams read per recvmmsg and answered per sendmmsg, 1-%d;\n"
+                        "                  1 uses recvfrom/sendto and logs every request (default 1)\n", MAX_BATCH_IO);
         exit(EXIT_FAILURE);
     }
     log_with_timestamp("Server starting with provided arguments.");
@@ -111,13 +247,18 @@ int main(int argc, char *argv[]) { // Added argc and argv
     snprintf(log_msg, sizeof(log_msg), "UDP server listening on %s:%d...", my_host, my_port);
     log_with_timestamp(log_msg);
 
-    // Register with gateway using a new temporary UDP socket
+    // Register with gateway using a separate UDP socket, kept open for
+    // heartbeats and the deregistration on shutdown
     int reg_sock;
     struct sockaddr_in gateway_addr_reg; // Use a different name to avoid conflict
     char reg_msg[512];
+    char dereg_msg[256];
 
-    snprintf(reg_msg, sizeof(reg_msg), "type=UDP;host=%s;port=%d;name=%s;ops=add,subtract,multiply,divide",
-             my_host, my_port, server_name);
+    // With heartbeats on, the gateway expires the registration (its lease)
+    // once LEASE_HEARTBEATS of them in a row are missing
+    snprintf(reg_msg, sizeof(reg_msg), "type=UDP;host=%s;port=%d;name=%s;ops=add,subtract,multiply,divide;lease_ms=%lld;proto=%s;batch=%d",
+             my_host, my_port, server_name, (long long)heartbeat_ms * LEASE_HEARTBEATS, CALC_PROTO_NAME, CALC_BATCH_MAX);
+    snprintf(dereg_msg, sizeof(dereg_msg), "action=deregister;name=%s", server_name);
 
     if ((reg_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Temporary UDP socket creation for registration failed");
@@ -132,6 +273,7 @@ int main(int argc, char *argv[]) { // Added argc and argv
             perror("Invalid gateway address for registration");
             log_with_timestamp("Proceeding without gateway registration due to invalid gateway address.");
             close(reg_sock);
+            reg_sock = -1;
         } else {
             log_with_timestamp("Attempting to register with gateway...");
             if (sendto(reg_sock, reg_msg, strlen(reg_msg), 0, (const struct sockaddr *)&gateway_addr_reg, sizeof(gateway_addr_reg)) < 0) {
@@ -144,14 +286,47 @@ int main(int argc, char *argv[]) { // Added argc and argv
                 snprintf(success_log, sizeof(success_log), "Registration message sent to %s:%d: %s", gateway_host, gateway_port, reg_msg);
                 log_with_timestamp(success_log);
             }
-            close(reg_sock); // Close the temporary socket
         }
     }
+    long long next_heartbeat_ms = monotonic_ms() + heartbeat_ms;
+
+    // No SA_RESTART: the signal interrupts poll so the loop can exit
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
 
 
     log_with_timestamp("UDP Calculator Server is now fully running.");
 
-    while (1) {
+    while (!stop_requested) {
+        int timeout = -1;
+        if (reg_sock >= 0 && heartbeat_ms > 0) {
+            long long now = monotonic_ms();
+            if (now >= next_heartbeat_ms) {
+                if (sendto(reg_sock, reg_msg, strlen(reg_msg), 0, (const struct sockaddr *)&gateway_addr_reg, sizeof(gateway_addr_reg)) < 0) {
+                    char error_log[512];
+                    snprintf(error_log, sizeof(error_log), "Failed to send heartbeat to %s:%d. Error: %s", gateway_host, gateway_port, strerror(errno));
+                    log_with_timestamp(error_log);
+                }
+                next_heartbeat_ms = now + heartbeat_ms;
+            }
+            timeout = (int)(next_heartbeat_ms - now);
+        }
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout) <= 0) continue; // Heartbeat due, or interrupted
+
+        if (batch_io > 1) {
+            int answered = serve_batch(sockfd, batch_io);
+            if (answered > 0) {
+                char batch_log[64];
+                snprintf(batch_log, sizeof(batch_log), "Answered a batch of %d requests.", answered);
+                log_with_timestamp(batch_log);
+            }
+            continue;
+        }
+
         // Receive message
         memset(buffer, 0, BUF_SIZE); // Clear buffer before receiving
         int n = recvfrom(sockfd, buffer, BUF_SIZE -1 , 0, (struct sockaddr *)&client_addr, &addr_len);
@@ -165,61 +340,24 @@ int main(int argc, char *argv[]) { // Added argc and argv
         char client_ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
         char recv_log[BUF_SIZE + 100];
-        snprintf(recv_log, sizeof(recv_log), "Received from %s:%d - %s", client_ip, ntohs(client_addr.sin_port), buffer);
-        log_with_timestamp(recv_log);
-
-
-        int choice;
-        double a, b, result;
-        // sscanf(buffer, "%d %lf %lf", &choice, &a, &b); // Original sscanf
-        if (sscanf(buffer, "%d %lf %lf", &choice, &a, &b) != 3) {
-            char err_resp[100];
-            snprintf(err_resp, sizeof(err_resp), "Invalid input format. Expected: <choice> <num1> <num2>");
-            log_with_timestamp("Sending error response for invalid input format.");
-            sendto(sockfd, err_resp, strlen(err_resp), 0, (struct sockaddr *)&client_addr, addr_len);
-            continue;
-        }
-
-
-        // Handle operation
-        if (choice == 5) {
-            log_with_timestamp("Client requested exit.");
-            char exit_resp[] = "Goodbye.";
-            sendto(sockfd, exit_resp, strlen(exit_resp), 0, (struct sockaddr *)&client_addr, addr_len);
-            continue;
-        }
-
-        char calc_log[100];
-        snprintf(calc_log, sizeof(calc_log), "Performing operation %d for %lf and %lf", choice, a,b);
-        log_with_timestamp(calc_log);
-
-        switch (choice) {
-            case 1: result = a + b; break;
-            case 2: result = a - b; break;
-            case 3: result = a * b; break;
-            case 4:
-                if (b == 0) {
-                    log_with_timestamp("Error: Division by zero.");
-                    snprintf(buffer, BUF_SIZE, "Error: Division by zero");
-                    sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
-                    continue;
-                }
-                result = a / b;
-                break;
-            default:
-                log_with_timestamp("Invalid operation choice received.");
-                snprintf(buffer, BUF_SIZE, "Invalid operation choice.");
-                sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
-                continue;
+        if (calc_is_binary(buffer, n)) {
+            snprintf(recv_log, sizeof(recv_log), "Received binary request from %s:%d", client_ip, ntohs(client_addr.sin_port));
+        } else {
+            snprintf(recv_log, sizeof(recv_log), "Received from %s:%d - %s", client_ip, ntohs(client_addr.sin_port), buffer);
         }
+        log_with_timestamp(recv_log);
 
-        // Send result
-        snprintf(buffer, BUF_SIZE, "Result: %.2lf", result);
-        log_with_timestamp("Sending result to client.");
-        sendto(sockfd, buffer, strlen(buffer), 0, (struct sockaddr *)&client_addr, addr_len);
+        char reply[REPLY_SIZE];
+        size_t reply_len = answer_datagram(buffer, n, reply, 1);
+        sendto(sockfd, reply, reply_len, 0, (struct sockaddr *)&client_addr, addr_len);
     }
 
     log_with_timestamp("UDP Server shutting down.");
+    if (reg_sock >= 0) {
+        log_with_timestamp("Deregistering from gateway.");
+        sendto(reg_sock, dereg_msg, strlen(dereg_msg), 0, (const struct sockaddr *)&gateway_addr_reg, sizeof(gateway_addr_reg));
+        close(reg_sock);
+    }
     close(sockfd);
     return 0;
 }
@@ -0,0 +1,203 @@
+// udp_bench.c
+// Load generator for the UDP calculator backends: keeps a window of requests
+// in flight on each of several sockets and reports the replies received per
+// second. Run it against a server started with --batch-io 1 (one
+// recvfrom/sendto per request) and with --batch-io 64 (recvmmsg/sendmmsg) to
+// compare the two. The generator itself sends and receives with
+// sendmmsg/recvmmsg so that it is not what limits the rate.
+//
+// Build and run with `make bench`, which starts the server in both modes, or
+// `./udp_bench [--port <port>] [--proto text|bin1] ...` against a running one.
+// concurrent_udp_async and concurrent_udp_threads build it from here for
+// their own `make bench`.
+#define _GNU_SOURCE // recvmmsg/sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../json_rpc/calc_proto.h"
+
+#define MAX_SOCKETS 64
+#define MAX_WINDOW 256
+#define REPLY_BUF_SIZE 256
+#define LOSS_TIMEOUT_MS 100 // Requests still unanswered after this long with no reply are counted lost
+
+typedef struct {
+    int fd;
+    int in_flight;
+    long long last_reply_ms;
+} BenchSocket;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Sends count requests on a connected socket in one sendmmsg. Returns how
+// many went out.
+static int send_requests(int fd, int count, int binary, uint32_t *next_id) {
+    static unsigned char frames[MAX_WINDOW][CALC_REQUEST_SIZE];
+    static char texts[MAX_WINDOW][64];
+    struct iovec iov[MAX_WINDOW];
+    struct mmsghdr msgs[MAX_WINDOW];
+
+    memset(msgs, 0, count * sizeof(msgs[0]));
+    for (int i = 0; i < count; ++i) {
+        uint32_t id = (*next_id)++;
+        int op = 1 + id % 4;
+        double a = id % 1000, b = 1 + id % 7;
+        if (binary) {
+            calc_encode_request(frames[i], id, op, a, b);
+            iov[i].iov_base = frames[i];
+            iov[i].iov_len = CALC_REQUEST_SIZE;
+        } else {
+            iov[i].iov_base = texts[i];
+            iov[i].iov_len = snprintf(texts[i], sizeof(texts[i]), "%d %.0f %.0f", op, a, b);
+        }
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(fd, msgs, count, 0);
+    return sent < 0 ? 0 : sent;
+}
+
+// Reads every reply waiting on a socket. Returns how many there were.
+static int drain_replies(int fd) {
+    static char buffers[MAX_WINDOW][REPLY_BUF_SIZE];
+    struct iovec iov[MAX_WINDOW];
+    struct mmsghdr msgs[MAX_WINDOW];
+    int total = 0;
+
+    for (;;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < MAX_WINDOW; ++i) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = REPLY_BUF_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(fd, msgs, MAX_WINDOW, MSG_DONTWAIT, NULL);
+        if (n <= 0) return total;
+        total += n;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--host <host>] [--port <port>] [--proto text|bin1] [--seconds <s>] [--window <n>] [--sockets <n>]\n", prog);
+    fprintf(stderr, "  --host     Server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  --port     Server port (default 9090)\n");
+    fprintf(stderr, "  --proto    Request format: text \"<op> <a> <b>\" or single %s frames (default text)\n", CALC_PROTO_NAME);
+    fprintf(stderr, "  --seconds  How long to run (default 5)\n");
+    fprintf(stderr, "  --window   Requests kept in flight per socket, 1-%d (default 32)\n", MAX_WINDOW);
+    fprintf(stderr, "  --sockets  Client sockets, each its own source port, 1-%d (default 4)\n", MAX_SOCKETS);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = 9090, binary = 0, seconds = 5, window = 32, socket_count = 4;
+
+    struct option long_options[] = {
+        {"host", required_argument, 0, 'h'},
+        {"port", required_argument, 0, 'p'},
+        {"proto", required_argument, 0, 'P'},
+        {"seconds", required_argument, 0, 't'},
+        {"window", required_argument, 0, 'w'},
+        {"sockets", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h:p:P:t:w:s:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'P':
+                if (strcmp(optarg, CALC_PROTO_NAME) == 0) binary = 1;
+                else if (strcmp(optarg, "text") == 0) binary = 0;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't': seconds = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 's': socket_count = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (port <= 0 || seconds <= 0 || window < 1 || window > MAX_WINDOW || socket_count < 1 || socket_count > MAX_SOCKETS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid host %s\n", host);
+        return 1;
+    }
+
+    BenchSocket sockets[MAX_SOCKETS];
+    struct pollfd pfds[MAX_SOCKETS];
+    for (int i = 0; i < socket_count; ++i) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("UDP socket setup failed");
+            return 1;
+        }
+        sockets[i].fd = fd;
+        sockets[i].in_flight = 0;
+        sockets[i].last_reply_ms = now_ms();
+        pfds[i].fd = fd;
+        pfds[i].events = POLLIN;
+    }
+
+    uint32_t next_id = 1;
+    unsigned long long sent = 0, replies = 0, lost = 0;
+    long long start_ms = now_ms(), end_ms = start_ms + seconds * 1000LL;
+    for (long long now = start_ms; now < end_ms; now = now_ms()) {
+        for (int i = 0; i < socket_count; ++i) {
+            BenchSocket *sock = &sockets[i];
+            if (sock->in_flight > 0 && now - sock->last_reply_ms >= LOSS_TIMEOUT_MS) {
+                // Dropped by a full socket buffer on either side
+                lost += sock->in_flight;
+                sock->in_flight = 0;
+            }
+            if (sock->in_flight < window) {
+                if (sock->in_flight == 0) sock->last_reply_ms = now;
+                int n = send_requests(sock->fd, window - sock->in_flight, binary, &next_id);
+                sock->in_flight += n;
+                sent += n;
+            }
+        }
+        if (poll(pfds, socket_count, 10) <= 0) continue;
+        now = now_ms();
+        for (int i = 0; i < socket_count; ++i) {
+            if (!(pfds[i].revents & (POLLIN | POLLERR))) continue;
+            int n = drain_replies(sockets[i].fd);
+            if (n == 0) continue;
+            if (n > sockets[i].in_flight) n = sockets[i].in_flight; // Late replies to requests counted lost
+            sockets[i].in_flight -= n;
+            sockets[i].last_reply_ms = now;
+            replies += n;
+        }
+    }
+    double elapsed = (now_ms() - start_ms) / 1000.0;
+
+    printf("udp_bench %s:%d %s, %d sockets x %d in flight, %.1f s\n", host, port, binary ? CALC_PROTO_NAME : "text",
+           socket_count, window, elapsed);
+    printf("  sent %llu  replies %llu  lost %llu\n", sent, replies, lost);
+    printf("  %.0f replies/s\n", replies / elapsed);
+    for (int i = 0; i < socket_count; ++i) close(sockets[i].fd);
+    return replies > 0 ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+// backend_health.c
+#include "backend_health.h"
+
+#include <stdlib.h>
+
+_Static_assert(HEALTH_WINDOW <= 32, "outcome window must fit in 32 bits");
+
+static void breaker_open(BackendHealth *health, long long now_ms) {
+    health->breaker = BREAKER_OPEN;
+    health->open_until_ms = now_ms + HEALTH_OPEN_MS;
+}
+
+static void breaker_close(BackendHealth *health) {
+    health->breaker = BREAKER_CLOSED;
+    health->consecutive_failures = 0;
+    health->outcomes = 0;
+    health->outcome_count = 0;
+}
+
+int health_window_failures(const BackendHealth *health) {
+    uint32_t window_mask = HEALTH_WINDOW == 32 ? 0xFFFFFFFFu : (1u << HEALTH_WINDOW) - 1;
+    return __builtin_popcount(health->outcomes & window_mask);
+}
+
+int health_breaker_allows(BackendHealth *health, long long now_ms) {
+    if (health->breaker == BREAKER_OPEN) {
+        if (now_ms < health->open_until_ms) return 0;
+        health->breaker = BREAKER_HALF_OPEN;
+    }
+    if (health->breaker == BREAKER_HALF_OPEN) return health->trials_in_flight == 0;
+    return 1;
+}
+
+int health_is_ejected(BackendHealth *health, long long now_ms) {
+    if (health->ejected && now_ms >= health->ejected_until_ms) {
+        health->ejected = 0;
+        // Judge it on calls made after readmission only
+        health->interval_latency_sum_ms = 0.0;
+        health->interval_calls = 0;
+    }
+    return health->ejected;
+}
+
+int health_call_started(BackendHealth *health) {
+    if (health->breaker != BREAKER_HALF_OPEN) return 0;
+    health->trials_in_flight++;
+    return 1;
+}
+
+void health_record(BackendHealth *health, int failed, double latency_ms, int trial, long long now_ms) {
+    if (trial) health->trials_in_flight--;
+    if (!failed) {
+        health->interval_latency_sum_ms += latency_ms;
+        health->interval_calls++;
+    }
+
+    health->outcomes = (health->outcomes << 1) | (failed ? 1u : 0u);
+    if (health->outcome_count < HEALTH_WINDOW) health->outcome_count++;
+    health->consecutive_failures = failed ? health->consecutive_failures + 1 : 0;
+
+    switch (health->breaker) {
+        case BREAKER_CLOSED: {
+            if (!failed) break;
+            int window_failures = health_window_failures(health);
+            if (health->consecutive_failures >= HEALTH_CONSECUTIVE_FAILURES ||
+                (health->outcome_count == HEALTH_WINDOW && window_failures * 100 >= HEALTH_ERROR_RATE_PCT * HEALTH_WINDOW)) {
+                breaker_open(health, now_ms);
+            }
+            break;
+        }
+        case BREAKER_HALF_OPEN:
+            // Calls started before the breaker opened do not decide
+            if (!trial) break;
+            if (failed) breaker_open(health, now_ms);
+            else breaker_close(health);
+            break;
+        case BREAKER_OPEN:
+            break;
+    }
+}
+
+void health_call_abandoned(BackendHealth *health, int trial) {
+    // A half-open breaker admits the next trial instead
+    if (trial) health->trials_in_flight--;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int health_sweep_outliers(BackendHealth *const *backends, int count, long long now_ms, int *ejected_out) {
+    if (count <= 0) return 0;
+    double means[count];
+    int measured = 0, ejected = 0;
+
+    for (int i = 0; i < count; ++i) {
+        BackendHealth *health = backends[i];
+        if (health_is_ejected(health, now_ms)) {
+            ejected++;
+            continue;
+        }
+        if (health->interval_calls >= HEALTH_OUTLIER_MIN_CALLS) {
+            means[measured++] = health->interval_latency_sum_ms / health->interval_calls;
+        }
+    }
+
+    int newly_ejected = 0;
+    if (measured >= 2) {
+        qsort(means, measured, sizeof(means[0]), compare_double);
+        double median = means[(measured - 1) / 2];
+        for (int i = 0; i < count && ejected < count / 2; ++i) {
+            BackendHealth *health = backends[i];
+            if (health->ejected || health->interval_calls < HEALTH_OUTLIER_MIN_CALLS) continue;
+            double mean = health->interval_latency_sum_ms / health->interval_calls;
+            if (mean <= median * HEALTH_OUTLIER_FACTOR || mean - median < HEALTH_OUTLIER_MIN_EXCESS_MS) continue;
+
+            long long duration = HEALTH_EJECTION_BASE_MS;
+            for (int k = 0; k < health->ejection_count && duration < HEALTH_EJECTION_MAX_MS; ++k) duration *= 2;
+            if (duration > HEALTH_EJECTION_MAX_MS) duration = HEALTH_EJECTION_MAX_MS;
+            health->ejected = 1;
+            health->ejected_until_ms = now_ms + duration;
+            health->ejection_count++;
+            ejected++;
+            ejected_out[newly_ejected++] = i;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        BackendHealth *health = backends[i];
+        if (!health->ejected) {
+            // A full interval in service without being ejected
+            if (health->ejection_count > 0 && health->interval_calls > 0) health->ejection_count--;
+            health->interval_latency_sum_ms = 0.0;
+            health->interval_calls = 0;
+        }
+    }
+    return newly_ejected;
+}
@@ -0,0 +1,87 @@
+// backend_health.h
+// Per-backend health for the gateway's candidate filtering: a circuit
+// breaker and latency-outlier ejection.
+//
+// The breaker is closed while calls succeed. It opens after
+// HEALTH_CONSECUTIVE_FAILURES failures in a row, or once the last
+// HEALTH_WINDOW calls include HEALTH_ERROR_RATE_PCT percent failures.
+// While open, the backend gets no calls for HEALTH_OPEN_MS; then it is
+// half-open and one trial call at a time goes through. The first trial to
+// succeed closes the breaker again, and one that fails reopens it.
+//
+// Outlier ejection compares the mean latency of each backend's successful
+// calls over the last sweep interval to the median across backends. A
+// backend much slower than the median is ejected for HEALTH_EJECTION_BASE_MS
+// doubled for each recent ejection, up to HEALTH_EJECTION_MAX_MS. Every sweep
+// interval spent admitted and not ejected forgets one of them. At most half
+// of the backends are ejected at once.
+//
+// Failures are calls that got no answer (timeouts, refused connections,
+// transport errors), not backend error replies such as division by zero.
+// Not thread-safe; the gateway calls it from its event loop only.
+#ifndef BACKEND_HEALTH_H
+#define BACKEND_HEALTH_H
+
+#include <stdint.h>
+
+#define HEALTH_CONSECUTIVE_FAILURES 5
+#define HEALTH_WINDOW 20 // Recent outcomes kept for the error rate, at most 32
+#define HEALTH_ERROR_RATE_PCT 50
+#define HEALTH_OPEN_MS 5000
+#define HEALTH_SWEEP_INTERVAL_MS 10000
+#define HEALTH_OUTLIER_MIN_CALLS 10 // Successful calls in an interval for a backend's mean to count
+#define HEALTH_OUTLIER_FACTOR 3.0   // Ejected when its mean is over this many times the median...
+#define HEALTH_OUTLIER_MIN_EXCESS_MS 10.0 // ...and at least this much above it
+#define HEALTH_EJECTION_BASE_MS 10000
+#define HEALTH_EJECTION_MAX_MS 300000
+
+typedef enum {
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+} BreakerState;
+
+typedef struct {
+    BreakerState breaker;
+    int consecutive_failures;
+    uint32_t outcomes;  // One bit per recent call, newest in bit 0, set for a failure
+    int outcome_count;  // Valid bits in outcomes, up to HEALTH_WINDOW
+    long long open_until_ms;
+    int trials_in_flight; // Calls started while half-open
+
+    int ejected;
+    long long ejected_until_ms;
+    int ejection_count; // Recent ejections; sets the length of the next one
+    double interval_latency_sum_ms; // Successful calls since the last sweep
+    int interval_calls;
+} BackendHealth;
+
+// Whether the breaker lets a call through now. Moves an open breaker whose
+// time is up to half-open; a half-open one admits a call only while no
+// trial is in flight.
+int health_breaker_allows(BackendHealth *health, long long now_ms);
+
+// Whether the backend is currently ejected as a latency outlier. Readmits
+// it once its ejection time is up.
+int health_is_ejected(BackendHealth *health, long long now_ms);
+
+// Called when a call to the backend starts. Returns 1 if it is a half-open
+// trial, to be passed back to health_record.
+int health_call_started(BackendHealth *health);
+
+// Folds in the outcome of a finished call
+void health_record(BackendHealth *health, int failed, double latency_ms, int trial, long long now_ms);
+
+// Called instead of health_record for a call given up for reasons of the
+// client's, e.g. its deadline ran out, which says nothing about the backend
+void health_call_abandoned(BackendHealth *health, int trial);
+
+// Failures among the last outcome_count calls
+int health_window_failures(const BackendHealth *health);
+
+// Runs outlier detection over the backends that are taking calls and starts
+// a new interval. Indexes (into `backends`) of the backends ejected by this
+// sweep are written to ejected_out. Returns how many there are.
+int health_sweep_outliers(BackendHealth *const *backends, int count, long long now_ms, int *ejected_out);
+
+#endif // BACKEND_HEALTH_H
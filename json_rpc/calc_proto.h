@@ -0,0 +1,374 @@
+// calc_proto.h
+// "bin1", the binary framing between the gateway and calculator backends.
+// It replaces the "<op> <a> <b>" / "Result: ..." text exchange for backends
+// that advertise proto=bin1 when they register; text stays the fallback.
+//
+// Every frame has a fixed size and layout, all integers big-endian:
+//
+//   request (24 bytes)                 reply (16 bytes)
+//   0  u8  magic  CALC_PROTO_MAGIC     0  u8  magic  CALC_PROTO_MAGIC
+//   1  u8  version CALC_PROTO_VERSION  1  u8  version
+//   2  u8  op (1 add .. 4 divide)      2  u8  status (CalcStatus)
+//   3  u8  reserved, 0                 3  u8  reserved, 0
+//   4  u32 request id                  4  u32 request id, echoed
+//   8  f64 a, IEEE-754 bits            8  f64 result, IEEE-754 bits
+//   16 f64 b
+//
+// The magic byte is not ASCII, so a backend can tell a binary request from
+// a text one by its first byte. Results travel as exact doubles instead of
+// being rounded to two decimals.
+//
+// A batch frame carries up to CALC_BATCH_MAX calls in structure-of-arrays
+// form, for backends that registered with batch=<n>. Its op byte is
+// CALC_BATCH_OP and the arrays start at byte 8:
+//
+//   batch request                      batch reply
+//   4  u32 count n                     4  u32 count n
+//   8  u32 ids[n]                      8  u32 ids[n], echoed
+//      u8  ops[n]                         u8  statuses[n]
+//      zero padding to a multiple of 8    zero padding to a multiple of 8
+//      f64 a[n]                           f64 results[n]
+//      f64 b[n]
+//
+// Backends evaluate each run of equal ops in a batch with one vectorized
+// kernel (AVX2 or SSE2 when the CPU has it, scalar otherwise), so senders
+// should group calls by op.
+//
+// Header-only so that the backends, which are built on their own, can share
+// it: #include "../json_rpc/calc_proto.h".
+#ifndef CALC_PROTO_H
+#define CALC_PROTO_H
+
+#include <endian.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CALC_KERNELS_X86 1
+#endif
+
+#define CALC_PROTO_NAME "bin1" // Value of proto= in registration messages
+#define CALC_PROTO_MAGIC 0xCA
+#define CALC_PROTO_VERSION 1
+#define CALC_REQUEST_SIZE 24
+#define CALC_REPLY_SIZE 16
+#define CALC_BATCH_OP 0xFF
+#define CALC_BATCH_MAX 64 // Calls per batch frame; a full request still fits one Ethernet datagram
+#define CALC_BATCH_HEADER_SIZE 8
+#define CALC_PAD8(n) (((n) + 7) & ~(size_t)7)
+#define CALC_BATCH_REQUEST_SIZE(n) (CALC_BATCH_HEADER_SIZE + CALC_PAD8(5 * (size_t)(n)) + 16 * (size_t)(n))
+#define CALC_BATCH_REPLY_SIZE(n) (CALC_BATCH_HEADER_SIZE + CALC_PAD8(5 * (size_t)(n)) + 8 * (size_t)(n))
+#define CALC_MAX_REQUEST_SIZE CALC_BATCH_REQUEST_SIZE(CALC_BATCH_MAX)
+#define CALC_MAX_REPLY_SIZE CALC_BATCH_REPLY_SIZE(CALC_BATCH_MAX)
+
+typedef enum {
+    CALC_OK = 0,
+    CALC_DIVISION_BY_ZERO = 1,
+    CALC_INVALID_OP = 2,
+    CALC_BAD_FRAME = 3
+} CalcStatus;
+
+static inline void calc_put_u32(unsigned char *p, uint32_t v) {
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t calc_get_u32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static inline void calc_put_f64(unsigned char *p, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    bits = htobe64(bits);
+    memcpy(p, &bits, sizeof(bits));
+}
+
+static inline double calc_get_f64(const unsigned char *p) {
+    uint64_t bits;
+    memcpy(&bits, p, sizeof(bits));
+    bits = be64toh(bits);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+// Whether buf starts like a binary frame rather than a text request
+static inline int calc_is_binary(const void *buf, size_t len) {
+    return len > 0 && ((const unsigned char *)buf)[0] == CALC_PROTO_MAGIC;
+}
+
+static inline void calc_encode_request(unsigned char *frame, uint32_t id, int op, double a, double b) {
+    frame[0] = CALC_PROTO_MAGIC;
+    frame[1] = CALC_PROTO_VERSION;
+    frame[2] = (unsigned char)op;
+    frame[3] = 0;
+    calc_put_u32(frame + 4, id);
+    calc_put_f64(frame + 8, a);
+    calc_put_f64(frame + 16, b);
+}
+
+// Returns 0, or -1 if the frame is short or not a version this code speaks
+static inline int calc_decode_request(const unsigned char *frame, size_t len, uint32_t *id, int *op, double *a, double *b) {
+    if (len < CALC_REQUEST_SIZE || frame[0] != CALC_PROTO_MAGIC || frame[1] != CALC_PROTO_VERSION) return -1;
+    *op = frame[2];
+    *id = calc_get_u32(frame + 4);
+    *a = calc_get_f64(frame + 8);
+    *b = calc_get_f64(frame + 16);
+    return 0;
+}
+
+static inline void calc_encode_reply(unsigned char *frame, uint32_t id, CalcStatus status, double result) {
+    frame[0] = CALC_PROTO_MAGIC;
+    frame[1] = CALC_PROTO_VERSION;
+    frame[2] = (unsigned char)status;
+    frame[3] = 0;
+    calc_put_u32(frame + 4, id);
+    calc_put_f64(frame + 8, result);
+}
+
+static inline int calc_decode_reply(const unsigned char *frame, size_t len, uint32_t *id, int *status, double *result) {
+    if (len < CALC_REPLY_SIZE || frame[0] != CALC_PROTO_MAGIC || frame[1] != CALC_PROTO_VERSION) return -1;
+    *status = frame[2];
+    *id = calc_get_u32(frame + 4);
+    *result = calc_get_f64(frame + 8);
+    return 0;
+}
+
+// Evaluates a request the way the text protocol does; *result is 0 on error
+static inline CalcStatus calc_evaluate(int op, double a, double b, double *result) {
+    *result = 0.0;
+    switch (op) {
+        case 1: *result = a + b; return CALC_OK;
+        case 2: *result = a - b; return CALC_OK;
+        case 3: *result = a * b; return CALC_OK;
+        case 4:
+            if (b == 0) return CALC_DIVISION_BY_ZERO;
+            *result = a / b;
+            return CALC_OK;
+        default: return CALC_INVALID_OP;
+    }
+}
+
+// Answers one request frame into out (CALC_REPLY_SIZE bytes) and returns
+// the reply size. A frame that cannot be decoded gets CALC_BAD_FRAME, id 0.
+static inline size_t calc_handle_request(const unsigned char *in, size_t in_len, unsigned char *out) {
+    uint32_t id = 0;
+    int op;
+    double a, b, result = 0.0;
+    CalcStatus status = CALC_BAD_FRAME;
+    if (calc_decode_request(in, in_len, &id, &op, &a, &b) == 0) status = calc_evaluate(op, a, b, &result);
+    calc_encode_reply(out, id, status, result);
+    return CALC_REPLY_SIZE;
+}
+
+// Batch evaluation kernels: op (1 add .. 4 divide) over n operand pairs.
+// Each writes results and statuses like calc_evaluate.
+
+static inline void calc_kernel_scalar(int op, const double *a, const double *b, double *result, unsigned char *status, size_t n) {
+    for (size_t i = 0; i < n; ++i) status[i] = (unsigned char)calc_evaluate(op, a[i], b[i], &result[i]);
+}
+
+#ifdef CALC_KERNELS_X86
+__attribute__((target("avx2")))
+static inline void calc_kernel_avx2(int op, const double *a, const double *b, double *result, unsigned char *status, size_t n) {
+    size_t i = 0;
+    const __m256d zero = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        __m256d va = _mm256_loadu_pd(a + i), vb = _mm256_loadu_pd(b + i), vr;
+        int zero_divisors = 0;
+        switch (op) {
+            case 1: vr = _mm256_add_pd(va, vb); break;
+            case 2: vr = _mm256_sub_pd(va, vb); break;
+            case 3: vr = _mm256_mul_pd(va, vb); break;
+            default: {
+                __m256d is_zero = _mm256_cmp_pd(vb, zero, _CMP_EQ_OQ);
+                vr = _mm256_andnot_pd(is_zero, _mm256_div_pd(va, vb));
+                zero_divisors = _mm256_movemask_pd(is_zero);
+            }
+        }
+        _mm256_storeu_pd(result + i, vr);
+        for (int k = 0; k < 4; ++k) status[i + k] = (zero_divisors >> k) & 1 ? CALC_DIVISION_BY_ZERO : CALC_OK;
+    }
+    calc_kernel_scalar(op, a + i, b + i, result + i, status + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static inline void calc_kernel_sse2(int op, const double *a, const double *b, double *result, unsigned char *status, size_t n) {
+    size_t i = 0;
+    const __m128d zero = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+        __m128d va = _mm_loadu_pd(a + i), vb = _mm_loadu_pd(b + i), vr;
+        int zero_divisors = 0;
+        switch (op) {
+            case 1: vr = _mm_add_pd(va, vb); break;
+            case 2: vr = _mm_sub_pd(va, vb); break;
+            case 3: vr = _mm_mul_pd(va, vb); break;
+            default: {
+                __m128d is_zero = _mm_cmpeq_pd(vb, zero);
+                vr = _mm_andnot_pd(is_zero, _mm_div_pd(va, vb));
+                zero_divisors = _mm_movemask_pd(is_zero);
+            }
+        }
+        _mm_storeu_pd(result + i, vr);
+        for (int k = 0; k < 2; ++k) status[i + k] = (zero_divisors >> k) & 1 ? CALC_DIVISION_BY_ZERO : CALC_OK;
+    }
+    calc_kernel_scalar(op, a + i, b + i, result + i, status + i, n - i);
+}
+#endif
+
+typedef enum {
+    CALC_KERNEL_SCALAR,
+    CALC_KERNEL_SSE2,
+    CALC_KERNEL_AVX2
+} CalcKernelLevel;
+
+// The best kernels this CPU runs, detected on first use. The backends are
+// built without -mavx2 and still use AVX2 where it is there. Event loop
+// threads may get here at once; each detects the same level and publishes
+// it whole, so none sees a half-made choice.
+static inline CalcKernelLevel calc_kernel_level(void) {
+    static _Atomic int level = -1;
+    int known = atomic_load_explicit(&level, memory_order_relaxed);
+    if (known >= 0) return (CalcKernelLevel)known;
+    int detected = CALC_KERNEL_SCALAR;
+#ifdef CALC_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) detected = CALC_KERNEL_AVX2;
+    else if (__builtin_cpu_supports("sse2")) detected = CALC_KERNEL_SSE2;
+#endif
+    atomic_store_explicit(&level, detected, memory_order_relaxed);
+    return (CalcKernelLevel)detected;
+}
+
+static inline const char *calc_kernel_name(CalcKernelLevel level) {
+    return level == CALC_KERNEL_AVX2 ? "avx2" : level == CALC_KERNEL_SSE2 ? "sse2" : "scalar";
+}
+
+// Evaluates n calls that share one op
+static inline void calc_evaluate_run(int op, const double *a, const double *b, double *result, unsigned char *status, size_t n) {
+#ifdef CALC_KERNELS_X86
+    if (op >= 1 && op <= 4) {
+        switch (calc_kernel_level()) {
+            case CALC_KERNEL_AVX2: calc_kernel_avx2(op, a, b, result, status, n); return;
+            case CALC_KERNEL_SSE2: calc_kernel_sse2(op, a, b, result, status, n); return;
+            case CALC_KERNEL_SCALAR: break;
+        }
+    }
+#endif
+    calc_kernel_scalar(op, a, b, result, status, n);
+}
+
+// Size of the request frame at the start of buf: 0 if more bytes are needed
+// to tell, -1 if buf does not start a frame this code speaks
+static inline long calc_request_frame_size(const unsigned char *buf, size_t len) {
+    if (len < 4) return 0;
+    if (buf[0] != CALC_PROTO_MAGIC || buf[1] != CALC_PROTO_VERSION) return -1;
+    if (buf[2] != CALC_BATCH_OP) return CALC_REQUEST_SIZE;
+    if (len < CALC_BATCH_HEADER_SIZE) return 0;
+    uint32_t count = calc_get_u32(buf + 4);
+    if (count == 0 || count > CALC_BATCH_MAX) return -1;
+    return (long)CALC_BATCH_REQUEST_SIZE(count);
+}
+
+// Same for reply frames
+static inline long calc_reply_frame_size(const unsigned char *buf, size_t len) {
+    if (len < 4) return 0;
+    if (buf[0] != CALC_PROTO_MAGIC || buf[1] != CALC_PROTO_VERSION) return -1;
+    if (buf[2] != CALC_BATCH_OP) return CALC_REPLY_SIZE;
+    if (len < CALC_BATCH_HEADER_SIZE) return 0;
+    uint32_t count = calc_get_u32(buf + 4);
+    if (count == 0 || count > CALC_BATCH_MAX) return -1;
+    return (long)CALC_BATCH_REPLY_SIZE(count);
+}
+
+// Writes a batch request for n calls (n <= CALC_BATCH_MAX) into frame,
+// which has room for CALC_BATCH_REQUEST_SIZE(n) bytes; returns that size
+static inline size_t calc_encode_batch_request(unsigned char *frame, size_t n, const uint32_t *ids, const unsigned char *ops,
+                                               const double *a, const double *b) {
+    size_t size = CALC_BATCH_REQUEST_SIZE(n);
+    memset(frame, 0, size);
+    frame[0] = CALC_PROTO_MAGIC;
+    frame[1] = CALC_PROTO_VERSION;
+    frame[2] = CALC_BATCH_OP;
+    calc_put_u32(frame + 4, (uint32_t)n);
+    unsigned char *ids_at = frame + CALC_BATCH_HEADER_SIZE, *ops_at = ids_at + 4 * n;
+    unsigned char *a_at = ids_at + CALC_PAD8(5 * n), *b_at = a_at + 8 * n;
+    for (size_t i = 0; i < n; ++i) {
+        calc_put_u32(ids_at + 4 * i, ids[i]);
+        ops_at[i] = ops[i];
+        calc_put_f64(a_at + 8 * i, a[i]);
+        calc_put_f64(b_at + 8 * i, b[i]);
+    }
+    return size;
+}
+
+// Replies in a single or batch reply frame whose size calc_reply_frame_size
+// checked, and reply i of it
+static inline size_t calc_reply_count(const unsigned char *frame) {
+    return frame[2] == CALC_BATCH_OP ? calc_get_u32(frame + 4) : 1;
+}
+
+static inline void calc_decode_reply_entry(const unsigned char *frame, size_t i, uint32_t *id, int *status, double *result) {
+    if (frame[2] != CALC_BATCH_OP) {
+        calc_decode_reply(frame, CALC_REPLY_SIZE, id, status, result);
+        return;
+    }
+    size_t n = calc_get_u32(frame + 4);
+    const unsigned char *ids_at = frame + CALC_BATCH_HEADER_SIZE;
+    *id = calc_get_u32(ids_at + 4 * i);
+    *status = ids_at[4 * n + i];
+    *result = calc_get_f64(ids_at + CALC_PAD8(5 * n) + 8 * i);
+}
+
+// Answers a batch request frame whose size calc_request_frame_size checked.
+// Operands are unpacked into arrays, each run of equal ops is evaluated by
+// one kernel call, and the results are packed into the reply.
+static inline size_t calc_handle_batch(const unsigned char *in, unsigned char *out) {
+    size_t n = calc_get_u32(in + 4);
+    uint32_t ids[CALC_BATCH_MAX];
+    unsigned char ops[CALC_BATCH_MAX], status[CALC_BATCH_MAX];
+    double a[CALC_BATCH_MAX], b[CALC_BATCH_MAX], result[CALC_BATCH_MAX];
+    const unsigned char *ids_at = in + CALC_BATCH_HEADER_SIZE, *ops_at = ids_at + 4 * n;
+    const unsigned char *a_at = ids_at + CALC_PAD8(5 * n), *b_at = a_at + 8 * n;
+    for (size_t i = 0; i < n; ++i) {
+        ids[i] = calc_get_u32(ids_at + 4 * i);
+        ops[i] = ops_at[i];
+        a[i] = calc_get_f64(a_at + 8 * i);
+        b[i] = calc_get_f64(b_at + 8 * i);
+    }
+    for (size_t start = 0, end; start < n; start = end) {
+        for (end = start + 1; end < n && ops[end] == ops[start]; ++end) {
+        }
+        calc_evaluate_run(ops[start], a + start, b + start, result + start, status + start, end - start);
+    }
+
+    size_t size = CALC_BATCH_REPLY_SIZE(n);
+    memset(out, 0, size);
+    out[0] = CALC_PROTO_MAGIC;
+    out[1] = CALC_PROTO_VERSION;
+    out[2] = CALC_BATCH_OP;
+    calc_put_u32(out + 4, (uint32_t)n);
+    unsigned char *reply_ids = out + CALC_BATCH_HEADER_SIZE, *statuses = reply_ids + 4 * n;
+    unsigned char *results = reply_ids + CALC_PAD8(5 * n);
+    for (size_t i = 0; i < n; ++i) {
+        calc_put_u32(reply_ids + 4 * i, ids[i]);
+        statuses[i] = status[i];
+        calc_put_f64(results + 8 * i, result[i]);
+    }
+    return size;
+}
+
+// Answers a single or batch request frame into out (CALC_MAX_REPLY_SIZE
+// bytes) and returns the reply size
+static inline size_t calc_handle_frame(const unsigned char *in, size_t in_len, unsigned char *out) {
+    long size = calc_request_frame_size(in, in_len);
+    if (size > CALC_REQUEST_SIZE && (size_t)size <= in_len) return calc_handle_batch(in, out);
+    return calc_handle_request(in, in_len, out);
+}
+
+#endif // CALC_PROTO_H
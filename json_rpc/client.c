@@ -17,13 +17,24 @@
 // Simplifies ID management for this basic client.
 static int request_id = 1;
 
-// Core function to send a JSON-RPC request and receive the server's response.
+// Persistent connection to the server, opened on first use and reused for
+// every request. Responses are newline-delimited, so bytes read past the end
+// of one response are kept in pending_buf for the next.
+static int server_sock = -1;
+static char pending_buf[BUFFER_SIZE * 4];
+static size_t pending_len = 0;
+
+// Core function to send a JSON-RPC request and receive the server's response
+// over the client's persistent connection.
 // request_str: The JSON-RPC request string to send.
 // response_buf: Buffer to store the server's response.
 // response_buf_size: Size of the response_buf.
 // Returns 0 on success, -1 on failure (connection, send, or receive error).
 int send_rpc_request(const char *request_str, char *response_buf, size_t response_buf_size);
 
+// Closes the persistent connection, if any.
+static void disconnect_from_server(void);
+
 // Wrapper functions for specific calculator operations.
 // These construct the JSON-RPC request, call send_rpc_request, and parse the response.
 // n1, n2: The numbers to operate on.
@@ -69,6 +80,7 @@ int main() {
         // Check for 'exit' command
         if (strcmp(operation, "exit") == 0) {
             printf("Exiting client.\n");
+            disconnect_from_server();
             break;
         }
 
@@ -118,8 +130,8 @@ int main() {
     return 0;
 }
 
-// Implementation of send_rpc_request: Establishes connection, sends request, receives response.
-int send_rpc_request(const char *request_str, char *response_buf, size_t response_buf_size) {
+// Opens a new TCP connection to the server. Returns the socket or -1.
+static int connect_to_server(void) {
     int sock_fd; // Socket file descriptor
     struct sockaddr_in server_addr; // Server address structure
 
@@ -150,28 +162,78 @@ int send_rpc_request(const char *request_str, char *response_buf, size_t respons
         close(sock_fd);
         return -1;
     }
+    return sock_fd;
+}
+
+// Drops the persistent connection and anything left unread on it.
+static void disconnect_from_server(void) {
+    if (server_sock >= 0) {
+        close(server_sock);
+        server_sock = -1;
+    }
+    pending_len = 0;
+}
 
-    // Send the JSON-RPC request string to the server
-    if (send(sock_fd, request_str, strlen(request_str), 0) < 0) {
+// Sends one newline-terminated request and reads one newline-terminated
+// response on the persistent connection. Returns 0 on success, -1 if the
+// connection failed (it is then closed so the next call reconnects).
+static int exchange_on_connection(const char *request_str, char *response_buf, size_t response_buf_size) {
+    if (server_sock < 0) {
+        server_sock = connect_to_server();
+        if (server_sock < 0) return -1;
+    }
+
+    // Send the JSON-RPC request string followed by the message delimiter
+    size_t request_len = strlen(request_str);
+    if (send(server_sock, request_str, request_len, MSG_NOSIGNAL) != (ssize_t)request_len ||
+        send(server_sock, "\n", 1, MSG_NOSIGNAL) != 1) {
         perror("Client: send failed");
-        close(sock_fd);
+        disconnect_from_server();
         return -1;
     }
 
-    // Receive the server's response
-    memset(response_buf, 0, response_buf_size); // Clear buffer before receiving
-    ssize_t bytes_received = recv(sock_fd, response_buf, response_buf_size - 1, 0); // -1 for null terminator
-    if (bytes_received < 0) {
-        perror("Client: recv failed");
-        close(sock_fd);
-        return -1;
+    // Receive until a full response line is buffered
+    char *newline;
+    while ((newline = memchr(pending_buf, '\n', pending_len)) == NULL) {
+        if (pending_len == sizeof(pending_buf)) {
+            fprintf(stderr, "Client: response too large\n");
+            disconnect_from_server();
+            return -1;
+        }
+        ssize_t bytes_received = recv(server_sock, pending_buf + pending_len, sizeof(pending_buf) - pending_len, 0);
+        if (bytes_received <= 0) {
+            if (bytes_received < 0) perror("Client: recv failed");
+            disconnect_from_server();
+            return -1;
+        }
+        pending_len += bytes_received;
     }
+
+    size_t line_len = newline - pending_buf;
+    if (line_len >= response_buf_size) line_len = response_buf_size - 1;
+    memcpy(response_buf, pending_buf, line_len);
     // Null-terminate the received data to make it a valid C string
-    response_buf[bytes_received] = '\0';
+    response_buf[line_len] = '\0';
+
+    // Keep any bytes past this response for the next call
+    size_t consumed = newline - pending_buf + 1;
+    memmove(pending_buf, pending_buf + consumed, pending_len - consumed);
+    pending_len -= consumed;
+    return 0;
+}
 
-    // Close the socket
-    close(sock_fd);
-    return 0; // Success
+// Implementation of send_rpc_request: reuses one connection for all calls.
+// If a reused connection turns out to be dead (e.g. the server restarted),
+// the request is retried once on a fresh connection.
+int send_rpc_request(const char *request_str, char *response_buf, size_t response_buf_size) {
+    int reused = server_sock >= 0;
+    if (exchange_on_connection(request_str, response_buf, response_buf_size) == 0) {
+        return 0; // Success
+    }
+    if (reused) {
+        return exchange_on_connection(request_str, response_buf, response_buf_size);
+    }
+    return -1;
 }
 
 // Implementation for parse_rpc_response using json-c: Parses server response.
@@ -251,6 +313,13 @@ int parse_rpc_response(const char *response_str, double *result_val, char *error
 
     // If no "error" field, look for the "result" field.
     if (json_object_object_get_ex(root_obj, "result", &result_obj)) {
+        // The gateway wraps the number as {"value": ..., "backend": ...};
+        // plain numeric results are accepted too.
+        struct json_object *value_obj = NULL;
+        if (json_object_is_type(result_obj, json_type_object) &&
+            json_object_object_get_ex(result_obj, "value", &value_obj)) {
+            result_obj = value_obj;
+        }
         // For a calculator, result should be a number (double or int).
         if (json_object_is_type(result_obj, json_type_double) || json_object_is_type(result_obj, json_type_int)) {
             *result_val = json_object_get_double(result_obj); // json-c handles int to double conversion
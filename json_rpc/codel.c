@@ -0,0 +1,45 @@
+// codel.c
+#include "codel.h"
+
+#include <math.h>
+
+static long long control_law(long long t, unsigned int count, long long interval_us) {
+    return t + (long long)(interval_us / sqrt((double)count));
+}
+
+void codel_queue_empty(CodelState *codel) {
+    codel->first_above_us = 0;
+    codel->dropping = 0;
+}
+
+int codel_should_drop(CodelState *codel, long long sojourn_us, long long now_us, long long target_us, long long interval_us) {
+    int ok_to_drop = 0;
+    if (sojourn_us < target_us) {
+        codel->first_above_us = 0;
+    } else if (codel->first_above_us == 0) {
+        codel->first_above_us = now_us + interval_us;
+    } else if (now_us >= codel->first_above_us) {
+        ok_to_drop = 1;
+    }
+
+    if (codel->dropping) {
+        if (!ok_to_drop) {
+            codel->dropping = 0;
+            return 0;
+        }
+        if (now_us < codel->drop_next_us) return 0;
+        codel->count++;
+        codel->drop_next_us = control_law(codel->drop_next_us, codel->count, interval_us);
+        return 1;
+    }
+    if (!ok_to_drop) return 0;
+
+    // Dropping again soon after the last dropping state: resume near the
+    // drop rate it ended with instead of starting over
+    codel->dropping = 1;
+    unsigned int delta = codel->count - codel->last_count;
+    codel->count = (delta > 1 && now_us - codel->drop_next_us < 16 * interval_us) ? delta : 1;
+    codel->last_count = codel->count;
+    codel->drop_next_us = control_law(now_us, codel->count, interval_us);
+    return 1;
+}
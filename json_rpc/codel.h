@@ -0,0 +1,31 @@
+// codel.h
+// CoDel (controlled delay) load shedding for a request queue, after
+// RFC 8289. The queue is judged on how long requests waited in it, not on
+// its length. A standing queue -- every request waiting longer than the
+// target for a whole interval -- starts a dropping state. In that state one
+// request is shed, and the next after interval / sqrt(drops so far), so
+// the drop rate rises until the wait falls under the target again. Short
+// bursts that drain within an interval are never shed.
+//
+// The caller asks once per request it takes off the queue, and sheds the
+// request (then asks about the next one) when told to.
+// Not thread-safe; the gateway calls it from its event loop only.
+#ifndef CODEL_H
+#define CODEL_H
+
+typedef struct {
+    long long first_above_us; // When a wait above target becomes a standing queue; 0 while under target
+    long long drop_next_us;   // Next drop while dropping
+    unsigned int count;       // Drops since dropping started
+    unsigned int last_count;  // count when the previous dropping state began
+    int dropping;
+} CodelState;
+
+// Whether to shed a request that waited sojourn_us before being dequeued at
+// now_us. All times are in microseconds.
+int codel_should_drop(CodelState *codel, long long sojourn_us, long long now_us, long long target_us, long long interval_us);
+
+// Called when a request finds the queue empty: there is no standing queue
+void codel_queue_empty(CodelState *codel);
+
+#endif // CODEL_H
@@ -0,0 +1,43 @@
+// histogram.c
+#include "histogram.h"
+
+static int bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    int sub = (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Largest value that lands in a bucket
+static uint64_t bucket_top(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return (uint64_t)index;
+    int shift = (index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = (uint64_t)((index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS);
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogram_record(Histogram *hist, uint64_t value) {
+    uint64_t limit = ((uint64_t)1 << HISTOGRAM_MAX_BITS) - 1;
+    if (value > limit) value = limit;
+    hist->counts[bucket_index(value)]++;
+    hist->total_count++;
+    hist->sum += value;
+    if (value > hist->max) hist->max = value;
+}
+
+uint64_t histogram_value_at_percentile(const Histogram *hist, double percentile) {
+    if (hist->total_count == 0) return 0;
+    double exact = percentile / 100.0 * hist->total_count;
+    uint64_t target = (uint64_t)exact;
+    if ((double)target < exact || target == 0) target++;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            uint64_t top = bucket_top(i);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,30 @@
+// histogram.h
+// HDR-style latency histogram: values below HISTOGRAM_SUB_BUCKETS are
+// counted exactly, larger ones in HISTOGRAM_SUB_BUCKETS linear steps per
+// power of two, so every recorded value is off by at most 1/32 (~3%) and
+// memory stays fixed whatever the range. Recording is a few integer
+// operations; percentiles are computed by walking the buckets.
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_BITS 36 // Values up to 2^36 - 1 (19 hours in microseconds); larger ones are clamped
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1))
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total_count;
+    uint64_t sum; // Of the exact recorded values
+    uint64_t max;
+} Histogram;
+
+void histogram_record(Histogram *hist, uint64_t value);
+
+// Smallest value v such that at least `percentile` percent (0-100) of the
+// recorded values are <= v, reported as the top of v's bucket. 0 if empty.
+uint64_t histogram_value_at_percentile(const Histogram *hist, double percentile);
+
+#endif // HISTOGRAM_H
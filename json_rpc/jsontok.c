@@ -0,0 +1,379 @@
+// jsontok.c
+#include "jsontok.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+// Build with -DJSONTOK_NO_SIMD to measure the portable scalar scanners
+#if defined(__SSE2__) && !defined(JSONTOK_NO_SIMD)
+#define JSONTOK_USE_SSE2 1
+#include <emmintrin.h> // 16-byte scans for whitespace runs and string bodies
+#endif
+
+enum {
+    EXPECT_VALUE,
+    EXPECT_VALUE_OR_CLOSE, // Just after '['
+    EXPECT_KEY,
+    EXPECT_KEY_OR_CLOSE,   // Just after '{'
+    EXPECT_COLON,
+    EXPECT_COMMA_OR_CLOSE
+};
+
+void jsontok_init(jsontok_parser *parser) {
+    parser->pos = 0;
+    parser->toknext = 0;
+    parser->toksuper = -1;
+    parser->partial = -1;
+    parser->expect = EXPECT_VALUE;
+}
+
+#define CLASS_WHITESPACE 1
+#define CLASS_DELIMITER 2 // Ends a primitive
+#define CLASS_INVALID 4   // Never allowed inside a primitive
+
+// One lookup per byte instead of a chain of comparisons
+static const unsigned char char_class[256] = {
+    [0 ... 0x1F] = CLASS_INVALID,
+    [' '] = CLASS_WHITESPACE | CLASS_DELIMITER,
+    ['\t'] = CLASS_WHITESPACE | CLASS_DELIMITER,
+    ['\n'] = CLASS_WHITESPACE | CLASS_DELIMITER,
+    ['\r'] = CLASS_WHITESPACE | CLASS_DELIMITER,
+    [','] = CLASS_DELIMITER,
+    [']'] = CLASS_DELIMITER,
+    ['}'] = CLASS_DELIMITER,
+    [':'] = CLASS_DELIMITER,
+    ['"'] = CLASS_INVALID,
+    ['{'] = CLASS_INVALID,
+    ['['] = CLASS_INVALID,
+    [0x7F ... 0xFF] = CLASS_INVALID
+};
+
+static inline int is_whitespace(char c) {
+    return char_class[(unsigned char)c] & CLASS_WHITESPACE;
+}
+
+static size_t skip_whitespace(const char *js, size_t pos, size_t len) {
+    // Most values are separated by at most one space; only long runs
+    // (indentation) are worth a vector scan
+    if (pos < len && !is_whitespace(js[pos])) return pos;
+#ifdef JSONTOK_USE_SSE2
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    while (pos + 16 <= len) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(js + pos));
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, cr)));
+        unsigned int other = ~(unsigned int)_mm_movemask_epi8(ws) & 0xFFFF;
+        if (other) return pos + __builtin_ctz(other);
+        pos += 16;
+    }
+#endif
+    while (pos < len && is_whitespace(js[pos])) pos++;
+    return pos;
+}
+
+// Returns the offset of the first byte at or after pos that ends a plain
+// run of string contents: a quote, a backslash or a control character.
+static size_t scan_string(const char *js, size_t pos, size_t len) {
+#ifdef JSONTOK_USE_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+    // Long strings are checked 32 bytes per iteration
+    while (pos + 32 <= len) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(js + pos));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(js + pos + 16));
+        __m128i special_lo = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lo, quote), _mm_cmpeq_epi8(lo, backslash)),
+                                          _mm_cmpeq_epi8(_mm_max_epu8(lo, control_max), control_max));
+        __m128i special_hi = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(hi, quote), _mm_cmpeq_epi8(hi, backslash)),
+                                          _mm_cmpeq_epi8(_mm_max_epu8(hi, control_max), control_max));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(special_lo) | ((unsigned int)_mm_movemask_epi8(special_hi) << 16);
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += 32;
+    }
+    while (pos + 16 <= len) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(js + pos));
+        // Unsigned chunk <= 0x1F is max(chunk, 0x1F) == 0x1F
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(chunk, control_max), control_max);
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), control);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(special);
+        if (mask) return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif
+    while (pos < len) {
+        unsigned char c = (unsigned char)js[pos];
+        if (c == '"' || c == '\\' || c < 0x20) return pos;
+        pos++;
+    }
+    return len;
+}
+
+static int is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// Continues scanning the open string token. Returns 1 when its closing quote
+// was found, 0 if more input is needed, JSONTOK_ERROR_INVAL on bad contents.
+static int continue_string(jsontok_parser *parser, const char *js, size_t len, jsontok_token *token) {
+    size_t pos = parser->pos;
+    while (1) {
+        pos = scan_string(js, pos, len);
+        if (pos >= len) {
+            parser->pos = len;
+            return 0;
+        }
+        char c = js[pos];
+        if (c == '"') {
+            token->end = (int)pos;
+            parser->pos = pos + 1;
+            return 1;
+        }
+        if (c != '\\') {
+            parser->pos = pos;
+            return JSONTOK_ERROR_INVAL; // Raw control character
+        }
+        // Escapes are only consumed whole, so a split one is rescanned
+        if (pos + 1 >= len) {
+            parser->pos = pos;
+            return 0;
+        }
+        char escaped = js[pos + 1];
+        if (escaped == 'u') {
+            if (pos + 5 >= len) {
+                parser->pos = pos;
+                return 0;
+            }
+            for (int i = 2; i < 6; ++i) {
+                if (!is_hex(js[pos + i])) {
+                    parser->pos = pos;
+                    return JSONTOK_ERROR_INVAL;
+                }
+            }
+            pos += 6;
+        } else if (strchr("\"\\/bfnrt", escaped) && escaped != '\0') {
+            pos += 2;
+        } else {
+            parser->pos = pos;
+            return JSONTOK_ERROR_INVAL;
+        }
+    }
+}
+
+// Continues scanning the open primitive token; it ends at the first
+// delimiter, so a primitive at the very end of the input stays open.
+static int continue_primitive(jsontok_parser *parser, const char *js, size_t len, jsontok_token *token) {
+    size_t pos = parser->pos;
+    for (; pos < len; ++pos) {
+        unsigned char class = char_class[(unsigned char)js[pos]];
+        if (!class) continue;
+        if (class & CLASS_DELIMITER) {
+            token->end = (int)pos;
+            parser->pos = pos;
+            return 1;
+        }
+        parser->pos = pos;
+        return JSONTOK_ERROR_INVAL;
+    }
+    parser->pos = len;
+    return 0;
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Whether s[0, len) is a JSON number: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+static int is_number(const char *s, size_t len) {
+    size_t i = 0;
+    if (i < len && s[i] == '-') i++;
+    if (i >= len || !is_digit(s[i])) return 0;
+    if (s[i++] != '0') {
+        while (i < len && is_digit(s[i])) i++;
+    }
+    if (i < len && s[i] == '.') {
+        if (++i >= len || !is_digit(s[i])) return 0;
+        while (i < len && is_digit(s[i])) i++;
+    }
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+        if (++i < len && (s[i] == '+' || s[i] == '-')) i++;
+        if (i >= len || !is_digit(s[i])) return 0;
+        while (i < len && is_digit(s[i])) i++;
+    }
+    return i == len;
+}
+
+// A primitive is scanned up to the next delimiter, so `trueblah` or `01`
+// only fail here, once it is complete
+static int is_valid_primitive(const char *js, const jsontok_token *token) {
+    const char *s = js + token->start;
+    size_t len = (size_t)(token->end - token->start);
+    if (s[0] == 't') return len == 4 && memcmp(s, "true", 4) == 0;
+    if (s[0] == 'f') return len == 5 && memcmp(s, "false", 5) == 0;
+    if (s[0] == 'n') return len == 4 && memcmp(s, "null", 4) == 0;
+    return is_number(s, len);
+}
+
+static jsontok_token *start_token(jsontok_parser *parser, jsontok_token *tokens, int num_tokens, jsontok_type type, int start) {
+    if (parser->toknext >= num_tokens) return NULL;
+    jsontok_token *token = &tokens[parser->toknext++];
+    token->type = type;
+    token->start = start;
+    token->end = -1;
+    token->size = 0;
+    token->parent = parser->toksuper;
+    if (parser->toksuper >= 0) tokens[parser->toksuper].size++;
+    return token;
+}
+
+// Called after a value has been completed. Returns 1 if it was the root.
+static int finish_value(jsontok_parser *parser, jsontok_token *tokens) {
+    int super = parser->toksuper;
+    if (super < 0) return 1;
+    if (tokens[super].type == JSONTOK_STRING) {
+        // The value belonged to a key: go back to the object
+        parser->toksuper = tokens[super].parent;
+    }
+    parser->expect = EXPECT_COMMA_OR_CLOSE;
+    return 0;
+}
+
+static int expects_value(const jsontok_parser *parser) {
+    return parser->expect == EXPECT_VALUE || parser->expect == EXPECT_VALUE_OR_CLOSE;
+}
+
+int jsontok_parse(jsontok_parser *parser, const char *js, size_t len, jsontok_token *tokens, int num_tokens) {
+    while (1) {
+        if (parser->partial >= 0) {
+            jsontok_token *token = &tokens[parser->partial];
+            int status = token->type == JSONTOK_STRING
+                ? continue_string(parser, js, len, token)
+                : continue_primitive(parser, js, len, token);
+            if (status < 0) return status;
+            if (status == 0) return JSONTOK_ERROR_PART;
+            if (token->type == JSONTOK_PRIMITIVE && !is_valid_primitive(js, token)) {
+                parser->pos = (size_t)token->start;
+                return JSONTOK_ERROR_INVAL;
+            }
+            int index = parser->partial;
+            parser->partial = -1;
+            if (token->type == JSONTOK_STRING && !expects_value(parser)) {
+                // An object key: its value attaches to it after the colon
+                parser->toksuper = index;
+                parser->expect = EXPECT_COLON;
+            } else if (finish_value(parser, tokens)) {
+                return parser->toknext;
+            }
+            continue;
+        }
+
+        parser->pos = skip_whitespace(js, parser->pos, len);
+        if (parser->pos >= len) return JSONTOK_ERROR_PART;
+
+        char c = js[parser->pos];
+        switch (c) {
+            case '{':
+            case '[': {
+                if (!expects_value(parser)) return JSONTOK_ERROR_INVAL;
+                jsontok_type type = c == '{' ? JSONTOK_OBJECT : JSONTOK_ARRAY;
+                if (!start_token(parser, tokens, num_tokens, type, (int)parser->pos)) return JSONTOK_ERROR_NOMEM;
+                parser->toksuper = parser->toknext - 1;
+                parser->expect = c == '{' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE;
+                parser->pos++;
+                break;
+            }
+            case '}':
+            case ']': {
+                jsontok_type type = c == '}' ? JSONTOK_OBJECT : JSONTOK_ARRAY;
+                int empty_ok = c == '}' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE;
+                if (parser->expect != EXPECT_COMMA_OR_CLOSE && parser->expect != empty_ok) return JSONTOK_ERROR_INVAL;
+                int container = parser->toksuper;
+                if (container < 0 || tokens[container].type != type) return JSONTOK_ERROR_INVAL;
+                tokens[container].end = (int)parser->pos + 1;
+                parser->pos++;
+                parser->toksuper = tokens[container].parent;
+                if (finish_value(parser, tokens)) return parser->toknext;
+                break;
+            }
+            case '"': {
+                if (!expects_value(parser) && parser->expect != EXPECT_KEY && parser->expect != EXPECT_KEY_OR_CLOSE) {
+                    return JSONTOK_ERROR_INVAL;
+                }
+                if (!start_token(parser, tokens, num_tokens, JSONTOK_STRING, (int)parser->pos + 1)) return JSONTOK_ERROR_NOMEM;
+                parser->partial = parser->toknext - 1;
+                parser->pos++;
+                break;
+            }
+            case ':':
+                if (parser->expect != EXPECT_COLON) return JSONTOK_ERROR_INVAL;
+                parser->expect = EXPECT_VALUE;
+                parser->pos++;
+                break;
+            case ',':
+                if (parser->expect != EXPECT_COMMA_OR_CLOSE) return JSONTOK_ERROR_INVAL;
+                parser->expect = tokens[parser->toksuper].type == JSONTOK_OBJECT ? EXPECT_KEY : EXPECT_VALUE;
+                parser->pos++;
+                break;
+            default:
+                if (!expects_value(parser) || !strchr("-0123456789tfn", c)) return JSONTOK_ERROR_INVAL;
+                if (!start_token(parser, tokens, num_tokens, JSONTOK_PRIMITIVE, (int)parser->pos)) return JSONTOK_ERROR_NOMEM;
+                parser->partial = parser->toknext - 1;
+                break;
+        }
+    }
+}
+
+int jsontok_skip(const jsontok_token *tokens, int count, int i) {
+    int end = tokens[i].end;
+    int next = i + 1;
+    while (next < count && tokens[next].start < end) next++;
+    return next;
+}
+
+int jsontok_find_key(const char *js, const jsontok_token *tokens, int count, int obj, const char *key) {
+    if (tokens[obj].type != JSONTOK_OBJECT) return -1;
+    int i = obj + 1;
+    for (int k = 0; k < tokens[obj].size && i + 1 < count; ++k) {
+        if (jsontok_equals(js, &tokens[i], key)) return i + 1;
+        i = jsontok_skip(tokens, count, i + 1);
+    }
+    return -1;
+}
+
+int jsontok_equals(const char *js, const jsontok_token *token, const char *str) {
+    size_t len = (size_t)(token->end - token->start);
+    return strlen(str) == len && memcmp(js + token->start, str, len) == 0;
+}
+
+int jsontok_to_double(const char *js, const jsontok_token *token, double *out) {
+    char number[64];
+    size_t len = (size_t)(token->end - token->start);
+    if (token->type != JSONTOK_PRIMITIVE || len == 0 || len >= sizeof(number)) return -1;
+    // strtod would also take hex, inf, nan and other forms JSON does not allow
+    if (!is_number(js + token->start, len)) return -1;
+    memcpy(number, js + token->start, len);
+    number[len] = '\0';
+    errno = 0;
+    *out = strtod(number, NULL);
+    // Too large for a double (strtod gave +-HUGE_VAL); underflow to a tiny value is kept
+    if (errno == ERANGE && isinf(*out)) return -1;
+    return 0;
+}
+
+int jsontok_to_int(const char *js, const jsontok_token *token, int *out) {
+    char number[32];
+    size_t len = (size_t)(token->end - token->start);
+    if (token->type != JSONTOK_PRIMITIVE || len == 0 || len >= sizeof(number)) return -1;
+    memcpy(number, js + token->start, len);
+    number[len] = '\0';
+    char *end;
+    errno = 0;
+    long value = strtol(number, &end, 10);
+    if (*end != '\0' || errno == ERANGE || value < INT_MIN || value > INT_MAX) return -1;
+    *out = (int)value;
+    return 0;
+}
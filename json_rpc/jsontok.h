@@ -0,0 +1,65 @@
+// jsontok.h
+// Incremental JSON tokenizer used by the gateway to frame and parse client
+// messages. It never allocates: the caller owns the token array. Parsing can
+// stop at any byte (partial read or full token array) and resume later from
+// where it left off without rescanning what was already consumed.
+#ifndef JSONTOK_H
+#define JSONTOK_H
+
+#include <stddef.h>
+
+typedef enum {
+    JSONTOK_UNDEFINED = 0,
+    JSONTOK_OBJECT,
+    JSONTOK_ARRAY,
+    JSONTOK_STRING,
+    JSONTOK_PRIMITIVE // Number, true, false or null
+} jsontok_type;
+
+// Negative results of jsontok_parse
+#define JSONTOK_ERROR_NOMEM -1 // Token array is full; grow it and call again
+#define JSONTOK_ERROR_INVAL -2 // Invalid JSON at parser->pos
+#define JSONTOK_ERROR_PART  -3 // Value not complete yet; call again with more bytes
+
+// Offsets are relative to the start of the buffer given to jsontok_parse.
+// Strings span their contents without the quotes; escapes are left as is.
+typedef struct {
+    jsontok_type type;
+    int start;
+    int end;    // One past the last byte, -1 while the token is still open
+    int size;   // Objects: number of keys. Arrays: elements. Keys: 1
+    int parent; // Enclosing container or key, -1 for the root value
+} jsontok_token;
+
+typedef struct {
+    size_t pos;   // Next byte to examine
+    int toknext;  // Next free slot in the token array
+    int toksuper; // Innermost open container, or the key awaiting its value
+    int partial;  // String or primitive still being scanned, or -1
+    int expect;   // Grammar state: what may come next
+} jsontok_parser;
+
+void jsontok_init(jsontok_parser *parser);
+
+// Tokenizes the first complete JSON value in js[0, len). Returns the number
+// of tokens once the value is complete (parser->pos is then just past it),
+// or one of the JSONTOK_ERROR_* codes. After JSONTOK_ERROR_PART or
+// JSONTOK_ERROR_NOMEM the call may be repeated with the same buffer grown
+// at the end and/or a larger copy of the token array.
+int jsontok_parse(jsontok_parser *parser, const char *js, size_t len, jsontok_token *tokens, int num_tokens);
+
+// Index of the first token after the value at index i and everything in it
+int jsontok_skip(const jsontok_token *tokens, int count, int i);
+
+// Index of the value stored under key in the object at index obj, or -1
+int jsontok_find_key(const char *js, const jsontok_token *tokens, int count, int obj, const char *key);
+
+// Compares a string or primitive token with a NUL-terminated string
+int jsontok_equals(const char *js, const jsontok_token *token, const char *str);
+
+// Converts a primitive token holding a number. Return 0 on success, -1 if
+// the token is not a number (or, for jsontok_to_int, not an integer in range).
+int jsontok_to_double(const char *js, const jsontok_token *token, double *out);
+int jsontok_to_int(const char *js, const jsontok_token *token, int *out);
+
+#endif // JSONTOK_H
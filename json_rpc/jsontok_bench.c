@@ -0,0 +1,163 @@
+// jsontok_bench.c
+// Microbenchmark: the gateway's jsontok-based request parsing against the
+// strstr/sscanf parser it replaced. Both extract method, params and id from
+// the same requests; the larger ones carry an extra member ahead of "id" so
+// the cost of scanning the whole message shows up. Before jsontok the
+// gateway also ran a byte-by-byte framing scan over every message to find
+// where it ended; jsontok frames and tokenizes in the same pass, so the
+// fair comparison is against framing plus parsing.
+//
+// Build and run with `make bench`. jsontok_bench_scalar is the same program
+// built with -DJSONTOK_NO_SIMD, to compare against the SSE2 scanners.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jsontok.h"
+
+#define MAX_TOKENS 64
+
+// The previous parse_json_rpc_request, minus its error logging
+static int legacy_parse(const char *json_str, char *method, double *params, int *id) {
+    *id = -1;
+    const char *method_key = "\"method\": \"";
+    const char *method_start = strstr(json_str, method_key);
+    if (method_start == NULL) return -1;
+    method_start += strlen(method_key);
+    const char *method_end = strchr(method_start, '\"');
+    if (method_end == NULL || (size_t)(method_end - method_start) >= 256) return -1;
+    strncpy(method, method_start, method_end - method_start);
+    method[method_end - method_start] = '\0';
+
+    const char *params_key = "\"params\": [";
+    const char *params_start = strstr(json_str, params_key);
+    if (params_start == NULL) return -1;
+    params_start += strlen(params_key);
+    if (sscanf(params_start, "%lf, %lf]", &params[0], &params[1]) != 2 &&
+        sscanf(params_start, "%lf,%lf]", &params[0], &params[1]) != 2) {
+        return -1;
+    }
+
+    const char *id_key = "\"id\": ";
+    const char *id_start = strstr(json_str, id_key);
+    if (id_start == NULL) return -1;
+    id_start += strlen(id_key);
+    if (sscanf(id_start, "%d", id) != 1) return -1;
+    return 0;
+}
+
+// The previous find_client_message: locates the end of the first value
+static size_t legacy_frame(const char *buf, size_t len) {
+    int depth = 0, in_string = 0, escaped = 0;
+    for (size_t i = 0; i < len; ++i) {
+        char c = buf[i];
+        if (in_string) {
+            if (escaped) escaped = 0;
+            else if (c == '\\') escaped = 1;
+            else if (c == '"') in_string = 0;
+            continue;
+        }
+        if (c == '"') in_string = 1;
+        else if (c == '{' || c == '[') depth++;
+        else if ((c == '}' || c == ']') && --depth == 0) return i + 1;
+    }
+    return 0;
+}
+
+// The gateway's current extraction on top of jsontok
+static int jsontok_request_parse(const char *js, size_t len, char *method, double *params, int *id) {
+    jsontok_parser parser;
+    jsontok_token tokens[MAX_TOKENS];
+    jsontok_init(&parser);
+    int count = jsontok_parse(&parser, js, len, tokens, MAX_TOKENS);
+    if (count <= 0 || tokens[0].type != JSONTOK_OBJECT) return -1;
+
+    int id_index = jsontok_find_key(js, tokens, count, 0, "id");
+    if (id_index < 0 || jsontok_to_int(js, &tokens[id_index], id) != 0) return -1;
+    int method_index = jsontok_find_key(js, tokens, count, 0, "method");
+    if (method_index < 0 || tokens[method_index].type != JSONTOK_STRING) return -1;
+    int method_len = tokens[method_index].end - tokens[method_index].start;
+    if (method_len >= 256) return -1;
+    memcpy(method, js + tokens[method_index].start, method_len);
+    method[method_len] = '\0';
+    int params_index = jsontok_find_key(js, tokens, count, 0, "params");
+    if (params_index < 0 || tokens[params_index].type != JSONTOK_ARRAY || tokens[params_index].size != 2 ||
+        jsontok_to_double(js, &tokens[params_index + 1], &params[0]) != 0 ||
+        jsontok_to_double(js, &tokens[params_index + 2], &params[1]) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Builds a request with `padding` bytes of string data ahead of "id", in
+// the exact spacing the legacy parser requires
+static char *make_request(size_t padding) {
+    char *msg = malloc(padding + 256);
+    if (!msg) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int len = sprintf(msg, "{\"jsonrpc\": \"2.0\", \"method\": \"multiply\", \"params\": [12.5, -3.25], ");
+    if (padding > 0) {
+        len += sprintf(msg + len, "\"meta\": \"");
+        memset(msg + len, 'x', padding);
+        len += padding;
+        len += sprintf(msg + len, "\", ");
+    }
+    sprintf(msg + len, "\"id\": 42}");
+    return msg;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    size_t paddings[] = {0, 256, 4096, 32768};
+    char method[256];
+    double params[2];
+    int id;
+
+    printf("%-8s %14s %20s %14s %9s\n", "bytes", "legacy parse", "legacy frame+parse", "jsontok", "speedup");
+    for (size_t p = 0; p < sizeof(paddings) / sizeof(paddings[0]); ++p) {
+        char *msg = make_request(paddings[p]);
+        size_t len = strlen(msg);
+        // Keep the total work per size roughly constant
+        long n = iterations / (1 + (long)(paddings[p] / 256));
+        if (n < 1000) n = 1000;
+
+        if (legacy_parse(msg, method, params, &id) != 0 || id != 42 ||
+            jsontok_request_parse(msg, len, method, params, &id) != 0 || id != 42 || strcmp(method, "multiply") != 0) {
+            fprintf(stderr, "Parsers disagree on the %zu byte request\n", len);
+            return EXIT_FAILURE;
+        }
+
+        volatile int sink = 0;
+        double start = now_ns();
+        for (long i = 0; i < n; ++i) {
+            sink += legacy_parse(msg, method, params, &id) + id;
+        }
+        double legacy = (now_ns() - start) / n;
+
+        start = now_ns();
+        for (long i = 0; i < n; ++i) {
+            sink += (int)legacy_frame(msg, len) + legacy_parse(msg, method, params, &id) + id;
+        }
+        double legacy_framed = (now_ns() - start) / n;
+
+        start = now_ns();
+        for (long i = 0; i < n; ++i) {
+            sink += jsontok_request_parse(msg, len, method, params, &id) + id;
+        }
+        double tokenized = (now_ns() - start) / n;
+        (void)sink;
+
+        printf("%-8zu %11.1f ns %17.1f ns %11.1f ns %8.2fx\n", len, legacy, legacy_framed, tokenized, legacy_framed / tokenized);
+        free(msg);
+    }
+    return 0;
+}
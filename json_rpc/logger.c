@@ -0,0 +1,451 @@
+// logger.c
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_SLOTS 2048 // Power of two
+#define LOG_ARG_BYTES 1000  // Captured argument space per record
+#define LOG_STRING_RESERVE 64 // Kept free behind a long string for the arguments after it
+#define LOG_LINE_MAX 4096
+#define LOG_OUTPUT_BUFFER 65536
+#define LOG_IDLE_SLEEP_MAX_US 10000
+
+LogLevel log_min_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR", "CRITICAL"};
+
+// One record. The sequence number hands the slot back and forth between
+// producers and the writer (bounded MPMC queue after D. Vyukov).
+typedef struct {
+    _Atomic size_t sequence;
+    const char *fmt;
+    time_t time_sec;
+    LogLevel level;
+    int truncated; // Ran out of argument space; the rest of fmt is not formatted
+    unsigned char args[LOG_ARG_BYTES];
+} LogSlot;
+
+static LogSlot ring[LOG_RING_SLOTS];
+static _Atomic size_t enqueue_pos;
+static size_t dequeue_pos; // Writer thread only
+static atomic_ulong dropped_records;
+static atomic_int writer_stopping;
+static int async_enabled; // Writer thread running and owned by this process
+static pthread_t writer_thread;
+
+typedef enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_BIG_L } LengthModifier;
+
+// One parsed conversion specification
+typedef struct {
+    const char *start;   // The '%'
+    size_t text_len;     // Through the conversion character
+    size_t prefix_len;   // '%', flags and width, without precision or length
+    int width_star;
+    int precision_star;
+    int precision;       // -1 if none, or given by '*'
+    LengthModifier length;
+    char conversion;
+} FormatSpec;
+
+static const char *parse_spec(const char *p, FormatSpec *spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->start = p++;
+    spec->precision = -1;
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        spec->width_star = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    spec->prefix_len = p - spec->start;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->precision_star = 1;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9') spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
+    }
+    switch (*p) {
+        case 'h': spec->length = p[1] == 'h' ? LEN_HH : LEN_H; p += p[1] == 'h' ? 2 : 1; break;
+        case 'l': spec->length = p[1] == 'l' ? LEN_LL : LEN_L; p += p[1] == 'l' ? 2 : 1; break;
+        case 'z': spec->length = LEN_Z; p++; break;
+        case 'j': spec->length = LEN_J; p++; break;
+        case 't': spec->length = LEN_T; p++; break;
+        case 'L': spec->length = LEN_BIG_L; p++; break;
+    }
+    spec->conversion = *p;
+    if (*p) p++;
+    spec->text_len = p - spec->start;
+    return p;
+}
+
+static int is_integer_conversion(char c) { return c && strchr("diouxXc", c) != NULL; }
+static int is_float_conversion(char c) { return c && strchr("fFeEgGaA", c) != NULL; }
+
+typedef struct {
+    unsigned char *pos;
+    unsigned char *end;
+} ArgBuffer;
+
+static int put_bytes(ArgBuffer *buf, const void *data, size_t len) {
+    if ((size_t)(buf->end - buf->pos) < len) return -1;
+    memcpy(buf->pos, data, len);
+    buf->pos += len;
+    return 0;
+}
+
+static int get_bytes(ArgBuffer *buf, void *data, size_t len) {
+    if ((size_t)(buf->end - buf->pos) < len) return -1;
+    memcpy(data, buf->pos, len);
+    buf->pos += len;
+    return 0;
+}
+
+// Stores a string as an int length and its bytes, cut short if needed to
+// leave room for later arguments
+static int put_string(ArgBuffer *buf, const char *s, int max_len) {
+    if (!s) s = "(null)";
+    size_t len = max_len >= 0 ? strnlen(s, max_len) : strlen(s);
+    size_t room = buf->end - buf->pos;
+    if (room < sizeof(int)) return -1;
+    room -= sizeof(int);
+    if (len > room) len = room > LOG_STRING_RESERVE ? room - LOG_STRING_RESERVE : room;
+    int stored = (int)len;
+    put_bytes(buf, &stored, sizeof(stored));
+    return put_bytes(buf, s, len);
+}
+
+// Copies the arguments fmt consumes into buf, in order. Returns -1 if they
+// did not all fit or fmt has a conversion this logger does not support.
+static int capture_args(ArgBuffer *buf, const char *fmt, va_list ap) {
+    const char *p = fmt;
+    while ((p = strchr(p, '%')) != NULL) {
+        FormatSpec spec;
+        p = parse_spec(p, &spec);
+        if (spec.conversion == '%') continue;
+        if (spec.width_star) {
+            int width = va_arg(ap, int);
+            if (put_bytes(buf, &width, sizeof(width)) != 0) return -1;
+        }
+        if (spec.precision_star) {
+            spec.precision = va_arg(ap, int);
+            if (put_bytes(buf, &spec.precision, sizeof(spec.precision)) != 0) return -1;
+        }
+        if (is_integer_conversion(spec.conversion)) {
+            uint64_t value;
+            switch (spec.length) {
+                case LEN_L: value = (uint64_t)va_arg(ap, long); break;
+                case LEN_LL: value = (uint64_t)va_arg(ap, long long); break;
+                case LEN_Z: value = (uint64_t)va_arg(ap, size_t); break;
+                case LEN_J: value = (uint64_t)va_arg(ap, intmax_t); break;
+                case LEN_T: value = (uint64_t)va_arg(ap, ptrdiff_t); break;
+                default: value = (uint64_t)va_arg(ap, int); break;
+            }
+            if (put_bytes(buf, &value, sizeof(value)) != 0) return -1;
+        } else if (is_float_conversion(spec.conversion)) {
+            if (spec.length == LEN_BIG_L) {
+                long double value = va_arg(ap, long double);
+                if (put_bytes(buf, &value, sizeof(value)) != 0) return -1;
+            } else {
+                double value = va_arg(ap, double);
+                if (put_bytes(buf, &value, sizeof(value)) != 0) return -1;
+            }
+        } else if (spec.conversion == 's') {
+            if (put_string(buf, va_arg(ap, const char *), spec.precision) != 0) return -1;
+        } else if (spec.conversion == 'm') {
+            // errno means nothing by the time the writer runs
+            if (put_string(buf, strerror(errno), -1) != 0) return -1;
+        } else if (spec.conversion == 'p') {
+            void *value = va_arg(ap, void *);
+            if (put_bytes(buf, &value, sizeof(value)) != 0) return -1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// snprintf with the spec's own text and however many '*' arguments it has
+#define FORMAT_ARG(out, room, text, spec, width, precision, value)                                   \
+    ((spec).width_star && (spec).precision_star ? snprintf(out, room, text, width, precision, value) \
+     : (spec).width_star                        ? snprintf(out, room, text, width, value)            \
+     : (spec).precision_star                    ? snprintf(out, room, text, precision, value)        \
+                                                : snprintf(out, room, text, value))
+
+// Formats a record's captured arguments into out, which has room bytes.
+// Returns the length written.
+static size_t format_record(char *out, size_t room, const char *fmt, ArgBuffer *args, int truncated) {
+    size_t len = 0;
+    const char *p = fmt;
+    while (*p && len + 1 < room) {
+        const char *percent = strchr(p, '%');
+        size_t literal = percent ? (size_t)(percent - p) : strlen(p);
+        if (literal > room - 1 - len) literal = room - 1 - len;
+        memcpy(out + len, p, literal);
+        len += literal;
+        if (!percent || len + 1 >= room) break;
+
+        FormatSpec spec;
+        p = parse_spec(percent, &spec);
+        if (spec.conversion == '%') {
+            out[len++] = '%';
+            continue;
+        }
+        char text[64];
+        int width = 0, precision = 0, written = -1;
+        if (spec.text_len >= sizeof(text) - 4 ||
+            (spec.width_star && get_bytes(args, &width, sizeof(width)) != 0) ||
+            (spec.precision_star && get_bytes(args, &precision, sizeof(precision)) != 0)) {
+            break;
+        }
+        memcpy(text, spec.start, spec.text_len);
+        text[spec.text_len] = '\0';
+
+        if (is_integer_conversion(spec.conversion)) {
+            uint64_t value;
+            if (get_bytes(args, &value, sizeof(value)) != 0) break;
+            switch (spec.length) {
+                case LEN_L: written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, (long)value); break;
+                case LEN_LL: written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, (long long)value); break;
+                case LEN_Z: written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, (size_t)value); break;
+                case LEN_J: written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, (intmax_t)value); break;
+                case LEN_T: written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, (ptrdiff_t)value); break;
+                default: written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, (int)value); break;
+            }
+        } else if (is_float_conversion(spec.conversion)) {
+            if (spec.length == LEN_BIG_L) {
+                long double value;
+                if (get_bytes(args, &value, sizeof(value)) != 0) break;
+                written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, value);
+            } else {
+                double value;
+                if (get_bytes(args, &value, sizeof(value)) != 0) break;
+                written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, value);
+            }
+        } else if (spec.conversion == 's' || spec.conversion == 'm') {
+            // Printed with the captured length as its precision
+            int string_len;
+            if (get_bytes(args, &string_len, sizeof(string_len)) != 0 ||
+                (size_t)(args->end - args->pos) < (size_t)string_len) {
+                break;
+            }
+            memcpy(text + spec.prefix_len, ".*s", 4);
+            const char *s = (const char *)args->pos;
+            args->pos += string_len;
+            written = spec.width_star ? snprintf(out + len, room - len, text, width, string_len, s)
+                                      : snprintf(out + len, room - len, text, string_len, s);
+        } else if (spec.conversion == 'p') {
+            void *value;
+            if (get_bytes(args, &value, sizeof(value)) != 0) break;
+            written = FORMAT_ARG(out + len, room - len, text, spec, width, precision, value);
+        }
+        if (written < 0) break;
+        len += (size_t)written < room - len ? (size_t)written : room - 1 - len;
+    }
+    if (truncated && len + 4 < room) {
+        memcpy(out + len, "...", 3);
+        len += 3;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// "[YYYY-MM-DD HH:MM:SS] [LEVEL] "; the date part is reformatted only when
+// the second changes
+static size_t format_prefix(char *out, size_t room, time_t when, LogLevel level) {
+    static __thread time_t cached_sec = -1;
+    static __thread char cached_text[sizeof("YYYY-MM-DD HH:MM:SS")];
+    if (when != cached_sec) {
+        struct tm tm_buf;
+        localtime_r(&when, &tm_buf);
+        strftime(cached_text, sizeof(cached_text), "%Y-%m-%d %H:%M:%S", &tm_buf);
+        cached_sec = when;
+    }
+    int written = snprintf(out, room, "[%s] [%s] ", cached_text, level_names[level]);
+    return written < 0 ? 0 : ((size_t)written < room ? (size_t)written : room - 1);
+}
+
+static time_t log_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+static void write_synchronously(LogLevel level, const char *fmt, va_list ap) {
+    char line[LOG_LINE_MAX];
+    size_t len = format_prefix(line, sizeof(line) - 1, log_clock(), level);
+    int written = vsnprintf(line + len, sizeof(line) - 1 - len, fmt, ap);
+    if (written > 0) len += (size_t)written < sizeof(line) - 1 - len ? (size_t)written : sizeof(line) - 2 - len;
+    line[len++] = '\n';
+    write_all(line, len);
+}
+
+void log_write(LogLevel level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (!async_enabled) {
+        write_synchronously(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // Full: the writer has not freed this slot yet
+            atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+            va_end(ap);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->fmt = fmt;
+    slot->time_sec = log_clock();
+    slot->level = level;
+    ArgBuffer args = { slot->args, slot->args + LOG_ARG_BYTES };
+    slot->truncated = capture_args(&args, fmt, ap) != 0;
+    va_end(ap);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+}
+
+// Moves every queued record to out, writing out whenever it fills up.
+// Returns the number of records taken.
+static int drain_ring(char *out, size_t *out_len) {
+    int taken = 0;
+    for (;;) {
+        LogSlot *slot = &ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence != dequeue_pos + 1) break;
+
+        if (LOG_OUTPUT_BUFFER - *out_len < LOG_LINE_MAX) {
+            write_all(out, *out_len);
+            *out_len = 0;
+        }
+        char *line = out + *out_len;
+        size_t len = format_prefix(line, LOG_LINE_MAX - 1, slot->time_sec, slot->level);
+        ArgBuffer args = { slot->args, slot->args + LOG_ARG_BYTES };
+        len += format_record(line + len, LOG_LINE_MAX - 1 - len, slot->fmt, &args, slot->truncated);
+        line[len++] = '\n';
+        *out_len += len;
+
+        atomic_store_explicit(&slot->sequence, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        dequeue_pos++;
+        taken++;
+    }
+    return taken;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    static char out[LOG_OUTPUT_BUFFER];
+    size_t out_len = 0;
+    unsigned long dropped_reported = 0;
+    int idle_us = 0;
+
+    for (;;) {
+        int stopping = atomic_load(&writer_stopping);
+        int taken = drain_ring(out, &out_len);
+
+        unsigned long dropped = atomic_load_explicit(&dropped_records, memory_order_relaxed);
+        if (dropped != dropped_reported) {
+            if (LOG_OUTPUT_BUFFER - out_len < LOG_LINE_MAX) {
+                write_all(out, out_len);
+                out_len = 0;
+            }
+            char *line = out + out_len;
+            size_t len = format_prefix(line, LOG_LINE_MAX - 1, log_clock(), LOG_LEVEL_WARNING);
+            len += snprintf(line + len, LOG_LINE_MAX - 1 - len, "Logger dropped %lu records: queue full (%lu dropped in total).",
+                            dropped - dropped_reported, dropped);
+            line[len++] = '\n';
+            out_len += len;
+            dropped_reported = dropped;
+        }
+        if (out_len > 0) {
+            write_all(out, out_len);
+            out_len = 0;
+        }
+
+        if (taken > 0) {
+            idle_us = 0;
+            continue;
+        }
+        if (stopping) break; // Nothing was queued once stopping was seen
+        idle_us = idle_us == 0 ? 100 : (idle_us * 2 > LOG_IDLE_SLEEP_MAX_US ? LOG_IDLE_SLEEP_MAX_US : idle_us * 2);
+        usleep(idle_us);
+    }
+    return NULL;
+}
+
+// A forked child has no writer thread; it logs synchronously until exec
+static void after_fork_in_child() {
+    async_enabled = 0;
+}
+
+int logger_start() {
+    static int atfork_registered = 0;
+    if (async_enabled) return 0;
+    for (size_t i = 0; i < LOG_RING_SLOTS; ++i) atomic_store_explicit(&ring[i].sequence, i, memory_order_relaxed);
+    atomic_store(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    atomic_store(&writer_stopping, 0);
+    if (!atfork_registered) {
+        if (pthread_atfork(NULL, NULL, after_fork_in_child) != 0) return -1;
+        atfork_registered = 1;
+    }
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) return -1;
+    async_enabled = 1;
+    return 0;
+}
+
+void logger_stop() {
+    if (!async_enabled) return;
+    async_enabled = 0; // Anything logged from here on is written directly
+    atomic_store(&writer_stopping, 1);
+    pthread_join(writer_thread, NULL);
+}
+
+int log_level_from_name(const char *name) {
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); ++i) {
+        if (strcasecmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *log_level_name(LogLevel level) {
+    return level_names[level];
+}
@@ -0,0 +1,46 @@
+// logger.h
+// Asynchronous, level-filtered logging for the gateway. LOG() checks the
+// level before evaluating any argument, so filtered-out messages cost one
+// comparison. Messages that pass are not formatted by the caller: the format
+// string and raw argument values are copied into a slot of a lock-free ring,
+// and a background writer thread formats them, stamps them with a cached
+// wall-clock time and writes them to stdout in batches. When the ring is
+// full, records are dropped and counted rather than blocking the caller;
+// the writer reports the count.
+//
+// Formats must be string literals (the writer reads them later). Supported
+// conversions: d i u x X o c with hh/h/l/ll/z/j/t, f F e E g G a A, s, p,
+// %% and the * width/precision. Strings longer than a slot has room for are
+// cut short.
+//
+// Before logger_start, after logger_stop and in a forked child, records are
+// formatted and written synchronously.
+#ifndef LOGGER_H
+#define LOGGER_H
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_CRITICAL
+} LogLevel;
+
+extern LogLevel log_min_level; // Records below this level are discarded
+
+#define LOG_ENABLED(level) (LOG_LEVEL_##level >= log_min_level)
+#define LOG(level, ...) \
+    do { if (LOG_ENABLED(level)) log_write(LOG_LEVEL_##level, __VA_ARGS__); } while (0)
+
+void log_write(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Parses "debug", "info", "warning", "error" or "critical". Returns -1 if unknown.
+int log_level_from_name(const char *name);
+const char *log_level_name(LogLevel level);
+
+// Starts the writer thread; 0 on success. logger_stop writes out everything
+// queued and stops it. Both are called from the main thread only.
+int logger_start(void);
+void logger_stop(void);
+
+#endif // LOGGER_H
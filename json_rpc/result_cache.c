@@ -0,0 +1,107 @@
+// result_cache.c
+#include "result_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int result_cache_init(ResultCache *cache, size_t capacity) {
+    memset(cache, 0, sizeof(*cache));
+    if (capacity == 0) return 0;
+    size_t set_count = 1;
+    while (set_count * RESULT_CACHE_WAYS < capacity) set_count <<= 1;
+    cache->entries = calloc(set_count * RESULT_CACHE_WAYS, sizeof(ResultCacheEntry));
+    cache->hands = calloc(set_count, 1);
+    if (!cache->entries || !cache->hands) {
+        result_cache_free(cache);
+        return -1;
+    }
+    cache->set_count = set_count;
+    return 0;
+}
+
+void result_cache_free(ResultCache *cache) {
+    free(cache->entries);
+    free(cache->hands);
+    cache->entries = NULL;
+    cache->hands = NULL;
+    cache->set_count = 0;
+}
+
+static uint64_t double_bits(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+// splitmix64 finalizer over the combined key
+static uint64_t hash_key(int op, uint64_t a_bits, uint64_t b_bits) {
+    uint64_t h = a_bits ^ (b_bits * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)op << 56);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+static ResultCacheEntry *find_set(ResultCache *cache, int op, uint64_t a_bits, uint64_t b_bits, size_t *set_out) {
+    size_t set = hash_key(op, a_bits, b_bits) & (cache->set_count - 1);
+    *set_out = set;
+    return &cache->entries[set * RESULT_CACHE_WAYS];
+}
+
+int result_cache_lookup(ResultCache *cache, int op, double a, double b, double *value_out, char *error_out, size_t error_out_size) {
+    if (cache->set_count == 0) return -1;
+    uint64_t a_bits = double_bits(a), b_bits = double_bits(b);
+    size_t set;
+    ResultCacheEntry *ways = find_set(cache, op, a_bits, b_bits, &set);
+    for (int i = 0; i < RESULT_CACHE_WAYS; ++i) {
+        ResultCacheEntry *entry = &ways[i];
+        if (entry->op != op || entry->a_bits != a_bits || entry->b_bits != b_bits) continue;
+        entry->referenced = 1;
+        cache->hits++;
+        if (entry->is_error) {
+            snprintf(error_out, error_out_size, "%s", entry->error);
+            return 1;
+        }
+        *value_out = entry->value;
+        return 0;
+    }
+    cache->misses++;
+    return -1;
+}
+
+void result_cache_store(ResultCache *cache, int op, double a, double b, double value, const char *error) {
+    if (cache->set_count == 0) return;
+    uint64_t a_bits = double_bits(a), b_bits = double_bits(b);
+    size_t set;
+    ResultCacheEntry *ways = find_set(cache, op, a_bits, b_bits, &set);
+
+    ResultCacheEntry *target = NULL;
+    for (int i = 0; i < RESULT_CACHE_WAYS && !target; ++i) {
+        if (ways[i].op == op && ways[i].a_bits == a_bits && ways[i].b_bits == b_bits) target = &ways[i];
+    }
+    for (int i = 0; i < RESULT_CACHE_WAYS && !target; ++i) {
+        if (ways[i].op == 0) target = &ways[i];
+    }
+    if (!target) {
+        // Terminates within two turns of the hand: the first clears every bit
+        unsigned char hand = cache->hands[set];
+        while (ways[hand].referenced) {
+            ways[hand].referenced = 0;
+            hand = (hand + 1) % RESULT_CACHE_WAYS;
+        }
+        target = &ways[hand];
+        cache->hands[set] = (hand + 1) % RESULT_CACHE_WAYS;
+        cache->evictions++;
+    }
+
+    target->op = op;
+    target->a_bits = a_bits;
+    target->b_bits = b_bits;
+    target->referenced = 0;
+    target->is_error = error != NULL;
+    target->value = error ? 0.0 : value;
+    snprintf(target->error, sizeof(target->error), "%s", error ? error : "");
+}
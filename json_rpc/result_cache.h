@@ -0,0 +1,55 @@
+// result_cache.h
+// Bounded memo of calculator results for the gateway. Calculator ops are
+// pure, so an answer can be reused for the same op and the same operands,
+// compared by their exact bit patterns. The table is split into sets of
+// RESULT_CACHE_WAYS entries picked by hash; within a set, CLOCK picks the
+// entry to replace: the hand clears referenced bits until it finds an entry
+// not used since its last pass. Lookups and inserts are O(RESULT_CACHE_WAYS).
+// Not thread-safe; the gateway calls it from its event loop only.
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESULT_CACHE_WAYS 8
+#define RESULT_CACHE_MAX_ERROR 48 // Backend error messages are short ("Division by zero")
+
+typedef struct {
+    uint64_t a_bits;
+    uint64_t b_bits;
+    int op;         // 0 marks an empty entry
+    int referenced; // Used since the hand last passed
+    int is_error;
+    double value;
+    char error[RESULT_CACHE_MAX_ERROR];
+} ResultCacheEntry;
+
+typedef struct {
+    ResultCacheEntry *entries; // set_count * RESULT_CACHE_WAYS
+    unsigned char *hands;      // CLOCK hand per set
+    size_t set_count;          // Power of two, 0 when the cache is disabled
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} ResultCache;
+
+// Sizes the cache for at least `capacity` entries, rounded up to a power of
+// two. A capacity of 0 leaves it disabled. Returns -1 if out of memory.
+int result_cache_init(ResultCache *cache, size_t capacity);
+
+void result_cache_free(ResultCache *cache);
+
+static inline size_t result_cache_capacity(const ResultCache *cache) {
+    return cache->set_count * RESULT_CACHE_WAYS;
+}
+
+// Looks up op (non-zero) applied to a and b. Returns -1 on a miss, 0 with
+// *value_out, or 1 with the cached error message copied to error_out.
+int result_cache_lookup(ResultCache *cache, int op, double a, double b, double *value_out, char *error_out, size_t error_out_size);
+
+// Records an answer, replacing an older one for the same key if present.
+// error is NULL for a value.
+void result_cache_store(ResultCache *cache, int op, double a, double b, double value, const char *error);
+
+#endif // RESULT_CACHE_H
@@ -0,0 +1,122 @@
+// route_bench.c
+// Microbenchmark: the cost of building a request's candidate list, as the
+// number of registered backends and advertised operations grows. The legacy
+// path is the per-request scan the gateway used before the route index:
+// copy and strtok every backend's operation list, comparing each entry with
+// the method name. The indexed path is one interned-name lookup plus a read
+// of the precomputed candidate array.
+//
+// Build and run with `make bench`, or `./route_bench [iterations]`.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "route_index.h"
+
+#define OPS_LEN 256 // Same size as RegisteredBackend.operations
+
+typedef struct {
+    int is_active;
+    char operations[OPS_LEN];
+} BenchBackend;
+
+// The previous is_operation_supported
+static int legacy_supported(const BenchBackend *backend, const char *operation_name) {
+    if (!backend->is_active) return 0;
+    char ops_copy[OPS_LEN];
+    strncpy(ops_copy, backend->operations, sizeof(ops_copy) - 1);
+    ops_copy[sizeof(ops_copy) - 1] = '\0';
+    char *saveptr;
+    char *token = strtok_r(ops_copy, ",", &saveptr);
+    while (token != NULL) {
+        if (strcmp(token, operation_name) == 0) return 1;
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    return 0;
+}
+
+static int legacy_candidates(const BenchBackend *backends, int count, const char *op, int *out) {
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        if (legacy_supported(&backends[i], op)) out[n++] = i;
+    }
+    return n;
+}
+
+static int indexed_candidates(const RouteIndex *index, const char *op, int *out) {
+    int op_id = route_find_op(index, op, strlen(op));
+    if (op_id < 0) return 0;
+    int n;
+    const int *slots = route_candidates(index, op_id, &n);
+    // The gateway reads the slots in place; copy one so the work is not elided
+    if (n > 0) out[0] = slots[0];
+    return n;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    int backend_counts[] = {2, 8, 20, 64};
+    int op_counts[] = {4, 16, 40}; // 40 short names still fit in one operations field
+    static BenchBackend backends[ROUTE_MAX_BACKENDS];
+    static RouteIndex index;
+    int out[ROUTE_MAX_BACKENDS];
+    char op_names[ROUTE_MAX_OPS][16];
+
+    printf("%-9s %-5s %-11s %14s %14s %9s\n", "backends", "ops", "candidates", "legacy scan", "route index", "speedup");
+    for (size_t b = 0; b < sizeof(backend_counts) / sizeof(backend_counts[0]); ++b) {
+        for (size_t o = 0; o < sizeof(op_counts) / sizeof(op_counts[0]); ++o) {
+            int nb = backend_counts[b], nops = op_counts[o];
+            // Each backend serves every op but one, so every op has
+            // several candidates and lists are close to full length
+            route_index_init(&index);
+            for (int op = 0; op < nops; ++op) snprintf(op_names[op], sizeof(op_names[op]), "op_%d", op);
+            for (int i = 0; i < nb; ++i) {
+                int len = 0;
+                backends[i].operations[0] = '\0';
+                for (int op = 0; op < nops; ++op) {
+                    if (op == i % nops) continue;
+                    len += snprintf(backends[i].operations + len, OPS_LEN - len, "%s%s", len ? "," : "", op_names[op]);
+                }
+                backends[i].is_active = 1;
+                route_set_backend(&index, i, backends[i].operations, 1);
+            }
+
+            int expected = 0;
+            for (int op = 0; op < nops; ++op) {
+                int legacy_n = legacy_candidates(backends, nb, op_names[op], out);
+                if (legacy_n != indexed_candidates(&index, op_names[op], out)) {
+                    fprintf(stderr, "Candidate counts disagree for %s with %d backends\n", op_names[op], nb);
+                    return EXIT_FAILURE;
+                }
+                expected += legacy_n;
+            }
+
+            // Keep the total work per row roughly constant
+            long n = iterations / nb;
+            if (n < 1000) n = 1000;
+            volatile int sink = 0;
+            double start = now_ns();
+            for (long i = 0; i < n; ++i) {
+                sink += legacy_candidates(backends, nb, op_names[i % nops], out);
+            }
+            double legacy = (now_ns() - start) / n;
+
+            start = now_ns();
+            for (long i = 0; i < n; ++i) {
+                sink += indexed_candidates(&index, op_names[i % nops], out);
+            }
+            double indexed = (now_ns() - start) / n;
+            (void)sink;
+
+            printf("%-9d %-5d %-11.1f %11.1f ns %11.1f ns %8.1fx\n", nb, nops, (double)expected / nops, legacy, indexed, legacy / indexed);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+// route_index.c
+#include "route_index.h"
+
+#include <string.h>
+
+void route_index_init(RouteIndex *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+// FNV-1a
+static unsigned int hash_name(const char *name, int name_len) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < name_len; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Bucket holding name, or the empty bucket where it would go
+static int find_bucket(const RouteIndex *index, const char *name, int name_len) {
+    unsigned int bucket = hash_name(name, name_len) & (ROUTE_HASH_SIZE - 1);
+    while (index->op_hash[bucket]) {
+        const char *existing = index->op_names[index->op_hash[bucket] - 1];
+        if (strncmp(existing, name, name_len) == 0 && existing[name_len] == '\0') break;
+        bucket = (bucket + 1) & (ROUTE_HASH_SIZE - 1);
+    }
+    return (int)bucket;
+}
+
+int route_find_op(const RouteIndex *index, const char *name, int name_len) {
+    if (name_len <= 0 || name_len >= ROUTE_MAX_OP_NAME) return -1;
+    return index->op_hash[find_bucket(index, name, name_len)] - 1;
+}
+
+int route_intern_op(RouteIndex *index, const char *name, int name_len) {
+    if (name_len <= 0 || name_len >= ROUTE_MAX_OP_NAME) return -1;
+    int bucket = find_bucket(index, name, name_len);
+    if (index->op_hash[bucket]) return index->op_hash[bucket] - 1;
+    if (index->op_count == ROUTE_MAX_OPS) return -1;
+
+    int op_id = index->op_count++;
+    memcpy(index->op_names[op_id], name, name_len);
+    index->op_names[op_id][name_len] = '\0';
+    index->op_hash[bucket] = (unsigned char)(op_id + 1);
+    return op_id;
+}
+
+static void rebuild_candidates(RouteIndex *index, int op_id) {
+    uint64_t bit = (uint64_t)1 << op_id;
+    int count = 0;
+    for (int slot = 0; slot < index->backend_count; ++slot) {
+        if (index->backend_ops[slot] & bit) index->candidates[op_id][count++] = slot;
+    }
+    index->candidate_count[op_id] = count;
+}
+
+int route_set_backend(RouteIndex *index, int slot, const char *ops_csv, int active) {
+    if (slot < 0 || slot >= ROUTE_MAX_BACKENDS) return -1;
+    uint64_t mask = 0;
+    int dropped = 0;
+    if (active && ops_csv) {
+        const char *p = ops_csv;
+        while (*p) {
+            const char *end = strchr(p, ',');
+            int len = end ? (int)(end - p) : (int)strlen(p);
+            if (len > 0) {
+                int op_id = route_intern_op(index, p, len);
+                if (op_id < 0) dropped++;
+                else mask |= (uint64_t)1 << op_id;
+            }
+            if (!end) break;
+            p = end + 1;
+        }
+    }
+
+    if (slot >= index->backend_count) index->backend_count = slot + 1;
+    uint64_t changed = index->backend_ops[slot] ^ mask;
+    index->backend_ops[slot] = mask;
+    // Only the ops this backend gained or lost need new candidate arrays
+    while (changed) {
+        int op_id = __builtin_ctzll(changed);
+        rebuild_candidates(index, op_id);
+        changed &= changed - 1;
+    }
+    return dropped;
+}
@@ -0,0 +1,47 @@
+// route_index.h
+// Operation-to-backend routing index for the gateway. Operation names are
+// interned to small integer ids once, when backends register; each backend
+// slot gets a bitmask of the ops it serves, and each op keeps the array of
+// backend slots that can serve it. Routing a request is then a single name
+// lookup followed by an array read, with no string splitting.
+#ifndef ROUTE_INDEX_H
+#define ROUTE_INDEX_H
+
+#include <stdint.h>
+
+#define ROUTE_MAX_OPS 64       // Bits in a capability mask
+#define ROUTE_MAX_BACKENDS 64
+#define ROUTE_MAX_OP_NAME 32
+#define ROUTE_HASH_SIZE 128    // Open-addressing table, kept at most half full
+
+typedef struct {
+    int op_count;
+    char op_names[ROUTE_MAX_OPS][ROUTE_MAX_OP_NAME];
+    unsigned char op_hash[ROUTE_HASH_SIZE]; // op id + 1, 0 marks an empty bucket
+    uint64_t backend_ops[ROUTE_MAX_BACKENDS]; // Ops each backend slot serves, 0 if inactive
+    int backend_count; // Highest slot in use + 1
+    int candidate_count[ROUTE_MAX_OPS];
+    int candidates[ROUTE_MAX_OPS][ROUTE_MAX_BACKENDS]; // Backend slots per op, ascending
+} RouteIndex;
+
+void route_index_init(RouteIndex *index);
+
+// Returns the id of an op name, adding it if it is new. Returns -1 if the
+// name is empty or too long, or all ROUTE_MAX_OPS ids are taken.
+int route_intern_op(RouteIndex *index, const char *name, int name_len);
+
+// Returns the id of a known op name, or -1
+int route_find_op(const RouteIndex *index, const char *name, int name_len);
+
+// Replaces the ops served by a backend slot with the comma-separated list
+// ops_csv (ignored when active is 0) and updates the candidate arrays.
+// Returns the number of listed ops that could not be interned.
+int route_set_backend(RouteIndex *index, int slot, const char *ops_csv, int active);
+
+// Backend slots that serve op_id, in slot order
+static inline const int *route_candidates(const RouteIndex *index, int op_id, int *count) {
+    *count = index->candidate_count[op_id];
+    return index->candidates[op_id];
+}
+
+#endif // ROUTE_INDEX_H
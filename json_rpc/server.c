@@ -3,6 +3,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY for pooled backend connections
 #include <unistd.h>
 #include <sys/types.h> // Added for pid_t
 #include <sys/wait.h>  // Added for waitpid
@@ -10,8 +11,21 @@
 #include <getopt.h>    // Added for getopt_long
 #include <time.h>      // For logging timestamp
 #include <arpa/inet.h> // Added for inet_ntoa and other network functions
-#include <sys/select.h> // Added for select()
+#include <sys/epoll.h> // Event loop for clients, discovery and backend calls
 #include <fcntl.h>     // Added for fcntl O_NONBLOCK
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>  // offsetof
+#include <math.h>    // isfinite
+
+#include "jsontok.h" // Incremental tokenizer for client messages
+#include "route_index.h" // Op-to-backend candidate lists built at registration
+#include "result_cache.h" // Memoized calculator answers
+#include "logger.h" // LOG(): level-filtered, formatted on a writer thread
+#include "histogram.h" // Latency distributions for the metrics endpoint
+#include "backend_health.h" // Circuit breakers and latency-outlier ejection
+#include "codel.h" // Load shedding on the backend connection queues
+#include "calc_proto.h" // Binary frames for backends registered with proto=bin1
 
 #define DEFAULT_PORT 8080
 #define BUFFER_SIZE 1024
@@ -19,6 +33,46 @@
 #define MAX_REGISTERED_BACKENDS_CONFIG 20 // Max backends registered via discovery
 #define GATEWAY_DISCOVERY_HOST "0.0.0.0" // Listen on all interfaces for discovery
 #define GATEWAY_DISCOVERY_PORT 8081
+#define MAX_EPOLL_EVENTS 256
+#define DEFAULT_BACKEND_TIMEOUT_MAX_MS 5000 // Upper bound for a single backend call, and its timeout until measured
+#define DEFAULT_BACKEND_TIMEOUT_MIN_MS 100
+#define DEFAULT_BACKEND_TIMEOUT_FACTOR 4.0 // A backend call times out after this many times the backend's p99
+#define ADAPTIVE_TIMEOUT_MIN_SAMPLES 20 // Recent latency samples a backend needs before its p99 sets the timeout
+#define UDP_RTO_INITIAL_MS 200 // UDP retransmission timeout until a backend's round trip is measured
+#define UDP_RTO_MIN_MS 20      // RFC 6298 says 1 s; backends here sit on a LAN
+#define UDP_RTO_MAX_MS 2000
+#define HOUSEKEEPING_INTERVAL_MS 1000 // How often managed backends are checked
+#define MAX_POOL_SIZE 256 // Hard cap on keep-alive connections per TCP backend
+#define DEFAULT_POOL_MIN_SIZE 1
+#define DEFAULT_POOL_MAX_SIZE 8
+#define DEFAULT_POOL_IDLE_TIMEOUT_MS 30000
+#define MUX_MAX_IN_FLIGHT 64 // Calls in flight at once on one multiplexed (bin1) TCP connection
+#define UDP_CHANNEL_MAX_IN_FLIGHT 256 // Calls in flight at once on one shared (bin1) UDP socket; more wait in the backend's queue
+#define UDP_CHANNEL_ID_BUCKETS 256 // Frame id hash buckets per shared UDP socket, a power of two
+#define EWMA_ALPHA 0.3 // Weight of the newest latency sample in a backend's average
+#define LATENCY_WINDOW 128 // Recent call latencies kept per backend for its p99
+#define LATENCY_WINDOW_MS 10000 // Samples older than this no longer count toward the p99
+#define P99_REFRESH_SAMPLES 8 // The p99 is recomputed after this many new samples
+#define DEFAULT_LOCAL_EVAL_P99_MS 100
+#define LOCAL_EVAL_PROBE_MS 1000 // While a backend is bypassed as slow, one call per interval still goes to it
+#define DEFAULT_RESULT_CACHE_SIZE 4096 // Entries; 0 disables the cache
+#define CACHE_STATS_INTERVAL_MS 60000 // How often result cache counters are logged
+#define DEFAULT_HEDGE_BUDGET_PCT 5.0 // Hedged calls allowed per 100 calls
+#define HEDGE_MIN_SAMPLES 20 // Recent latency samples a backend needs before its calls are hedged
+#define HEDGE_MAX_TOKENS 10.0 // Unused hedge budget saved up for a burst
+#define DEFAULT_RETRY_BUDGET_PCT 10.0 // Failover retries allowed per 100 requests
+#define RETRY_MAX_TOKENS 10.0 // Unused retry budget saved up for a burst
+#define DEFAULT_MAX_QUEUE_DEPTH 256 // Calls waiting for a connection (or a bin1 UDP socket) per backend before new ones are shed
+#define DEFAULT_CODEL_TARGET_MS 5 // Acceptable standing wait in a connection queue; 0 disables CoDel
+#define DEFAULT_CODEL_INTERVAL_MS 100
+#define DEFAULT_ADMIN_PORT 8082 // HTTP port serving /metrics; 0 disables it
+#define MAX_ADMIN_REQUEST_SIZE 4096 // Largest HTTP request head accepted on the admin port
+#define MAX_CLIENT_MESSAGE_SIZE 65536 // Largest single JSON-RPC message accepted
+#define MAX_PIPELINED_REQUESTS 128 // Requests in flight per client before reading pauses
+#define CLIENT_OUTPUT_HIGH_WATER 262144 // Unsent response bytes before reading pauses
+#define MAX_BATCH_SIZE (MAX_CLIENT_MESSAGE_SIZE / 128) // Elements accepted in one JSON-RPC batch: a full message of ~128-byte requests
+#define INITIAL_MESSAGE_TOKENS 64
+#define MAX_MESSAGE_TOKENS (MAX_CLIENT_MESSAGE_SIZE / 2) // A value needs at least a byte and a separator
 
 // Structure to hold information about a running backend process
 typedef struct {
@@ -34,6 +88,26 @@ typedef struct {
 ManagedBackend managed_backends[MAX_BACKENDS];
 int num_managed_backends = 0;
 
+// Load and latency inputs for backend selection. They belong to the backend
+// name, so they survive re-registration.
+typedef struct {
+    int in_flight;          // Calls started and not yet finished
+    double ewma_latency_ms; // Smoothed response time; 0 until the first sample
+    unsigned long completed;
+    unsigned long failed;
+    long long window_latency_ms[LATENCY_WINDOW]; // Ring of recent samples
+    long long window_at_ms[LATENCY_WINDOW];      // When each sample was taken
+    int window_next;
+    int window_count;
+    long long p99_latency_ms; // Over the samples in the window, 0 if there are none
+    int p99_samples;          // Samples the p99 was taken over
+    long long hedge_delay_ms; // The --hedge-percentile latency over the window, at least 1; 0 with too few samples
+    long long last_probe_ms;  // Last call let through while bypassed, see backend_too_slow
+    double udp_srtt_us;   // RFC 6298 round-trip estimate for UDP calls; 0 until the first sample
+    double udp_rttvar_us;
+    long long udp_rto_ms; // Retransmission timeout for new UDP calls, 0 until the first sample
+} BackendStats;
+
 // Structure for discovered backends
 typedef struct {
     char type[10]; // "TCP" or "UDP"
@@ -41,337 +115,318 @@ typedef struct {
     int port;
     char name[100];
     char operations[512]; // Comma-separated list like "add,subtract,multiply"
-    time_t last_seen;
+    long long last_seen_ms; // monotonic_ms() of the last registration or heartbeat
+    long long lease_ms;     // Expires this long after last_seen_ms; 0 if the backend sends no heartbeats
+    int proto_bin1;         // Registered with proto=bin1: calls use calc_proto.h frames instead of text
+    int batch_max;          // Registered with batch=<n>: takes bin1 batch frames of up to n calls; 0 if not
     int is_active; // 1 for active, 0 for inactive
+    BackendStats stats;
+    BackendHealth health; // Kept across re-registration like stats
 } RegisteredBackend;
 
-RegisteredBackend registered_backends[MAX_REGISTERED_BACKENDS_CONFIG];
-int num_registered_backends = 0;
-int discovery_fd; // File descriptor for the UDP discovery socket
-static unsigned int round_robin_counter = 0; // For round-robin backend selection
-
-
-// Function for logging with timestamp
-void log_with_timestamp(const char *level, const char *message) {
-    time_t now = time(NULL);
-    char buf[sizeof("YYYY-MM-DD HH:MM:SS")];
-    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-    // Output to stdout for now, could be stderr or a file
-    printf("[%s] [%s] %s\n", buf, level, message);
-}
-
-
-// Maps JSON-RPC method name to backend operation code
-int get_backend_op_code(const char* json_rpc_method) {
-    if (strcmp(json_rpc_method, "add") == 0) return 1;
-    if (strcmp(json_rpc_method, "subtract") == 0) return 2;
-    if (strcmp(json_rpc_method, "multiply") == 0) return 3;
-    if (strcmp(json_rpc_method, "divide") == 0) return 4;
-
-    char log_buf[100];
-    snprintf(log_buf, sizeof(log_buf), "Unknown JSON-RPC method for op code translation: %s", json_rpc_method);
-    log_with_timestamp("WARNING", log_buf);
-    return 0; // Unknown or unsupported method
-}
-
-// Communicate with a TCP backend
-int communicate_with_tcp_backend(const RegisteredBackend* backend, const char* request_payload, char* response_buf, size_t response_buf_size) {
-    char log_buf[512];
-    snprintf(log_buf, sizeof(log_buf), "Attempting TCP communication with %s at %s:%d. Payload: \"%s\"", backend->name, backend->host, backend->port, request_payload);
-    log_with_timestamp("INFO", log_buf);
+typedef enum {
+    POLICY_ROUND_ROBIN,
+    POLICY_P2C,               // Power of two random choices on in-flight count
+    POLICY_LEAST_OUTSTANDING, // Fewest in-flight calls
+    POLICY_EWMA               // Lowest smoothed latency, scaled by load
+} SelectionPolicy;
 
-    int sock_fd;
-    struct sockaddr_in server_addr;
-
-    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "TCP socket creation for backend %s failed: %s", backend->name, strerror(errno));
-        perror("TCP socket creation failed for backend communication"); // System error
-        log_with_timestamp("ERROR", err_buf); // Application context
-        snprintf(response_buf, response_buf_size -1, "Gateway error: Failed to create TCP socket to backend %s.", backend->name);
-        response_buf[response_buf_size -1] = '\0';
-        return -1;
-    }
-
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "setsockopt SO_RCVTIMEO for backend %s failed: %s", backend->name, strerror(errno));
-        perror("setsockopt SO_RCVTIMEO failed for TCP backend socket");
-        log_with_timestamp("ERROR", err_buf);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to set TCP recv timeout for backend %s.", backend->name);
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv) < 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "setsockopt SO_SNDTIMEO for backend %s failed: %s (non-critical)", backend->name, strerror(errno));
-        perror("setsockopt SO_SNDTIMEO failed for TCP backend socket (non-critical)");
-        log_with_timestamp("WARNING", err_buf);
-    }
+static const char *policy_names[] = {"round-robin", "p2c", "least-outstanding", "ewma"};
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(backend->port);
-    if (inet_pton(AF_INET, backend->host, &server_addr.sin_addr) <= 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "Invalid backend address %s for %s: %s", backend->host, backend->name, strerror(errno));
-        perror("Invalid address/ Address not supported for TCP backend");
-        log_with_timestamp("ERROR", err_buf);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Invalid backend address %s for %s.", backend->host, backend->name);
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
+// When the gateway evaluates add/subtract/multiply/divide itself instead of
+// calling a backend
+typedef enum {
+    LOCAL_EVAL_OFF,
+    LOCAL_EVAL_ALWAYS,
+    LOCAL_EVAL_NO_BACKEND,  // Only if no backend serves the method
+    LOCAL_EVAL_SLOW_BACKEND // Also if the chosen backend's p99 is over --local-p99-ms
+} LocalEvalMode;
 
-    if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        char err_msg[256];
-        snprintf(err_msg, sizeof(err_msg), "TCP connect to backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(errno));
-        log_with_timestamp("ERROR", err_msg);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to connect to backend %s. Details: %s", backend->name, strerror(errno));
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-    log_with_timestamp("INFO", "TCP connected to backend.");
+static const char *local_eval_names[] = {"off", "always", "no-backend", "slow-backend"};
 
-    if (send(sock_fd, request_payload, strlen(request_payload), 0) < 0) {
-        char err_msg[256];
-        snprintf(err_msg, sizeof(err_msg), "TCP send to backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(errno));
-        log_with_timestamp("ERROR", err_msg);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to send data to backend %s. Details: %s", backend->name, strerror(errno));
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-    log_with_timestamp("INFO", "TCP data sent to backend.");
+// JSON-RPC methods indexed by backend op code; slot 0 stands for any other method
+static const char *backend_methods[] = {NULL, "add", "subtract", "multiply", "divide"};
+#define NUM_METHOD_SLOTS 5
 
-    ssize_t bytes_received = recv(sock_fd, response_buf, response_buf_size - 1, 0);
-    if (bytes_received < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            snprintf(log_buf, sizeof(log_buf), "TCP recv from backend %s timed out.", backend->name);
-            log_with_timestamp("ERROR", log_buf);
-            snprintf(response_buf, response_buf_size-1, "Gateway error: Timeout receiving data from backend %s.", backend->name);
-        } else {
-            char err_msg[256];
-            snprintf(err_msg, sizeof(err_msg), "TCP recv from backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(errno));
-            log_with_timestamp("ERROR", err_msg);
-            snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to receive data from backend %s. Details: %s", backend->name, strerror(errno));
-        }
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
+RegisteredBackend registered_backends[MAX_REGISTERED_BACKENDS_CONFIG];
+int num_registered_backends = 0;
+int discovery_fd; // File descriptor for the UDP discovery socket
+static unsigned int round_robin_counter = 0; // For round-robin backend selection
+static SelectionPolicy method_policies[NUM_METHOD_SLOTS]; // Per method, see --policy
+static RouteIndex route_index; // Backend slots are indexes into registered_backends
+static SelectionPolicy op_policies[ROUTE_MAX_OPS]; // method_policies by interned op id
+_Static_assert(MAX_REGISTERED_BACKENDS_CONFIG <= ROUTE_MAX_BACKENDS, "route index too small for the backend list");
+static unsigned int selection_rng_state = 2463534242u; // xorshift32 state for p2c
+static LocalEvalMode local_eval_mode = LOCAL_EVAL_OFF; // See --local-eval
+static long long local_eval_p99_ms = DEFAULT_LOCAL_EVAL_P99_MS;
+static ResultCache result_cache;
+static long result_cache_size = DEFAULT_RESULT_CACHE_SIZE; // See --cache-size
+static double hedge_percentile = 0.0; // See --hedge-percentile; 0 disables hedging
+static double hedge_budget_pct = DEFAULT_HEDGE_BUDGET_PCT;
+static double hedge_tokens = 0.0; // Hedges that may be sent now; each call adds hedge_budget_pct / 100
+static unsigned long hedges_sent = 0;
+static unsigned long hedges_won = 0; // The hedge answered before the original call
+static unsigned long hedges_over_budget = 0;
+static double retry_budget_pct = DEFAULT_RETRY_BUDGET_PCT; // See --retry-budget-pct; 0 disables failover
+static double retry_tokens = RETRY_MAX_TOKENS; // Retries that may be sent now; each request adds retry_budget_pct / 100
+static unsigned long retries_sent = 0;
+static unsigned long retries_over_budget = 0;
+static int max_queue_depth = DEFAULT_MAX_QUEUE_DEPTH; // See --queue-depth
+static long long codel_target_ms = DEFAULT_CODEL_TARGET_MS;
+static long long codel_interval_ms = DEFAULT_CODEL_INTERVAL_MS;
+static long long backend_timeout_min_ms = DEFAULT_BACKEND_TIMEOUT_MIN_MS; // See --timeout-min-ms
+static long long backend_timeout_max_ms = DEFAULT_BACKEND_TIMEOUT_MAX_MS;
+static double backend_timeout_factor = DEFAULT_BACKEND_TIMEOUT_FACTOR; // 0 keeps every timeout at the maximum
+static unsigned long deadlines_exceeded = 0; // Requests given up because their timeout_ms ran out
+
+
+// Index of a method in backend_methods, 0 if it is none of them
+int method_slot(const char* json_rpc_method) {
+    for (int i = 1; i < NUM_METHOD_SLOTS; ++i) {
+        if (strcmp(json_rpc_method, backend_methods[i]) == 0) return i;
     }
-    response_buf[bytes_received] = '\0';
-    snprintf(log_buf, sizeof(log_buf), "TCP received from backend %s: %s", backend->name, response_buf);
-    log_with_timestamp("INFO", log_buf);
-
-    close(sock_fd);
     return 0;
 }
 
-// Communicate with a UDP backend
-int communicate_with_udp_backend(const RegisteredBackend* backend, const char* request_payload, char* response_buf, size_t response_buf_size) {
-    char log_buf[512];
-    snprintf(log_buf, sizeof(log_buf), "Attempting UDP communication with %s at %s:%d. Payload: \"%s\"", backend->name, backend->host, backend->port, request_payload);
-    log_with_timestamp("INFO", log_buf);
-
-    int sock_fd;
-    struct sockaddr_in server_addr, from_addr;
-    socklen_t from_addr_len = sizeof(from_addr);
-
-    if ((sock_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "UDP socket creation for backend %s failed: %s", backend->name, strerror(errno));
-        perror("UDP socket creation failed for backend communication");
-        log_with_timestamp("ERROR", err_buf);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to create UDP socket for backend %s.", backend->name);
-        response_buf[response_buf_size -1] = '\0';
-        return -1;
-    }
-
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv) < 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "setsockopt SO_RCVTIMEO for UDP backend %s failed: %s", backend->name, strerror(errno));
-        perror("setsockopt SO_RCVTIMEO failed for UDP backend socket");
-        log_with_timestamp("ERROR", err_buf);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to set UDP recv timeout for backend %s.", backend->name);
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(backend->port);
-    if (inet_pton(AF_INET, backend->host, &server_addr.sin_addr) <= 0) {
-        char err_buf[256];
-        snprintf(err_buf, sizeof(err_buf), "Invalid backend address %s for %s: %s", backend->host, backend->name, strerror(errno));
-        perror("Invalid address/ Address not supported for UDP backend");
-        log_with_timestamp("ERROR", err_buf);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Invalid backend address %s for %s.", backend->host, backend->name);
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-
-    if (sendto(sock_fd, request_payload, strlen(request_payload), 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        char err_msg[256];
-        snprintf(err_msg, sizeof(err_msg), "UDP sendto to backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(errno));
-        log_with_timestamp("ERROR", err_msg);
-        snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to send data to UDP backend %s. Details: %s", backend->name, strerror(errno));
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-    log_with_timestamp("INFO", "UDP data sent to backend.");
+long long monotonic_ms();
 
-    ssize_t bytes_received = recvfrom(sock_fd, response_buf, response_buf_size - 1, 0, (struct sockaddr *)&from_addr, &from_addr_len);
-    if (bytes_received < 0) {
-         if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            snprintf(log_buf, sizeof(log_buf), "UDP recvfrom backend %s timed out.", backend->name);
-            log_with_timestamp("ERROR", log_buf);
-            snprintf(response_buf, response_buf_size-1, "Gateway error: Timeout receiving data from UDP backend %s.", backend->name);
-        } else {
-            char err_msg[256];
-            snprintf(err_msg, sizeof(err_msg), "UDP recvfrom backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(errno));
-            log_with_timestamp("ERROR", err_msg);
-            snprintf(response_buf, response_buf_size-1, "Gateway error: Failed to receive data from UDP backend %s. Details: %s", backend->name, strerror(errno));
-        }
-        response_buf[response_buf_size -1] = '\0';
-        close(sock_fd);
-        return -1;
-    }
-    response_buf[bytes_received] = '\0';
-    snprintf(log_buf, sizeof(log_buf), "UDP received from backend %s: %s", backend->name, response_buf);
-    log_with_timestamp("INFO", log_buf);
+// Maps JSON-RPC method name to backend operation code
+int get_backend_op_code(const char* json_rpc_method) {
+    int op_code = method_slot(json_rpc_method);
+    if (op_code != 0) return op_code;
 
-    close(sock_fd);
-    return 0;
+    LOG(WARNING, "Unknown JSON-RPC method for op code translation: %s", json_rpc_method);
+    return 0; // Unknown or unsupported method
 }
 
 // Parses the simple "Result: value" or "Error: message" from backend
 int parse_backend_response(const char* backend_response_str, double* result_out, char* error_msg_out, size_t error_msg_out_size) {
     if (!backend_response_str || !result_out || !error_msg_out) {
-        log_with_timestamp("CRITICAL", "NULL argument to parse_backend_response");
+        LOG(CRITICAL, "NULL argument to parse_backend_response");
         if(error_msg_out) snprintf(error_msg_out, error_msg_out_size-1, "Gateway internal error: parsing backend response with NULL params.");
         if(error_msg_out && error_msg_out_size > 0) error_msg_out[error_msg_out_size-1] = '\0';
         return -1;
     }
 
-    char log_buf[1024];
-    snprintf(log_buf, sizeof(log_buf)-1, "Parsing backend response: \"%s\"", backend_response_str);
-    log_with_timestamp("DEBUG", log_buf);
+    LOG(DEBUG, "Parsing backend response: \"%s\"", backend_response_str);
 
     if (strncmp(backend_response_str, "Result: ", 8) == 0) {
-        if (sscanf(backend_response_str + 8, "%lf", result_out) == 1) {
-            snprintf(log_buf, sizeof(log_buf)-1, "Parsed result from backend: %f", *result_out);
-            log_with_timestamp("DEBUG", log_buf);
+        // Some backends echo the operation ("Result: 1.00 + 2.00 = 3.00");
+        // the value is what follows the '='
+        const char *value_str = strrchr(backend_response_str + 8, '=');
+        value_str = value_str ? value_str + 1 : backend_response_str + 8;
+        if (sscanf(value_str, "%lf", result_out) == 1) {
+            LOG(DEBUG, "Parsed result from backend: %f", *result_out);
             return 0;
         } else {
             snprintf(error_msg_out, error_msg_out_size-1, "Malformed result from backend: %s", backend_response_str);
             error_msg_out[error_msg_out_size-1] = '\0';
-            log_with_timestamp("ERROR", error_msg_out);
+            LOG(ERROR, "%s", error_msg_out);
             return -1;
         }
     } else if (strncmp(backend_response_str, "Error: ", 7) == 0) {
         strncpy(error_msg_out, backend_response_str + 7, error_msg_out_size - 1);
         error_msg_out[error_msg_out_size - 1] = '\0';
-        snprintf(log_buf, sizeof(log_buf)-1, "Parsed error from backend: \"%s\"", error_msg_out);
-        log_with_timestamp("INFO", log_buf);
+        LOG(INFO, "Parsed error from backend: \"%s\"", error_msg_out);
         return 1;
     }
 
     snprintf(error_msg_out, error_msg_out_size-1, "Unknown response format from backend: %s", backend_response_str);
     error_msg_out[error_msg_out_size-1] = '\0';
-    log_with_timestamp("ERROR", error_msg_out);
+    LOG(ERROR, "%s", error_msg_out);
     return -1;
 }
 
-int is_operation_supported(const RegisteredBackend* backend, const char* operation_name) {
-    if (!backend || !backend->is_active || !operation_name) {
+static uint32_t next_frame_id = 1; // Request ids for binary frames
+
+// The message for a bin1 status that is the backend's answer to the client,
+// or NULL for one that means the call itself failed
+const char *calc_error_message(int status) {
+    switch (status) {
+        case CALC_DIVISION_BY_ZERO: return "Division by zero.";
+        case CALC_INVALID_OP: return "Invalid operation choice.";
+        default: return NULL;
+    }
+}
+
+// Reads a bin1 reply frame. Returns like parse_backend_response: 0 with the
+// result, 1 with the backend's error, -1 if the frame is unusable.
+int parse_binary_response(const unsigned char *frame, size_t len, uint32_t expected_id, double *result_out,
+                          char *error_msg_out, size_t error_msg_out_size) {
+    uint32_t id;
+    int status;
+    if (calc_decode_reply(frame, len, &id, &status, result_out) != 0 || id != expected_id) {
+        snprintf(error_msg_out, error_msg_out_size, "Malformed %s reply from backend (%zu bytes).", CALC_PROTO_NAME, len);
+        LOG(ERROR, "%s", error_msg_out);
+        return -1;
+    }
+    if (status == CALC_OK) {
+        LOG(DEBUG, "Parsed result from backend: %f", *result_out);
         return 0;
     }
-    char ops_copy[sizeof(backend->operations)];
-    strncpy(ops_copy, backend->operations, sizeof(ops_copy) -1);
-    ops_copy[sizeof(ops_copy)-1] = '\0';
+    const char *message = calc_error_message(status);
+    if (message) {
+        snprintf(error_msg_out, error_msg_out_size, "%s", message);
+        return 1;
+    }
+    snprintf(error_msg_out, error_msg_out_size, "Backend could not read the %s request (status %d).", CALC_PROTO_NAME, status);
+    LOG(ERROR, "%s", error_msg_out);
+    return -1;
+}
 
-    char *saveptr;
-    char *token = strtok_r(ops_copy, ",", &saveptr);
-    while (token != NULL) {
-        if (strcmp(token, operation_name) == 0) {
-            return 1;
+static unsigned int selection_random() {
+    unsigned int x = selection_rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    selection_rng_state = x;
+    return x;
+}
+
+// Samples two distinct candidates and keeps the one with fewer calls in
+// flight, falling back to the lower latency on a tie. Avoids the herd that
+// always picking the global minimum causes, at O(1) cost.
+static RegisteredBackend* select_p2c(const int *candidates, int count) {
+    if (count == 1) return &registered_backends[candidates[0]];
+    int first = selection_random() % count;
+    int second = selection_random() % (count - 1);
+    if (second >= first) second++;
+    RegisteredBackend *a = &registered_backends[candidates[first]], *b = &registered_backends[candidates[second]];
+    if (a->stats.in_flight != b->stats.in_flight) return a->stats.in_flight < b->stats.in_flight ? a : b;
+    return a->stats.ewma_latency_ms <= b->stats.ewma_latency_ms ? a : b;
+}
+
+// Scans from a rotating start so ties are shared round-robin
+static RegisteredBackend* select_least_outstanding(const int *candidates, int count) {
+    int start = round_robin_counter++ % count;
+    RegisteredBackend *best = &registered_backends[candidates[start]];
+    for (int k = 1; k < count; ++k) {
+        RegisteredBackend *candidate = &registered_backends[candidates[(start + k) % count]];
+        if (candidate->stats.in_flight < best->stats.in_flight) best = candidate;
+    }
+    return best;
+}
+
+// Expected wait on a backend: its smoothed latency for each call already
+// queued plus this one. Backends without samples yet cost 0, so they get
+// probed right away.
+static RegisteredBackend* select_ewma(const int *candidates, int count) {
+    int start = round_robin_counter++ % count;
+    RegisteredBackend *best = NULL;
+    double best_cost = 0.0;
+    for (int k = 0; k < count; ++k) {
+        RegisteredBackend *candidate = &registered_backends[candidates[(start + k) % count]];
+        double cost = candidate->stats.ewma_latency_ms * (candidate->stats.in_flight + 1);
+        if (!best || cost < best_cost) {
+            best = candidate;
+            best_cost = cost;
         }
-        token = strtok_r(NULL, ",", &saveptr);
     }
-    return 0;
+    return best;
 }
 
-RegisteredBackend* select_backend(const char* operation_name, char* chosen_backend_name_out, size_t chosen_backend_name_out_size) {
-    char log_buf[512];
+// Picks a backend serving the operation, never `exclude` (may be NULL)
+RegisteredBackend* select_backend(const char* operation_name, const RegisteredBackend *exclude,
+                                  char* chosen_backend_name_out, size_t chosen_backend_name_out_size) {
     if (!operation_name || !chosen_backend_name_out) return NULL;
 
-    RegisteredBackend* candidates[MAX_REGISTERED_BACKENDS_CONFIG];
+    // Ops no backend has ever advertised are not in the index at all
+    int op_id = route_find_op(&route_index, operation_name, strlen(operation_name));
     int num_candidates = 0;
-
-    for (int i = 0; i < num_registered_backends; ++i) {
-        if (is_operation_supported(&registered_backends[i], operation_name)) {
-            if (num_candidates < MAX_REGISTERED_BACKENDS_CONFIG) {
-                 candidates[num_candidates++] = &registered_backends[i];
-            } else {
-                log_with_timestamp("WARNING", "Exceeded candidate array capacity in select_backend. This shouldn't happen.");
-                break;
-            }
-        }
-    }
+    const int* candidates = NULL;
+    if (op_id >= 0) candidates = route_candidates(&route_index, op_id, &num_candidates);
 
     if (num_candidates == 0) {
-        snprintf(log_buf, sizeof(log_buf), "No active backend found supporting operation: %s", operation_name);
-        log_with_timestamp("WARNING", log_buf);
+        LOG(WARNING, "No active backend found supporting operation: %s", operation_name);
         strncpy(chosen_backend_name_out, "N/A (No suitable backend)", chosen_backend_name_out_size -1);
         chosen_backend_name_out[chosen_backend_name_out_size-1] = '\0';
         return NULL;
     }
 
-    RegisteredBackend* selected = candidates[round_robin_counter % num_candidates];
-    round_robin_counter++;
+    // Backends with an open circuit are skipped. Ejected outliers are only
+    // used when nothing else serves the op.
+    int healthy[ROUTE_MAX_BACKENDS], ejected[ROUTE_MAX_BACKENDS];
+    int num_healthy = 0, num_ejected = 0;
+    long long now = monotonic_ms();
+    int num_excluded = 0;
+    for (int i = 0; i < num_candidates; ++i) {
+        if (&registered_backends[candidates[i]] == exclude) {
+            num_excluded++;
+            continue;
+        }
+        BackendHealth *health = &registered_backends[candidates[i]].health;
+        BreakerState breaker_before = health->breaker;
+        if (!health_breaker_allows(health, now)) continue;
+        if (breaker_before == BREAKER_OPEN) {
+            LOG(INFO, "Circuit for backend %s is half-open; sending a trial call.", registered_backends[candidates[i]].name);
+        }
+        if (health_is_ejected(health, now)) ejected[num_ejected++] = candidates[i];
+        else healthy[num_healthy++] = candidates[i];
+    }
+    if (num_healthy > 0) {
+        candidates = healthy;
+        num_candidates = num_healthy;
+    } else if (num_ejected > 0) {
+        candidates = ejected;
+        num_candidates = num_ejected;
+    } else if (num_excluded == num_candidates) {
+        strncpy(chosen_backend_name_out, "N/A (No other backend)", chosen_backend_name_out_size -1);
+        chosen_backend_name_out[chosen_backend_name_out_size-1] = '\0';
+        return NULL;
+    } else {
+        LOG(WARNING, "Circuits open for all %d backends supporting operation: %s", num_candidates - num_excluded, operation_name);
+        strncpy(chosen_backend_name_out, "N/A (All circuits open)", chosen_backend_name_out_size -1);
+        chosen_backend_name_out[chosen_backend_name_out_size-1] = '\0';
+        return NULL;
+    }
+
+    SelectionPolicy policy = op_policies[op_id];
+    RegisteredBackend* selected;
+    switch (policy) {
+        case POLICY_P2C:
+            selected = select_p2c(candidates, num_candidates);
+            break;
+        case POLICY_LEAST_OUTSTANDING:
+            selected = select_least_outstanding(candidates, num_candidates);
+            break;
+        case POLICY_EWMA:
+            selected = select_ewma(candidates, num_candidates);
+            break;
+        default:
+            selected = &registered_backends[candidates[round_robin_counter % num_candidates]];
+            round_robin_counter++;
+            break;
+    }
 
     strncpy(chosen_backend_name_out, selected->name, chosen_backend_name_out_size -1);
     chosen_backend_name_out[chosen_backend_name_out_size-1] = '\0';
 
-    snprintf(log_buf, sizeof(log_buf), "Selected backend %s for operation %s via round-robin from %d candidates.", selected->name, operation_name, num_candidates);
-    log_with_timestamp("INFO", log_buf);
+    LOG(INFO, "Selected backend %s for operation %s via %s from %d candidates (in flight: %d, ewma: %.2f ms).",
+        selected->name, operation_name, policy_names[policy], num_candidates, selected->stats.in_flight, selected->stats.ewma_latency_ms);
 
     return selected;
 }
 
 void setup_discovery_socket() {
-    char log_buf[256];
     struct sockaddr_in discovery_addr;
 
     discovery_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (discovery_fd < 0) {
         perror("Discovery socket creation failed");
-        log_with_timestamp("ERROR", "Discovery UDP socket creation failed.");
+        LOG(ERROR, "Discovery UDP socket creation failed.");
         exit(EXIT_FAILURE);
     }
 
     int flags = fcntl(discovery_fd, F_GETFL, 0);
     if (flags == -1) {
         perror("fcntl F_GETFL failed for discovery_fd");
-        log_with_timestamp("ERROR", "fcntl F_GETFL failed for discovery_fd.");
+        LOG(ERROR, "fcntl F_GETFL failed for discovery_fd.");
         close(discovery_fd);
         exit(EXIT_FAILURE);
     }
     if (fcntl(discovery_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
         perror("fcntl F_SETFL O_NONBLOCK failed for discovery_fd");
-        log_with_timestamp("ERROR", "fcntl F_SETFL O_NONBLOCK failed for discovery_fd.");
+        LOG(ERROR, "fcntl F_SETFL O_NONBLOCK failed for discovery_fd.");
         close(discovery_fd);
         exit(EXIT_FAILURE);
     }
@@ -386,8 +441,7 @@ void setup_discovery_socket() {
     } else {
         if (inet_pton(AF_INET, GATEWAY_DISCOVERY_HOST, &discovery_addr.sin_addr) <= 0) {
             perror("Invalid GATEWAY_DISCOVERY_HOST address");
-            snprintf(log_buf, sizeof(log_buf), "Invalid GATEWAY_DISCOVERY_HOST address: %s", GATEWAY_DISCOVERY_HOST);
-            log_with_timestamp("ERROR", log_buf);
+            LOG(ERROR, "Invalid GATEWAY_DISCOVERY_HOST address: %s", GATEWAY_DISCOVERY_HOST);
             close(discovery_fd);
             exit(EXIT_FAILURE);
         }
@@ -396,21 +450,21 @@ void setup_discovery_socket() {
 
     if (bind(discovery_fd, (struct sockaddr *)&discovery_addr, sizeof(discovery_addr)) < 0) {
         perror("Discovery socket bind failed");
-        snprintf(log_buf, sizeof(log_buf), "Discovery UDP socket bind failed on %s:%d - %s.", GATEWAY_DISCOVERY_HOST, GATEWAY_DISCOVERY_PORT, strerror(errno));
-        log_with_timestamp("ERROR", log_buf);
+        LOG(ERROR, "Discovery UDP socket bind failed on %s:%d - %s.", GATEWAY_DISCOVERY_HOST, GATEWAY_DISCOVERY_PORT, strerror(errno));
         close(discovery_fd);
         exit(EXIT_FAILURE);
     }
 
-    snprintf(log_buf, sizeof(log_buf), "Discovery UDP socket listening on %s:%d", GATEWAY_DISCOVERY_HOST, GATEWAY_DISCOVERY_PORT);
-    log_with_timestamp("INFO", log_buf);
+    LOG(INFO, "Discovery UDP socket listening on %s:%d", GATEWAY_DISCOVERY_HOST, GATEWAY_DISCOVERY_PORT);
 }
 
+// Parses "type=..;host=..;port=..;name=..;ops=..[;lease_ms=..][;proto=..][;batch=..]", sent by a
+// backend when it starts and then as its heartbeat, or "action=deregister;name=..".
+// Returns 0 for a registration, 1 for a deregistration (only the name is
+// set) and -1 if the message is invalid.
 int parse_registration_message(const char* msg, RegisteredBackend* backend_info) {
     if (!msg || !backend_info) return -1;
-    char log_buf[1024];
-    snprintf(log_buf, sizeof(log_buf), "Parsing registration message: %s", msg);
-    log_with_timestamp("DEBUG", log_buf);
+    LOG(DEBUG, "Parsing registration message: %s", msg);
 
     memset(backend_info, 0, sizeof(RegisteredBackend));
 
@@ -421,6 +475,7 @@ int parse_registration_message(const char* msg, RegisteredBackend* backend_info)
     char *saveptr1, *saveptr2;
     char *token = strtok_r(msg_copy, ";", &saveptr1);
     int found_fields = 0;
+    int deregister = 0;
 
     while (token != NULL) {
         char *key = strtok_r(token, "=", &saveptr2);
@@ -438,8 +493,7 @@ int parse_registration_message(const char* msg, RegisteredBackend* backend_info)
             } else if (strcmp(key, "port") == 0) {
                 backend_info->port = atoi(value);
                 if (backend_info->port == 0 && strcmp(value, "0") != 0) {
-                    snprintf(log_buf, sizeof(log_buf), "Invalid port value in registration: %s for key %s", value, key);
-                    log_with_timestamp("ERROR", log_buf);
+                    LOG(ERROR, "Invalid port value in registration: %s for key %s", value, key);
                     return -1;
                 }
                 found_fields++;
@@ -451,88 +505,181 @@ int parse_registration_message(const char* msg, RegisteredBackend* backend_info)
                 strncpy(backend_info->operations, value, sizeof(backend_info->operations) - 1);
                 backend_info->operations[sizeof(backend_info->operations) - 1] = '\0';
                 found_fields++;
+            } else if (strcmp(key, "lease_ms") == 0) {
+                backend_info->lease_ms = atoll(value);
+                if (backend_info->lease_ms < 0) {
+                    LOG(ERROR, "Invalid lease_ms value in registration: %s", value);
+                    return -1;
+                }
+            } else if (strcmp(key, "proto") == 0) {
+                // Anything but a protocol this gateway speaks falls back to text
+                backend_info->proto_bin1 = strcmp(value, CALC_PROTO_NAME) == 0;
+                if (!backend_info->proto_bin1) LOG(WARNING, "Unknown proto '%s' in registration; using text.", value);
+            } else if (strcmp(key, "batch") == 0) {
+                // More than this gateway's frames hold is fine; it sends smaller batches
+                int batch_max = atoi(value);
+                backend_info->batch_max = batch_max < 2 ? 0 : batch_max > CALC_BATCH_MAX ? CALC_BATCH_MAX : batch_max;
+            } else if (strcmp(key, "action") == 0) {
+                if (strcmp(value, "deregister") == 0) {
+                    deregister = 1;
+                } else if (strcmp(value, "register") != 0) {
+                    LOG(ERROR, "Unknown action in registration message: %s", value);
+                    return -1;
+                }
             }
         }
         token = strtok_r(NULL, ";", &saveptr1);
     }
 
+    if (deregister) {
+        if (strlen(backend_info->name) == 0) {
+            LOG(ERROR, "Deregistration message without a backend name: %s", msg);
+            return -1;
+        }
+        return 1;
+    }
+
     if (found_fields < 5) {
-        snprintf(log_buf, sizeof(log_buf), "Incomplete registration message. Found %d fields. Original: %s", found_fields, msg);
-        log_with_timestamp("ERROR", log_buf);
+        LOG(ERROR, "Incomplete registration message. Found %d fields. Original: %s", found_fields, msg);
         return -1;
     }
 
     if(strlen(backend_info->name) == 0){
-        log_with_timestamp("ERROR", "Backend name is empty after parsing.");
+        LOG(ERROR, "Backend name is empty after parsing.");
         return -1;
     }
 
-    backend_info->last_seen = time(NULL);
+    backend_info->last_seen_ms = monotonic_ms();
     backend_info->is_active = 1;
     return 0;
 }
 
+void pool_drain_idle(RegisteredBackend *backend);
+void udp_channel_close(RegisteredBackend *backend);
+void deactivate_backend(int slot, const char *reason);
+
+// Refreshes the route index entry for a backend slot. Ops seen for the
+// first time pick up the selection policy configured for their method.
+static void route_update_backend(int slot) {
+    RegisteredBackend *backend = &registered_backends[slot];
+    int known_ops = route_index.op_count;
+    int dropped = route_set_backend(&route_index, slot, backend->operations, backend->is_active);
+    for (int op_id = known_ops; op_id < route_index.op_count; ++op_id) {
+        op_policies[op_id] = method_policies[method_slot(route_index.op_names[op_id])];
+    }
+    if (dropped > 0) {
+        LOG(WARNING, "Backend %s: %d operation(s) not routable (names over %d bytes or more than %d distinct ops).",
+            backend->name, dropped, ROUTE_MAX_OP_NAME - 1, ROUTE_MAX_OPS);
+    }
+}
+
 void process_registration_message(const char* buffer, ssize_t len) {
-    char log_buf[1024];
     char safe_buffer[1024];
     if (len >= (ssize_t)sizeof(safe_buffer)) {
-        log_with_timestamp("ERROR", "Received registration message too long to process.");
+        LOG(ERROR, "Received registration message too long to process.");
         return;
     }
     memcpy(safe_buffer, buffer, len);
     safe_buffer[len] = '\0';
 
     RegisteredBackend backend_info;
-    if (parse_registration_message(safe_buffer, &backend_info) == 0) {
-        int found_idx = -1;
-        for (int i = 0; i < num_registered_backends; ++i) {
-            if (strcmp(registered_backends[i].name, backend_info.name) == 0) {
-                found_idx = i;
-                break;
-            }
+    int kind = parse_registration_message(safe_buffer, &backend_info);
+    if (kind < 0) {
+        LOG(ERROR, "Failed to parse registration message: %s", safe_buffer);
+        return;
+    }
+    int found_idx = -1;
+    for (int i = 0; i < num_registered_backends; ++i) {
+        if (strcmp(registered_backends[i].name, backend_info.name) == 0) {
+            found_idx = i;
+            break;
         }
+    }
 
-        if (found_idx != -1) {
-            registered_backends[found_idx] = backend_info;
-            snprintf(log_buf, sizeof(log_buf), "Updated registration for backend: %s (Type: %s, Host: %s, Port: %d, Ops: %s)",
-                     backend_info.name, backend_info.type, backend_info.host, backend_info.port, backend_info.operations);
-            log_with_timestamp("INFO", log_buf);
+    if (kind == 1) {
+        if (found_idx == -1 || !registered_backends[found_idx].is_active) {
+            LOG(INFO, "Deregistration from backend %s, which is not active.", backend_info.name);
         } else {
-            if (num_registered_backends < MAX_REGISTERED_BACKENDS_CONFIG) {
-                registered_backends[num_registered_backends++] = backend_info;
-                snprintf(log_buf, sizeof(log_buf), "Registered new backend: %s (Type: %s, Host: %s, Port: %d, Ops: %s)",
-                         backend_info.name, backend_info.type, backend_info.host, backend_info.port, backend_info.operations);
-                log_with_timestamp("INFO", log_buf);
-            } else {
-                snprintf(log_buf, sizeof(log_buf), "Cannot register backend %s: list full (max %d).", backend_info.name, MAX_REGISTERED_BACKENDS_CONFIG);
-                log_with_timestamp("WARNING", log_buf);
-            }
+            deactivate_backend(found_idx, "deregistered");
+        }
+        return;
+    }
+
+    if (found_idx != -1) {
+        RegisteredBackend *existing = &registered_backends[found_idx];
+        int moved = existing->port != backend_info.port || strcmp(existing->host, backend_info.host) != 0 ||
+                    strcmp(existing->type, backend_info.type) != 0;
+        int proto_changed = existing->proto_bin1 != backend_info.proto_bin1;
+        int ops_changed = strcmp(existing->operations, backend_info.operations) != 0 || proto_changed;
+        int was_active = existing->is_active;
+        if (moved || proto_changed) {
+            // Open connections speak the old address or protocol
+            pool_drain_idle(existing);
+            udp_channel_close(existing);
+        }
+        backend_info.stats = existing->stats; // Keep load and latency history
+        backend_info.health = existing->health;
+        registered_backends[found_idx] = backend_info;
+        if (!moved && !ops_changed && was_active) {
+            LOG(DEBUG, "Heartbeat from backend %s; lease renewed for %lld ms.", backend_info.name, backend_info.lease_ms);
+            return;
         }
+        route_update_backend(found_idx);
+        LOG(INFO, "%s backend: %s (Type: %s, Host: %s, Port: %d, Ops: %s, Proto: %s)", was_active ? "Updated registration for" : "Reactivated",
+            backend_info.name, backend_info.type, backend_info.host, backend_info.port, backend_info.operations,
+            backend_info.proto_bin1 ? CALC_PROTO_NAME : "text");
     } else {
-        snprintf(log_buf, sizeof(log_buf), "Failed to parse registration message: %s", safe_buffer);
-        log_with_timestamp("ERROR", log_buf);
+        if (num_registered_backends < MAX_REGISTERED_BACKENDS_CONFIG) {
+            registered_backends[num_registered_backends] = backend_info;
+            route_update_backend(num_registered_backends++);
+            LOG(INFO, "Registered new backend: %s (Type: %s, Host: %s, Port: %d, Ops: %s, Proto: %s)",
+                backend_info.name, backend_info.type, backend_info.host, backend_info.port, backend_info.operations,
+                backend_info.proto_bin1 ? CALC_PROTO_NAME : "text");
+        } else {
+            LOG(WARNING, "Cannot register backend %s: list full (max %d).", backend_info.name, MAX_REGISTERED_BACKENDS_CONFIG);
+        }
     }
 }
 
-double add(double a, double b);
-double subtract(double a, double b);
-double multiply(double a, double b);
-double divide(double a, double b);
+// Takes a backend out of routing. Its slot, statistics and metrics stay, so
+// it picks up where it left off if it registers again. Calls already in
+// flight to it finish or time out on their own.
+void deactivate_backend(int slot, const char *reason) {
+    RegisteredBackend *backend = &registered_backends[slot];
+    backend->is_active = 0;
+    route_update_backend(slot);
+    pool_drain_idle(backend);
+    udp_channel_close(backend);
+    LOG(WARNING, "Backend %s (%s:%d) %s; no longer routing to it.", backend->name, backend->host, backend->port, reason);
+}
+
+// Deactivates backends whose heartbeats stopped for longer than their lease
+void expire_backend_leases() {
+    long long now = monotonic_ms();
+    for (int i = 0; i < num_registered_backends; ++i) {
+        RegisteredBackend *backend = &registered_backends[i];
+        if (backend->is_active && backend->lease_ms > 0 && now - backend->last_seen_ms > backend->lease_ms) {
+            char reason[64];
+            snprintf(reason, sizeof(reason), "missed its heartbeats for %lld ms", now - backend->last_seen_ms);
+            deactivate_backend(i, reason);
+        }
+    }
+}
 
-int parse_json_rpc_request(const char *json_str, char *method, double *params, int *id);
+int parse_json_rpc_request(const char *js, const jsontok_token *tokens, int count, int obj, char *method, double *params, int *id,
+                           long long *timeout_ms);
 void build_json_rpc_response(char *response_str, int id, double result, const char *error_message);
+int build_result_response(char *response_str, int id, double result, const char *backend_label);
+void build_invalid_request_response(char *response_str, const char *error_message);
 
 pid_t launch_backend(const char* exec_path, const char* server_name, const char* listen_host, const char* listen_port_str, const char* server_type) {
-    char log_buffer[512];
-    snprintf(log_buffer, sizeof(log_buffer), "Attempting to launch backend: %s (Name: %s, Host: %s, Port: %s, Type: %s)",
-             exec_path, server_name, listen_host, listen_port_str, server_type);
-    log_with_timestamp("INFO", log_buffer);
+    LOG(INFO, "Attempting to launch backend: %s (Name: %s, Host: %s, Port: %s, Type: %s)",
+        exec_path, server_name, listen_host, listen_port_str, server_type);
 
     pid_t pid = fork();
     if (pid == -1) {
         perror("fork failed");
-        snprintf(log_buffer, sizeof(log_buffer), "Failed to fork for backend %s: %s", server_name, strerror(errno));
-        log_with_timestamp("ERROR", log_buffer);
+        LOG(ERROR, "Failed to fork for backend %s: %s", server_name, strerror(errno));
         return 0;
     } else if (pid == 0) {
         char gateway_port_str[10];
@@ -548,39 +695,33 @@ pid_t launch_backend(const char* exec_path, const char* server_name, const char*
             NULL
         };
 
-        snprintf(log_buffer, sizeof(log_buffer), "Child process for %s executing: %s --my-host %s --my-port %s --server-name %s --gateway-host %s --gateway-port %s",
+        LOG(DEBUG, "Child process for %s executing: %s --my-host %s --my-port %s --server-name %s --gateway-host %s --gateway-port %s",
             server_name, exec_path, listen_host, listen_port_str, server_name, GATEWAY_DISCOVERY_HOST, gateway_port_str);
-        log_with_timestamp("DEBUG", log_buffer);
 
         execv(exec_path, argv);
         perror("execv failed");
-        snprintf(log_buffer, sizeof(log_buffer), "execv failed for %s: %s", exec_path, strerror(errno));
-        log_with_timestamp("ERROR", log_buffer);
+        LOG(ERROR, "execv failed for %s: %s", exec_path, strerror(errno));
         exit(EXIT_FAILURE);
     } else {
-        snprintf(log_buffer, sizeof(log_buffer), "Backend %s launched successfully with PID: %d", server_name, pid);
-        log_with_timestamp("INFO", log_buffer);
+        LOG(INFO, "Backend %s launched successfully with PID: %d", server_name, pid);
         return pid;
     }
 }
 
 void load_and_launch_backends(const char* config_path) {
-    char log_buffer[512];
-    snprintf(log_buffer, sizeof(log_buffer), "Loading backends configuration from: %s", config_path);
-    log_with_timestamp("INFO", log_buffer);
+    LOG(INFO, "Loading backends configuration from: %s", config_path);
 
     FILE *file = fopen(config_path, "r");
     if (!file) {
         perror("fopen config_path failed");
-        snprintf(log_buffer, sizeof(log_buffer), "Failed to open backend config file %s: %s. No managed backends will be launched.", config_path, strerror(errno));
-        log_with_timestamp("ERROR", log_buffer);
+        LOG(ERROR, "Failed to open backend config file %s: %s. No managed backends will be launched.", config_path, strerror(errno));
         return;
     }
 
     char line[512];
     while (fgets(line, sizeof(line), file)) {
         if (num_managed_backends >= MAX_BACKENDS) {
-            log_with_timestamp("WARNING", "Maximum number of managed backends reached. Skipping remaining entries in backends.conf.");
+            LOG(WARNING, "Maximum number of managed backends reached. Skipping remaining entries in backends.conf.");
             break;
         }
         line[strcspn(line, "\n")] = 0;
@@ -606,53 +747,44 @@ void load_and_launch_backends(const char* config_path) {
                 backend->server_type[sizeof(backend->server_type) -1] = '\0';
                 backend->is_running = 1;
             } else {
-                snprintf(log_buffer, sizeof(log_buffer), "Failed to launch backend defined in line: %s", line);
-                log_with_timestamp("ERROR", log_buffer);
+                LOG(ERROR, "Failed to launch backend defined in line: %s", line);
             }
         } else {
-            snprintf(log_buffer, sizeof(log_buffer), "Skipping malformed line in backend config: %s", line);
-            log_with_timestamp("WARNING", log_buffer);
+            LOG(WARNING, "Skipping malformed line in backend config: %s", line);
         }
     }
     fclose(file);
-    snprintf(log_buffer, sizeof(log_buffer), "Finished loading backends. Total managed backends launched: %d", num_managed_backends);
-    log_with_timestamp("INFO", log_buffer);
+    LOG(INFO, "Finished loading backends. Total managed backends launched: %d", num_managed_backends);
 }
 
 void check_managed_backends() {
-    char log_buffer[256];
     for (int i = 0; i < num_managed_backends; ++i) {
         if (managed_backends[i].pid > 0 && managed_backends[i].is_running) {
             int status;
             pid_t result = waitpid(managed_backends[i].pid, &status, WNOHANG);
             if (result == managed_backends[i].pid) {
                 if (WIFEXITED(status)) {
-                    snprintf(log_buffer, sizeof(log_buffer), "Managed backend %s (PID: %d) exited with status %d.",
-                             managed_backends[i].name, managed_backends[i].pid, WEXITSTATUS(status));
-                    log_with_timestamp("INFO", log_buffer);
+                    LOG(INFO, "Managed backend %s (PID: %d) exited with status %d.",
+                        managed_backends[i].name, managed_backends[i].pid, WEXITSTATUS(status));
                 } else if (WIFSIGNALED(status)) {
-                    snprintf(log_buffer, sizeof(log_buffer), "Managed backend %s (PID: %d) killed by signal %d.",
-                             managed_backends[i].name, managed_backends[i].pid, WTERMSIG(status));
-                    log_with_timestamp("WARNING", log_buffer);
+                    LOG(WARNING, "Managed backend %s (PID: %d) killed by signal %d.",
+                        managed_backends[i].name, managed_backends[i].pid, WTERMSIG(status));
                 }
                 managed_backends[i].is_running = 0;
-                log_with_timestamp("INFO", "Attempting to relaunch backend...");
+                LOG(INFO, "Attempting to relaunch backend...");
                 pid_t new_pid = launch_backend(managed_backends[i].exec_path, managed_backends[i].name, managed_backends[i].listen_host, managed_backends[i].listen_port_str, managed_backends[i].server_type);
                 if (new_pid > 0) {
                     managed_backends[i].pid = new_pid;
                     managed_backends[i].is_running = 1;
-                    snprintf(log_buffer, sizeof(log_buffer), "Backend %s re-launched with new PID: %d", managed_backends[i].name, new_pid);
-                    log_with_timestamp("INFO", log_buffer);
+                    LOG(INFO, "Backend %s re-launched with new PID: %d", managed_backends[i].name, new_pid);
                 } else {
-                    snprintf(log_buffer, sizeof(log_buffer), "Failed to re-launch backend %s.", managed_backends[i].name);
-                    log_with_timestamp("ERROR", log_buffer);
+                    LOG(ERROR, "Failed to re-launch backend %s.", managed_backends[i].name);
                 }
 
             } else if (result == -1) {
                 perror("waitpid error checking managed backend");
-                snprintf(log_buffer, sizeof(log_buffer), "Error checking status of managed backend %s (PID: %d): %s",
-                         managed_backends[i].name, managed_backends[i].pid, strerror(errno));
-                log_with_timestamp("ERROR", log_buffer);
+                LOG(ERROR, "Error checking status of managed backend %s (PID: %d): %s",
+                    managed_backends[i].name, managed_backends[i].pid, strerror(errno));
                 managed_backends[i].is_running = 0;
             }
         }
@@ -660,325 +792,3075 @@ void check_managed_backends() {
 }
 
 
-int main() {
-    load_and_launch_backends("json_rpc/backends.conf");
+// Every object registered with epoll starts with an EventSource so the
+// main loop can tell listeners, clients and backend calls apart.
+typedef enum {
+    SRC_LISTENER,
+    SRC_DISCOVERY,
+    SRC_CLIENT,
+    SRC_BACKEND,
+    SRC_POOLED_CONN,
+    SRC_UDP_CHANNEL,
+    SRC_ADMIN_LISTENER,
+    SRC_ADMIN_CONN
+} EventSourceType;
 
-    if (num_managed_backends == 0) {
-        log_with_timestamp("WARNING", "CRITICAL SETUP: No backends were successfully launched from backends.conf. Gateway may not be able to process any backend requests that rely on these managed backends.");
-    }
+typedef struct {
+    EventSourceType type;
+    int fd;
+} EventSource;
 
-    setup_discovery_socket();
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} ByteBuffer;
 
-    int server_fd, client_fd;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
-    char log_buf[512];
+// A persistent JSON-RPC client connection owned by the event loop. Clients
+// may pipeline requests; each is answered as soon as its backend replies.
+typedef struct {
+    EventSource src;
+    ByteBuffer in;
+    ByteBuffer out;
+    size_t out_sent;
+    uint32_t watched_events;
+    jsontok_parser parser;   // Progress through the message at the head of `in`
+    jsontok_token *tokens;   // Reused for every message on this connection
+    int token_cap;
+    int discard_line;        // Skipping a bad message up to the next newline
+    int pending_calls; // Backend calls that will still answer on this connection
+    int peer_done;     // Client finished sending; close once all is answered
+    int closed;        // Socket is gone; free once pending_calls drops to 0
+} ClientConn;
+
+typedef enum {
+    CALL_QUEUED,    // TCP: waiting for a pooled connection
+    CALL_SENDING,
+    CALL_RECEIVING
+} BackendCallState;
+
+// A JSON-RPC batch being answered. Every element gets a slot; the combined
+// array response is sent once the last slot has been filled.
+typedef struct {
+    ClientConn *client;
+    int count;
+    int remaining;
+    char **responses;
+} ClientBatch;
+
+struct PooledConn;
+struct UdpChannel;
+
+// One in-flight request to a backend. Progresses send -> recv without ever
+// blocking the loop; a timer bounds how long it may take. TCP calls borrow a
+// keep-alive connection from the backend's pool. UDP calls own their socket,
+// or share the backend's UdpChannel when it speaks bin1, and are retransmitted
+// while unanswered.
+typedef struct BackendCall {
+    EventSource src; // UDP socket; fd is -1 for TCP calls
+    BackendCallState state;
+    RegisteredBackend *backend;
+    struct PooledConn *conn;
+    struct UdpChannel *channel;
+    struct BackendCall *next_waiting;
+    struct BackendCall *mux_prev; // Neighbours among the calls in flight on a multiplexed conn or UDP channel
+    struct BackendCall *mux_next;
+    struct BackendCall *id_next; // Next call in its UDP channel's frame id bucket
+    ClientConn *client;
+    ClientBatch *batch; // Batch this call answers into, or NULL
+    int batch_slot;
+    int request_id;
+    int op_code; // Backend op code and operands, the key for result_cache
+    double params[2];
+    char request[256]; // Text, or a calc_proto.h frame when binary
+    size_t request_len;
+    size_t request_sent;
+    char response[BUFFER_SIZE];
+    size_t response_len;
+    int binary;        // Speaks bin1; fixed when the call starts
+    int framed;        // Multiplexed or channel call: its request has been put in a frame for the backend
+    uint32_t frame_id; // Request id in the frame, echoed in the reply
+    long long request_started_us; // When the client's request was read, for method_metrics
+    long long started_us;
+    long long deadline_ms;
+    long long request_deadline_ms; // From the client's timeout_ms, 0 if it gave none
+    int deadline_from_client; // deadline_ms is the client's, earlier than the backend timeout
+    long long hedge_at_ms; // When to send a hedge if there is no reply yet, 0 if not planned
+    long long retransmit_at_ms; // UDP: when to resend if there is no reply yet, 0 if not planned
+    long long rto_ms;      // UDP: current retransmission timeout, doubled on each resend
+    int retransmits;
+    long long sent_us;     // UDP: first transmission, for the round-trip sample
+    long long timer_ms;    // Next wake-up: the earliest of hedge_at_ms, retransmit_at_ms and deadline_ms
+    int timer_slot; // Position in timer_heap, -1 when not armed
+    int stale_retry_used; // Already retried once after a dead keep-alive connection
+    int timed_out;
+    int breaker_trial; // Started while the backend's circuit was half-open
+    struct BackendCall *sibling; // The other call of a hedged pair while both run
+    int is_hedge;
+    int orphaned; // The sibling already answered, or a failover took over; this reply is only recorded
+    int is_failover; // Retry of a call that failed on another backend; not retried again
+    long long queued_us; // When it joined its backend's wait queue
+    int shed; // Rejected as overload before reaching the backend
+} BackendCall;
+
+typedef enum {
+    CONN_CONNECTING,
+    CONN_IDLE,
+    CONN_BUSY
+} PooledConnState;
+
+// A keep-alive TCP connection to a backend. It serves one call at a time,
+// except to bin1 backends: there it is multiplexed, with up to
+// MUX_MAX_IN_FLIGHT calls written back to back and each reply matched to its
+// call by the frame id it echoes. A multiplexed connection stays in the idle
+// stack (CONN_IDLE) while it has room for another call.
+typedef struct PooledConn {
+    EventSource src;
+    PooledConnState state;
+    RegisteredBackend *backend;
+    BackendCall *call;
+    long long last_used_ms;
+    int requests_served;
+    int generation; // The pool's generation when opened; older ones are not reused
+    int multiplexed;
+    BackendCall *inflight_head; // Multiplexed: calls sent or queued, oldest first
+    BackendCall *inflight_tail;
+    int inflight_count;
+    int unframed_count; // Multiplexed: calls at the end of the in-flight list not yet encoded into `out`
+    ByteBuffer out; // Multiplexed: frames not yet written
+    unsigned char in[4 * CALC_MAX_REPLY_SIZE]; // Multiplexed: reply bytes read and not yet delivered
+    size_t in_len;
+    uint32_t watched_events;
+} PooledConn;
+
+// Connections to one TCP backend. Idle connections form a stack so the most
+// recently used (warmest) one is reused first and the oldest ones age out.
+typedef struct {
+    PooledConn *idle[MAX_POOL_SIZE];
+    int idle_count;
+    int open_count;       // Connecting + idle + busy
+    int connecting_count;
+    BackendCall *wait_head;
+    BackendCall *wait_tail;
+    int waiting_count;
+    CodelState codel; // Over the time calls spend in the wait queue
+    int generation; // Bumped by pool_drain_idle
+} ConnPool;
+
+static ConnPool backend_pools[MAX_REGISTERED_BACKENDS_CONFIG];
+static int pool_min_size = DEFAULT_POOL_MIN_SIZE;
+static int pool_max_size = DEFAULT_POOL_MAX_SIZE;
+static int pool_idle_timeout_ms = DEFAULT_POOL_IDLE_TIMEOUT_MS;
+
+// A connected UDP socket shared by the calls to one bin1 backend, opened on
+// first use. Replies are matched to calls by the frame id they echo, so a
+// late reply to a retransmitted request cannot answer another call. Calls
+// started during one pass of the event loop are sent together before it
+// waits again, in batch datagrams if the backend takes them. At most
+// UDP_CHANNEL_MAX_IN_FLIGHT calls are on a channel at once; the rest wait in
+// the backend's ConnPool queue, bounded and shed exactly like TCP calls.
+typedef struct UdpChannel {
+    EventSource src;
+    RegisteredBackend *backend;
+    BackendCall *inflight_head; // Linked through mux_prev/mux_next, oldest first
+    BackendCall *inflight_tail;
+    int inflight_count;
+    int unframed_count; // Calls at the end of the in-flight list not sent yet
+    BackendCall *by_id[UDP_CHANNEL_ID_BUCKETS]; // The in-flight calls again, chained through id_next by frame id
+} UdpChannel;
+
+static UdpChannel *udp_channels[MAX_REGISTERED_BACKENDS_CONFIG]; // Indexed like registered_backends
+
+// Outcomes of the calls made to one backend, served on the admin port.
+// Indexed like registered_backends, so they survive re-registration too.
+typedef struct {
+    Histogram latency_us; // Calls the backend answered, in microseconds
+    unsigned long requests;
+    unsigned long errors; // Calls that did not produce a result, timeouts and connect failures included
+    unsigned long timeouts;
+    unsigned long connect_failures;
+    unsigned long circuit_opens;
+    unsigned long ejections;
+    unsigned long shed_queue_full; // Calls turned away because the backend's wait queue was full
+    unsigned long shed_codel;      // Calls dropped from the wait queue by CoDel
+    unsigned long udp_retransmits;
+    unsigned long batch_frames;  // bin1 batch frames sent
+    unsigned long batched_calls; // Calls sent in them
+} BackendMetrics;
+
+// Client requests per method (a backend_methods slot), however answered
+typedef struct {
+    Histogram latency_us; // From reading the request to queueing its response
+    unsigned long requests;
+    unsigned long errors;
+} MethodMetrics;
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("TCP socket failed");
-        log_with_timestamp("CRITICAL", "JSON-RPC TCP Socket creation failed. Exiting.");
-        exit(EXIT_FAILURE);
-    }
+static BackendMetrics backend_metrics[MAX_REGISTERED_BACKENDS_CONFIG];
+static MethodMetrics method_metrics[NUM_METHOD_SLOTS];
+static int admin_port = DEFAULT_ADMIN_PORT; // See --admin-port
 
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt for TCP socket failed");
-        log_with_timestamp("CRITICAL", "setsockopt for JSON-RPC TCP socket failed. Exiting.");
-        exit(EXIT_FAILURE);
-    }
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(DEFAULT_PORT);
+// A connection to the admin port: one HTTP request, one response, then closed
+typedef struct {
+    EventSource src;
+    char request[MAX_ADMIN_REQUEST_SIZE];
+    size_t request_len;
+    ByteBuffer out;
+    size_t out_sent;
+} AdminConn;
+
+static int epoll_fd = -1;
+
+// Objects closed while handling an epoll batch may still be referenced by
+// later events in that batch, so they are only freed once it is done.
+static EventSource **release_queue = NULL;
+static int release_queue_len = 0;
+static int release_queue_cap = 0;
+
+// Min-heap of backend calls ordered by timer_ms
+static BackendCall **timer_heap = NULL;
+static int timer_heap_len = 0;
+static int timer_heap_cap = 0;
+
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("TCP bind failed");
-        snprintf(log_buf, sizeof(log_buf), "JSON-RPC TCP Bind failed for port %d: %s. Exiting.", DEFAULT_PORT, strerror(errno));
-        log_with_timestamp("CRITICAL", log_buf);
-        exit(EXIT_FAILURE);
-    }
+long long monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    if (listen(server_fd, 3) < 0) {
-        perror("TCP listen failed");
-        log_with_timestamp("CRITICAL", "JSON-RPC TCP Listen failed. Exiting.");
-        exit(EXIT_FAILURE);
-    }
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    snprintf(log_buf, sizeof(log_buf), "JSON-RPC Server listening on port %d", DEFAULT_PORT);
-    log_with_timestamp("INFO", log_buf);
+int watch_fd(EventSource *src, int op, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(epoll_fd, op, src->fd, &ev);
+}
 
-    while(1) {
-        check_managed_backends();
-
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
-        FD_SET(discovery_fd, &readfds);
-
-        int max_fd = (server_fd > discovery_fd ? server_fd : discovery_fd) + 1;
-
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
-        int activity = select(max_fd, &readfds, NULL, NULL, &timeout);
-
-        if (activity < 0 && errno != EINTR) {
-            char err_select_buf[100];
-            snprintf(err_select_buf, sizeof(err_select_buf), "Select error: %s. Continuing...", strerror(errno));
-            perror("select error"); // This will print the system error
-            log_with_timestamp("ERROR", err_select_buf); // Log our formatted error
-            // Depending on the error, the server might continue or exit.
-            // For now, we continue, which is suitable for some transient errors.
-            // If select consistently fails, the server might become unresponsive.
-            // Consider adding a counter for consecutive select failures to exit eventually.
-            continue;
-        }
+static void timer_swap(int i, int j) {
+    BackendCall *tmp = timer_heap[i];
+    timer_heap[i] = timer_heap[j];
+    timer_heap[j] = tmp;
+    timer_heap[i]->timer_slot = i;
+    timer_heap[j]->timer_slot = j;
+}
 
-        if (activity == 0) {
-            continue;
-        }
+static void timer_sift_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timer_heap[parent]->timer_ms <= timer_heap[i]->timer_ms) break;
+        timer_swap(i, parent);
+        i = parent;
+    }
+}
 
-        if (FD_ISSET(discovery_fd, &readfds)) {
-            char reg_buffer[1024];
-            struct sockaddr_in backend_client_addr;
-            socklen_t backend_addr_len = sizeof(backend_client_addr);
-
-            ssize_t len = recvfrom(discovery_fd, reg_buffer, sizeof(reg_buffer) - 1, 0,
-                                   (struct sockaddr*)&backend_client_addr, &backend_addr_len);
-
-            if (len > 0) {
-                reg_buffer[len] = '\0';
-                char client_ip_str[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &backend_client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-                snprintf(log_buf, sizeof(log_buf), "Received registration message from %s:%d : %s",
-                         client_ip_str, ntohs(backend_client_addr.sin_port), reg_buffer);
-                log_with_timestamp("INFO", log_buf);
-                process_registration_message(reg_buffer, len);
-            } else if (len < 0 && (errno != EAGAIN && errno != EWOULDBLOCK)) {
-                char err_msg[256];
-                snprintf(err_msg, sizeof(err_msg), "Error receiving from discovery UDP socket: %s", strerror(errno));
-                perror("recvfrom discovery_fd error");
-                log_with_timestamp("ERROR", err_msg);
-            }
-        }
+static void timer_sift_down(int i) {
+    while (1) {
+        int left = 2 * i + 1, right = left + 1, smallest = i;
+        if (left < timer_heap_len && timer_heap[left]->timer_ms < timer_heap[smallest]->timer_ms) smallest = left;
+        if (right < timer_heap_len && timer_heap[right]->timer_ms < timer_heap[smallest]->timer_ms) smallest = right;
+        if (smallest == i) break;
+        timer_swap(i, smallest);
+        i = smallest;
+    }
+}
 
-        if (FD_ISSET(server_fd, &readfds)) {
-            log_with_timestamp("INFO", "Activity on JSON-RPC socket. Waiting for a new connection...");
-            if ((client_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-                char err_msg[256];
-                snprintf(err_msg, sizeof(err_msg), "Accept for JSON-RPC failed: %s", strerror(errno));
-                perror("accept for JSON-RPC failed");
-                log_with_timestamp("ERROR", err_msg);
-                continue;
-            }
-            log_with_timestamp("INFO","JSON-RPC Connection accepted from a client.");
+int timer_arm(BackendCall *call) {
+    if (timer_heap_len == timer_heap_cap) {
+        int new_cap = timer_heap_cap ? timer_heap_cap * 2 : 64;
+        BackendCall **grown = realloc(timer_heap, new_cap * sizeof(*grown));
+        if (!grown) return -1;
+        timer_heap = grown;
+        timer_heap_cap = new_cap;
+    }
+    call->timer_slot = timer_heap_len;
+    timer_heap[timer_heap_len++] = call;
+    timer_sift_up(call->timer_slot);
+    return 0;
+}
 
-            memset(buffer, 0, BUFFER_SIZE);
-            ssize_t bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1);
+void timer_disarm(BackendCall *call) {
+    int slot = call->timer_slot;
+    if (slot < 0) return;
+    timer_heap_len--;
+    if (slot != timer_heap_len) {
+        timer_swap(slot, timer_heap_len);
+        timer_sift_down(slot);
+        timer_sift_up(slot);
+    }
+    call->timer_slot = -1;
+}
 
-            if (bytes_read < 0) {
-                char err_msg[256];
-                snprintf(err_msg, sizeof(err_msg), "Read from JSON-RPC client failed: %s", strerror(errno));
-                perror("read from JSON-RPC client failed");
-                log_with_timestamp("ERROR", err_msg);
-                close(client_fd);
-                continue;
-            }
-            if (bytes_read == 0) {
-                log_with_timestamp("INFO", "JSON-RPC client disconnected gracefully (read 0 bytes).");
-                close(client_fd);
-                continue;
-            }
-            buffer[bytes_read] = '\0';
-            snprintf(log_buf, sizeof(log_buf), "Received JSON-RPC request: %s", buffer);
-            log_with_timestamp("DEBUG", log_buf);
-
-            char method[256];
-            double params[2];
-            int id = -1;
-            int parse_status = parse_json_rpc_request(buffer, method, params, &id);
-            char response_str[BUFFER_SIZE];
-            memset(response_str, 0, BUFFER_SIZE);
-
-            if (parse_status == 0) {
-                const char *error_message = NULL;
-
-                char chosen_backend_name[100] = "N/A";
-                RegisteredBackend* selected_backend = select_backend(method, chosen_backend_name, sizeof(chosen_backend_name));
-
-                if (selected_backend == NULL) {
-                    snprintf(log_buf, sizeof(log_buf), "Method '%s' (id: %d) not supported by any available backend or no backends available.", method, id);
-                    log_with_timestamp("ERROR", log_buf);
-                    error_message = "Method not supported by any available backend or no backends available.";
-                    build_json_rpc_response(response_str, id, 0.0, error_message);
-                } else {
-                    snprintf(log_buf, sizeof(log_buf), "Routing request for method '%s' (id: %d) to backend: %s (%s:%d)",
-                             method, id, selected_backend->name, selected_backend->host, selected_backend->port);
-                    log_with_timestamp("INFO", log_buf);
-
-                    int op_code = get_backend_op_code(method);
-                    if (op_code == 0) {
-                        error_message = "Internal server error: Method mapped to unknown operation code.";
-                        snprintf(log_buf, sizeof(log_buf), "Method '%s' (id: %d) mapped to op_code 0. This indicates an issue with is_operation_supported or get_backend_op_code logic.", method, id);
-                        log_with_timestamp("CRITICAL", log_buf);
-                        build_json_rpc_response(response_str, id, 0.0, error_message);
-                    } else {
-                        char backend_request_str[256];
-                        sprintf(backend_request_str, "%d %lf %lf", op_code, params[0], params[1]);
-
-                        char backend_response_str[1024] = {0};
-                        int communication_status = -1;
-
-                        if (strcmp(selected_backend->type, "TCP") == 0) {
-                            communication_status = communicate_with_tcp_backend(selected_backend, backend_request_str, backend_response_str, sizeof(backend_response_str));
-                        } else if (strcmp(selected_backend->type, "UDP") == 0) {
-                            communication_status = communicate_with_udp_backend(selected_backend, backend_request_str, backend_response_str, sizeof(backend_response_str));
-                        } else {
-                            snprintf(log_buf, sizeof(log_buf), "Unknown backend type '%s' for backend %s (id: %d)", selected_backend->type, selected_backend->name, id);
-                            log_with_timestamp("ERROR", log_buf);
-                            error_message = "Internal server error: Unknown backend type configured.";
-                        }
-
-                        if (error_message == NULL) {
-                            double backend_result = 0.0;
-                            char backend_error_msg[BUFFER_SIZE] = {0};
-                            const char* final_error_message_ptr = NULL;
-
-                            if (communication_status != 0) {
-                                snprintf(log_buf, sizeof(log_buf), "Error communicating with backend %s (id: %d): %s", selected_backend->name, id, backend_response_str);
-                                log_with_timestamp("ERROR", log_buf);
-                                final_error_message_ptr = backend_response_str;
-                            } else {
-                                snprintf(log_buf, sizeof(log_buf), "Raw response from backend %s (id: %d): \"%s\"", selected_backend->name, id, backend_response_str);
-                                log_with_timestamp("INFO", log_buf);
-                                int parse_res_status = parse_backend_response(backend_response_str, &backend_result, backend_error_msg, sizeof(backend_error_msg));
-
-                                if (parse_res_status == 0) {
-                                    // Success: include backend info in the result
-                                    snprintf(response_str, sizeof(response_str),
-                                        "{\"jsonrpc\": \"2.0\", \"result\": {\"value\": %.10g, \"backend\": \"%s (%s:%d)\"}, \"id\": %d}",
-                                        backend_result, selected_backend->name, selected_backend->host, selected_backend->port, id);
-                                    snprintf(log_buf, sizeof(log_buf), "Sending JSON-RPC response (id: %d): %s", id, response_str);
-                                    log_with_timestamp("DEBUG", log_buf);
-                                    write(client_fd, response_str, strlen(response_str));
-                                } else if (parse_res_status == 1) {
-                                    build_json_rpc_response(response_str, id, 0.0, backend_error_msg);
-                                    write(client_fd, response_str, strlen(response_str));
-                                } else {
-                                    final_error_message_ptr = backend_error_msg;
-                                }
-                            }
-                            build_json_rpc_response(response_str, id, 0.0, final_error_message_ptr);
-                        } else {
-                             build_json_rpc_response(response_str, id, 0.0, error_message);
-                        }
-                    }
-                }
-            } else {
-                snprintf(log_buf, sizeof(log_buf), "Failed to parse JSON-RPC request (id: %d). Body: %s", id, buffer);
-                log_with_timestamp("ERROR", log_buf);
-                build_json_rpc_response(response_str, id, 0.0, "Parse error. Invalid JSON-RPC request.");
-            }
+// Milliseconds until the earliest deadline, capped so housekeeping still runs
+int next_timer_timeout(int cap_ms) {
+    if (timer_heap_len == 0) return cap_ms;
+    long long wait = timer_heap[0]->timer_ms - monotonic_ms();
+    if (wait < 0) return 0;
+    return wait < cap_ms ? (int)wait : cap_ms;
+}
 
-            snprintf(log_buf, sizeof(log_buf), "Sending JSON-RPC response (id: %d): %s", id, response_str);
-            log_with_timestamp("DEBUG", log_buf);
-            if (write(client_fd, response_str, strlen(response_str)) < 0) {
-                char err_msg[256];
-                snprintf(err_msg, sizeof(err_msg), "Write to JSON-RPC client failed (id: %d): %s", id, strerror(errno));
-                perror("write to JSON-RPC client failed");
-                log_with_timestamp("ERROR", err_msg);
-            }
-            close(client_fd);
-            log_with_timestamp("INFO", "JSON-RPC Connection closed.");
+void release_later(EventSource *src) {
+    if (release_queue_len == release_queue_cap) {
+        int new_cap = release_queue_cap ? release_queue_cap * 2 : 64;
+        EventSource **grown = realloc(release_queue, new_cap * sizeof(*grown));
+        if (!grown) {
+            LOG(CRITICAL, "Out of memory growing release queue; leaking object.");
+            return;
         }
+        release_queue = grown;
+        release_queue_cap = new_cap;
     }
+    release_queue[release_queue_len++] = src;
+}
 
-    log_with_timestamp("INFO", "Shutting down server.");
-    close(server_fd);
-    close(discovery_fd);
-    return 0;
+void release_pending_objects() {
+    for (int i = 0; i < release_queue_len; ++i) {
+        EventSource *src = release_queue[i];
+        if (src->type == SRC_CLIENT) {
+            ClientConn *conn = (ClientConn *)src;
+            free(conn->in.data);
+            free(conn->out.data);
+            free(conn->tokens);
+        } else if (src->type == SRC_ADMIN_CONN) {
+            free(((AdminConn *)src)->out.data);
+        } else if (src->type == SRC_POOLED_CONN) {
+            free(((PooledConn *)src)->out.data);
+        }
+        free(src);
+    }
+    release_queue_len = 0;
 }
 
-double add(double a, double b) { return a + b; }
-double subtract(double a, double b) { return a - b; }
-double multiply(double a, double b) { return a * b; }
-double divide(double a, double b) { return a / b; } // Basic, assumes caller checks for b==0 based on error_message
+int buffer_reserve(ByteBuffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t new_cap = buf->cap ? buf->cap : 1024;
+    while (new_cap < buf->len + extra) new_cap *= 2;
+    char *grown = realloc(buf->data, new_cap);
+    if (!grown) return -1;
+    buf->data = grown;
+    buf->cap = new_cap;
+    return 0;
+}
 
-int parse_json_rpc_request(const char *json_str, char *method, double *params, int *id) {
-    if (json_str == NULL || method == NULL || params == NULL || id == NULL) {
-        log_with_timestamp("CRITICAL", "NULL argument to parse_json_rpc_request");
-        return -1;
+void buffer_consume(ByteBuffer *buf, size_t n) {
+    if (n >= buf->len) {
+        buf->len = 0;
+        return;
     }
-    *id = -1;
+    memmove(buf->data, buf->data + n, buf->len - n);
+    buf->len -= n;
+}
 
-    char log_buf[BUFFER_SIZE + 50];
-    const char *method_key = "\"method\": \"";
-    const char *method_start = strstr(json_str, method_key);
-    if (method_start == NULL) {
-        snprintf(log_buf, sizeof(log_buf), "Parse error: method key not found in request: %.1000s", json_str);
-        log_with_timestamp("ERROR", log_buf);
-        return -1;
-    }
-    method_start += strlen(method_key);
-    const char *method_end = strchr(method_start, '\"');
-    if (method_end == NULL || (size_t)(method_end - method_start) >= 256 ) {
-        snprintf(log_buf, sizeof(log_buf), "Parse error: method value not found or too long in request: %.1000s", json_str);
-        log_with_timestamp("ERROR", log_buf);
-        return -1;
+void client_conn_close(ClientConn *conn) {
+    if (!conn->closed) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->src.fd, NULL);
+        close(conn->src.fd);
+        conn->src.fd = -1;
+        conn->closed = 1;
+        LOG(INFO, "JSON-RPC Connection closed.");
+        if (conn->pending_calls == 0) {
+            release_later(&conn->src);
+        }
     }
-    strncpy(method, method_start, method_end - method_start);
-    method[method_end - method_start] = '\0';
+}
 
-    const char *params_key = "\"params\": [";
-    const char *params_start = strstr(json_str, params_key);
-    if (params_start == NULL) {
-        snprintf(log_buf, sizeof(log_buf), "Parse error: params key not found for method '%s' in request: %.1000s", method, json_str);
-        log_with_timestamp("ERROR", log_buf);
-        return -1;
-    }
-    params_start += strlen(params_key);
-    if (sscanf(params_start, "%lf, %lf]", &params[0], &params[1]) != 2 &&
-        sscanf(params_start, "%lf,%lf]", &params[0], &params[1]) != 2) {
-        snprintf(log_buf, sizeof(log_buf), "Parse error: could not parse params array for method '%s' in request: %.1000s", method, json_str);
-        log_with_timestamp("ERROR", log_buf);
-        return -1;
+// Writes as much of the queued responses as the socket takes. Returns 1 once
+// everything has been sent, 0 if EPOLLOUT is needed, -1 on error.
+int client_conn_flush(ClientConn *conn) {
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = send(conn->src.fd, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            LOG(ERROR, "Write to JSON-RPC client failed: %s", strerror(errno));
+            return -1;
+        }
+        conn->out_sent += n;
     }
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    return 1;
+}
 
-    const char *id_key = "\"id\": ";
-    const char *id_start = strstr(json_str, id_key);
-    if (id_start == NULL) {
-        snprintf(log_buf, sizeof(log_buf), "Parse error: id key not found for method '%s'. Request: %.1000s", method, json_str);
-        log_with_timestamp("ERROR", log_buf);
-        return -1;
+// Re-evaluates what the connection waits for after any progress. Reading is
+// paused while too many requests are in flight or responses pile up, and the
+// connection is closed once the client is done and everything is answered.
+void client_conn_update(ClientConn *conn) {
+    if (conn->closed) return;
+    if (conn->peer_done && conn->pending_calls == 0 && conn->out.len == 0) {
+        client_conn_close(conn);
+        return;
     }
-    id_start += strlen(id_key);
-    if (sscanf(id_start, "%d", id) != 1) {
-        char temp_id_str[128];
-        if (sscanf(id_start, "\"%127[^\"]\"", temp_id_str) == 1) {
-             snprintf(log_buf, sizeof(log_buf), "Parse warning: id is a string (\"%s\") but only integer IDs are supported. Method '%s'. Treating as parse error for ID. Request: %.1000s", temp_id_str, method, json_str);
-             log_with_timestamp("WARNING", log_buf);
-        } else if (strncmp(id_start, "null", 4) == 0) {
-             snprintf(log_buf, sizeof(log_buf), "Parse warning: id is null. Method '%s'. Treating as parse error for ID. Request: %.1000s", method, json_str);
-             log_with_timestamp("WARNING", log_buf);
-        } else {
-            snprintf(log_buf, sizeof(log_buf), "Parse error: could not parse id as integer for method '%s'. Request: %.1000s", method, json_str);
-            log_with_timestamp("ERROR", log_buf);
-        }
-        *id = -1; // Ensure id is -1 on any parsing failure for it
-        return -1;
+    uint32_t wanted = 0;
+    if (!conn->peer_done && conn->pending_calls < MAX_PIPELINED_REQUESTS &&
+        conn->out.len - conn->out_sent < CLIENT_OUTPUT_HIGH_WATER) {
+        wanted |= EPOLLIN;
+    }
+    if (conn->out.len > conn->out_sent) wanted |= EPOLLOUT;
+    if (wanted != conn->watched_events) {
+        watch_fd(&conn->src, EPOLL_CTL_MOD, wanted);
+        conn->watched_events = wanted;
     }
-    return 0;
 }
 
-void build_json_rpc_response(char *response_str, int id, double result, const char *error_message) {
-    if (response_str == NULL) {
-        log_with_timestamp("CRITICAL", "build_json_rpc_response called with NULL response_str");
+// Queues one newline-terminated response. Responses go out in completion
+// order; clients match them to requests by id.
+void client_conn_respond(ClientConn *conn, const char *response_str) {
+    if (conn->closed) {
+        LOG(WARNING, "JSON-RPC client went away before its response was ready. Dropping response.");
         return;
     }
-    char temp_buf[BUFFER_SIZE];
+    LOG(DEBUG, "Sending JSON-RPC response: %s", response_str);
 
-    if (error_message) {
+    size_t len = strlen(response_str);
+    if (buffer_reserve(&conn->out, len + 1) < 0) {
+        LOG(ERROR, "Out of memory queueing JSON-RPC response. Closing connection.");
+        client_conn_close(conn);
+        return;
+    }
+    memcpy(conn->out.data + conn->out.len, response_str, len);
+    conn->out.data[conn->out.len + len] = '\n';
+    conn->out.len += len + 1;
+
+    if (client_conn_flush(conn) < 0) {
+        client_conn_close(conn);
+        return;
+    }
+    client_conn_update(conn);
+}
+
+// Sends the whole batch as a single JSON array, in request order, once no
+// element is outstanding any more, and frees it.
+void client_batch_send_if_complete(ClientBatch *batch) {
+    if (batch->remaining > 0) return;
+
+    size_t total = 2;
+    for (int i = 0; i < batch->count; ++i) {
+        if (batch->responses[i]) total += strlen(batch->responses[i]) + 2;
+    }
+    char *combined = malloc(total + 1);
+    if (combined) {
+        size_t len = 0;
+        combined[len++] = '[';
+        for (int i = 0; i < batch->count; ++i) {
+            if (!batch->responses[i]) continue;
+            if (len > 1) {
+                combined[len++] = ',';
+                combined[len++] = ' ';
+            }
+            size_t part = strlen(batch->responses[i]);
+            memcpy(combined + len, batch->responses[i], part);
+            len += part;
+        }
+        combined[len++] = ']';
+        combined[len] = '\0';
+        client_conn_respond(batch->client, combined);
+        free(combined);
+    } else {
+        LOG(ERROR, "Out of memory assembling batch response. Closing connection.");
+        client_conn_close(batch->client);
+    }
+    for (int i = 0; i < batch->count; ++i) free(batch->responses[i]);
+    free(batch->responses);
+    free(batch);
+}
+
+// Stores one element's answer in its slot
+void client_batch_fill(ClientBatch *batch, int slot, const char *response_str) {
+    batch->responses[slot] = strdup(response_str);
+    if (!batch->responses[slot]) {
+        LOG(ERROR, "Out of memory storing batch response element.");
+    }
+    batch->remaining--;
+    client_batch_send_if_complete(batch);
+}
+
+// Routes a response either straight to the client or into its batch slot
+void deliver_response(ClientConn *conn, ClientBatch *batch, int slot, const char *response_str) {
+    if (batch) {
+        client_batch_fill(batch, slot, response_str);
+    } else {
+        client_conn_respond(conn, response_str);
+    }
+}
+
+// Counts a client request whose response has been produced
+void method_metrics_record(int method, long long started_us, int failed) {
+    MethodMetrics *metrics = &method_metrics[method];
+    long long latency_us = monotonic_us() - started_us;
+    histogram_record(&metrics->latency_us, latency_us > 0 ? (uint64_t)latency_us : 0);
+    metrics->requests++;
+    if (failed) metrics->errors++;
+}
+
+ConnPool *pool_for(const RegisteredBackend *backend) {
+    return &backend_pools[backend - registered_backends];
+}
+
+BackendMetrics *metrics_for(const RegisteredBackend *backend) {
+    return &backend_metrics[backend - registered_backends];
+}
+
+int call_fd(const BackendCall *call) {
+    return call->conn ? call->conn->src.fd : call->src.fd;
+}
+
+EventSource *call_source(BackendCall *call) {
+    return call->conn ? &call->conn->src : &call->src;
+}
+
+void backend_call_on_event(BackendCall *call, uint32_t events);
+void backend_call_fail(BackendCall *call, const char *what, int err);
+void backend_call_complete(BackendCall *call, int communication_status);
+
+// Answers a call the gateway has no capacity for with a "server busy" error.
+// Overload is not the backend's fault, so it is not held against it.
+void backend_call_shed(BackendCall *call, const char *why) {
+    LOG(WARNING, "Shedding call (id: %d) to backend %s: %s.", call->request_id, call->backend->name, why);
+    call->shed = 1;
+    snprintf(call->response, sizeof(call->response), "Server busy. Try again later.");
+    backend_call_complete(call, -1);
+}
+
+// Opens a new non-blocking connection for the pool. It joins the pool as
+// idle (or serves a waiting call) once the connect completes.
+PooledConn *pool_open_conn(RegisteredBackend *backend) {
+    ConnPool *pool = pool_for(backend);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(backend->port);
+    if (inet_pton(AF_INET, backend->host, &server_addr.sin_addr) <= 0) {
+        LOG(ERROR, "Invalid backend address %s for %s", backend->host, backend->name);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0 || set_nonblocking(sock_fd) < 0) {
+        int err = errno;
+        LOG(ERROR, "TCP socket creation for backend %s failed: %s", backend->name, strerror(err));
+        if (sock_fd >= 0) close(sock_fd);
+        errno = err;
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        int err = errno;
+        LOG(ERROR, "TCP connect to backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(err));
+        close(sock_fd);
+        errno = err;
+        return NULL;
+    }
+
+    PooledConn *conn = calloc(1, sizeof(PooledConn));
+    if (!conn) {
+        close(sock_fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    conn->src.type = SRC_POOLED_CONN;
+    conn->src.fd = sock_fd;
+    conn->state = CONN_CONNECTING;
+    conn->backend = backend;
+    conn->generation = pool->generation;
+    conn->multiplexed = backend->proto_bin1;
+    conn->watched_events = EPOLLOUT;
+    if (watch_fd(&conn->src, EPOLL_CTL_ADD, EPOLLOUT) < 0) {
+        int err = errno;
+        close(sock_fd);
+        free(conn);
+        errno = err;
+        return NULL;
+    }
+    pool->open_count++;
+    pool->connecting_count++;
+    return conn;
+}
+
+// Takes a connection out of the idle stack; it is left CONN_BUSY
+void pool_unlist_idle(ConnPool *pool, PooledConn *conn) {
+    for (int i = 0; i < pool->idle_count; ++i) {
+        if (pool->idle[i] == conn) {
+            memmove(&pool->idle[i], &pool->idle[i + 1], (pool->idle_count - i - 1) * sizeof(pool->idle[0]));
+            pool->idle_count--;
+            break;
+        }
+    }
+    conn->state = CONN_BUSY;
+}
+
+void pool_close_conn(PooledConn *conn) {
+    ConnPool *pool = pool_for(conn->backend);
+    if (conn->state == CONN_IDLE) {
+        pool_unlist_idle(pool, conn);
+    } else if (conn->state == CONN_CONNECTING) {
+        pool->connecting_count--;
+    }
+    if (conn->call) conn->call->conn = NULL;
+    // Calls still in flight on a multiplexed conn are left to their timers
+    for (BackendCall *call = conn->inflight_head; call; call = call->mux_next) call->conn = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->src.fd, NULL);
+    close(conn->src.fd);
+    conn->src.fd = -1;
+    pool->open_count--;
+    release_later(&conn->src);
+}
+
+BackendCall *pool_pop_waiter(ConnPool *pool) {
+    BackendCall *call = pool->wait_head;
+    if (call) {
+        pool->wait_head = call->next_waiting;
+        if (!pool->wait_head) pool->wait_tail = NULL;
+        call->next_waiting = NULL;
+        pool->waiting_count--;
+    }
+    return call;
+}
+
+void pool_remove_waiter(ConnPool *pool, BackendCall *call) {
+    BackendCall **link = &pool->wait_head;
+    BackendCall *prev = NULL;
+    while (*link && *link != call) {
+        prev = *link;
+        link = &(*link)->next_waiting;
+    }
+    if (!*link) return;
+    *link = call->next_waiting;
+    if (pool->wait_tail == call) pool->wait_tail = prev;
+    call->next_waiting = NULL;
+    pool->waiting_count--;
+}
+
+// Makes sure enough connects are underway to serve the calls still waiting
+void pool_grow_for_waiters(ConnPool *pool, RegisteredBackend *backend) {
+    int calls_per_conn = backend->proto_bin1 ? MUX_MAX_IN_FLIGHT : 1;
+    while (pool->waiting_count > pool->connecting_count * calls_per_conn && pool->open_count < pool_max_size) {
+        if (pool_open_conn(backend) != NULL) continue;
+        // Nothing can be opened right now; the head waiter gets the error
+        BackendCall *call = pool_pop_waiter(pool);
+        if (!call) return;
+        backend_call_fail(call, "connect to", errno);
+    }
+}
+
+// Takes the next call to serve off the wait queue, shedding the ones CoDel
+// drops while the queue is standing
+BackendCall *pool_next_waiter(ConnPool *pool) {
+    BackendCall *call;
+    while ((call = pool_pop_waiter(pool)) != NULL) {
+        long long now = monotonic_us();
+        if (codel_target_ms <= 0 ||
+            !codel_should_drop(&pool->codel, now - call->queued_us, now, codel_target_ms * 1000, codel_interval_ms * 1000)) {
+            return call;
+        }
+        metrics_for(call->backend)->shed_codel++;
+        char why[128];
+        snprintf(why, sizeof(why), "waited %lld ms in the backend's queue, over target", (now - call->queued_us) / 1000);
+        backend_call_shed(call, why);
+    }
+    return NULL;
+}
+
+void mux_assign(PooledConn *conn, BackendCall *call);
+void mux_fill(PooledConn *conn);
+
+void pool_assign(PooledConn *conn, BackendCall *call) {
+    if (conn->multiplexed) {
+        mux_assign(conn, call);
+        return;
+    }
+    conn->state = CONN_BUSY;
+    conn->call = call;
+    call->conn = conn;
+    call->state = CALL_SENDING;
+    call->request_sent = 0;
+    call->response_len = 0;
+    backend_call_on_event(call, EPOLLOUT);
+}
+
+// Returns a healthy connection to the pool, handing it straight to the
+// next waiting call if there is one.
+void pool_release_conn(PooledConn *conn) {
+    ConnPool *pool = pool_for(conn->backend);
+    if (conn->multiplexed) {
+        conn->state = CONN_BUSY;
+        mux_fill(conn);
+        return;
+    }
+    if (conn->call) conn->call->conn = NULL;
+    conn->call = NULL;
+    conn->last_used_ms = monotonic_ms();
+    if (conn->generation != pool->generation) {
+        // Opened before the backend moved
+        pool_close_conn(conn);
+        return;
+    }
+
+    BackendCall *waiter = pool_next_waiter(pool);
+    if (waiter) {
+        pool_assign(conn, waiter);
+        return;
+    }
+    if (pool->idle_count >= MAX_POOL_SIZE) {
+        pool_close_conn(conn);
+        return;
+    }
+    conn->state = CONN_IDLE;
+    pool->idle[pool->idle_count++] = conn;
+    // Readability on an idle connection means the backend closed it
+    watch_fd(&conn->src, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+// Adds a call to the end of its backend's wait queue, or sheds it when the
+// queue is full. Returns 0 if the call was queued.
+int pool_enqueue(ConnPool *pool, BackendCall *call, const char *full_reason) {
+    call->state = CALL_QUEUED;
+    if (pool->waiting_count >= max_queue_depth) {
+        metrics_for(call->backend)->shed_queue_full++;
+        backend_call_shed(call, full_reason);
+        return -1;
+    }
+    call->queued_us = monotonic_us();
+    if (pool->wait_tail) pool->wait_tail->next_waiting = call;
+    else pool->wait_head = call;
+    pool->wait_tail = call;
+    pool->waiting_count++;
+    return 0;
+}
+
+// Starts a TCP call on an idle pooled connection, or queues it until one
+// becomes available.
+void pool_dispatch(BackendCall *call) {
+    ConnPool *pool = pool_for(call->backend);
+    call->state = CALL_QUEUED;
+    if (pool->idle_count > 0) {
+        codel_queue_empty(&pool->codel);
+        PooledConn *conn = pool->idle[--pool->idle_count];
+        conn->state = CONN_BUSY;
+        pool_assign(conn, call);
+        return;
+    }
+    if (pool_enqueue(pool, call, "connection queue full") == 0) pool_grow_for_waiters(pool, call->backend);
+}
+
+// In-flight lists of multiplexed conns and UDP channels
+void inflight_append(BackendCall **head, BackendCall **tail, BackendCall *call) {
+    call->mux_prev = *tail;
+    call->mux_next = NULL;
+    if (*tail) (*tail)->mux_next = call;
+    else *head = call;
+    *tail = call;
+}
+
+void inflight_remove(BackendCall **head, BackendCall **tail, BackendCall *call) {
+    if (call->mux_prev) call->mux_prev->mux_next = call->mux_next;
+    else *head = call->mux_next;
+    if (call->mux_next) call->mux_next->mux_prev = call->mux_prev;
+    else *tail = call->mux_prev;
+    call->mux_prev = call->mux_next = NULL;
+}
+
+BackendCall *inflight_find(BackendCall *head, uint32_t frame_id) {
+    while (head && head->frame_id != frame_id) head = head->mux_next;
+    return head;
+}
+
+// Calls are framed in the order they were queued, so the unframed ones are
+// always the last `count` of an in-flight list. Returns the first of them.
+BackendCall *unframed_calls(BackendCall *tail, int count) {
+    for (int i = 1; i < count; ++i) tail = tail->mux_prev;
+    return tail;
+}
+
+// Encodes calls into one frame at `frame` (CALC_MAX_REQUEST_SIZE bytes) and
+// marks them framed. More than one make a batch frame, ordered by op so the
+// backend evaluates each op's calls with one kernel run. Reorders `calls`.
+size_t encode_calls(BackendCall **calls, int count, unsigned char *frame) {
+    for (int i = 0; i < count; ++i) calls[i]->framed = 1;
+    if (count == 1) {
+        memcpy(frame, calls[0]->request, calls[0]->request_len);
+        return calls[0]->request_len;
+    }
+
+    // Stable insertion sort by op; count is at most CALC_BATCH_MAX
+    for (int i = 1; i < count; ++i) {
+        BackendCall *call = calls[i];
+        int j = i;
+        for (; j > 0 && calls[j - 1]->op_code > call->op_code; --j) calls[j] = calls[j - 1];
+        calls[j] = call;
+    }
+    uint32_t ids[CALC_BATCH_MAX];
+    unsigned char ops[CALC_BATCH_MAX];
+    double a[CALC_BATCH_MAX], b[CALC_BATCH_MAX];
+    for (int i = 0; i < count; ++i) {
+        ids[i] = calls[i]->frame_id;
+        ops[i] = (unsigned char)calls[i]->op_code;
+        a[i] = calls[i]->params[0];
+        b[i] = calls[i]->params[1];
+    }
+    BackendMetrics *metrics = metrics_for(calls[0]->backend);
+    metrics->batch_frames++;
+    metrics->batched_calls += count;
+    return calc_encode_batch_request(frame, count, ids, ops, a, b);
+}
+
+void mux_watch(PooledConn *conn) {
+    uint32_t events = EPOLLIN | (conn->out.len > 0 || conn->unframed_count > 0 ? EPOLLOUT : 0);
+    if (events == conn->watched_events) return;
+    if (watch_fd(&conn->src, EPOLL_CTL_MOD, events) == 0) conn->watched_events = events;
+}
+
+// Writes queued calls until the socket would block, encoding the ones not
+// in a frame yet first. Returns -1 with errno set if the connection failed.
+int mux_flush(PooledConn *conn) {
+    if (conn->unframed_count > 0) {
+        int max = conn->backend->batch_max > 0 ? conn->backend->batch_max : 1;
+        BackendCall *call = unframed_calls(conn->inflight_tail, conn->unframed_count);
+        conn->unframed_count = 0;
+        while (call) {
+            BackendCall *calls[CALC_BATCH_MAX];
+            int count = 0;
+            for (; call && count < max; call = call->mux_next) calls[count++] = call;
+            if (buffer_reserve(&conn->out, CALC_MAX_REQUEST_SIZE) < 0) {
+                // Never sent: these calls run into their timeouts
+                LOG(ERROR, "Out of memory queueing frames to backend %s.", conn->backend->name);
+                for (int i = 0; i < count; ++i) calls[i]->framed = 1;
+                continue;
+            }
+            conn->out.len += encode_calls(calls, count, (unsigned char *)conn->out.data + conn->out.len);
+        }
+    }
+
+    size_t sent = 0;
+    int result = 0;
+    while (sent < conn->out.len) {
+        ssize_t n = send(conn->src.fd, conn->out.data + sent, conn->out.len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) result = -1;
+            break;
+        }
+        sent += n;
+    }
+    int err = errno;
+    buffer_consume(&conn->out, sent);
+    mux_watch(conn);
+    errno = err;
+    return result;
+}
+
+void mux_detach(PooledConn *conn, BackendCall *call) {
+    if (!call->framed) conn->unframed_count--;
+    inflight_remove(&conn->inflight_head, &conn->inflight_tail, call);
+    call->conn = NULL;
+    conn->inflight_count--;
+}
+
+// Queues a call on a multiplexed connection. Calls queued during one pass of
+// the event loop are encoded and go out together once the socket reports
+// writable, as batch frames if the backend takes them.
+void mux_send(PooledConn *conn, BackendCall *call) {
+    call->conn = conn;
+    inflight_append(&conn->inflight_head, &conn->inflight_tail, call);
+    conn->inflight_count++;
+    conn->unframed_count++;
+    call->framed = 0;
+    call->state = CALL_RECEIVING;
+    call->request_sent = call->request_len;
+    call->response_len = 0;
+    conn->last_used_ms = monotonic_ms();
+}
+
+// Puts a multiplexed connection where it belongs after its load changed: in
+// the idle stack while it has room, out of it when full, closed once it is
+// stale and has nothing left in flight.
+void mux_place(PooledConn *conn) {
+    ConnPool *pool = pool_for(conn->backend);
+    if (conn->generation != pool->generation) {
+        if (conn->state == CONN_IDLE) pool_unlist_idle(pool, conn);
+        if (conn->inflight_count == 0) pool_close_conn(conn);
+        else mux_watch(conn);
+        return;
+    }
+    int has_room = conn->inflight_count < MUX_MAX_IN_FLIGHT;
+    if (has_room && conn->state != CONN_IDLE) {
+        conn->state = CONN_IDLE;
+        pool->idle[pool->idle_count++] = conn; // Fits: there are at most MAX_POOL_SIZE connections
+    } else if (!has_room && conn->state == CONN_IDLE) {
+        pool_unlist_idle(pool, conn);
+    }
+    mux_watch(conn);
+}
+
+void mux_assign(PooledConn *conn, BackendCall *call) {
+    mux_send(conn, call);
+    mux_place(conn);
+}
+
+// Gives a multiplexed connection as many waiting calls as it has room for
+void mux_fill(PooledConn *conn) {
+    ConnPool *pool = pool_for(conn->backend);
+    if (conn->state == CONN_IDLE) pool_unlist_idle(pool, conn);
+    BackendCall *waiter;
+    while (conn->generation == pool->generation && conn->inflight_count < MUX_MAX_IN_FLIGHT &&
+           (waiter = pool_next_waiter(pool)) != NULL) {
+        mux_send(conn, waiter);
+    }
+    mux_place(conn);
+}
+
+// Fails every call in flight on a broken multiplexed connection and closes
+// it. As on a one-call connection, a call on a connection that had already
+// been answering is tried once more on a fresh one.
+void mux_conn_fail(PooledConn *conn, const char *what, int err) {
+    int reused = conn->requests_served > 0;
+    BackendCall *calls = conn->inflight_head;
+    LOG(WARNING, "Multiplexed TCP connection to backend %s failed (%s) with %d calls in flight.",
+        conn->backend->name, strerror(err), conn->inflight_count);
+    for (BackendCall *call = calls; call; call = call->mux_next) call->conn = NULL;
+    conn->inflight_head = conn->inflight_tail = NULL;
+    conn->inflight_count = 0;
+    conn->unframed_count = 0;
+    pool_close_conn(conn);
+
+    while (calls) {
+        BackendCall *call = calls;
+        calls = call->mux_next;
+        call->mux_prev = call->mux_next = NULL;
+        if (reused && !call->stale_retry_used) {
+            call->stale_retry_used = 1;
+            pool_dispatch(call);
+        } else {
+            backend_call_fail(call, what, err);
+        }
+    }
+}
+
+// Stores reply `index` of a reply frame as the call's response, in the
+// single-reply form parse_binary_response reads
+void take_reply(BackendCall *call, const unsigned char *frame, size_t index) {
+    uint32_t frame_id;
+    int status;
+    double result;
+    calc_decode_reply_entry(frame, index, &frame_id, &status, &result);
+    calc_encode_reply((unsigned char *)call->response, frame_id, (CalcStatus)status, result);
+    call->response_len = CALC_REPLY_SIZE;
+}
+
+// Completes the calls a single or batch reply frame answers
+void mux_deliver(PooledConn *conn, const unsigned char *frame, size_t size) {
+    size_t count = calc_reply_count(frame);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t frame_id;
+        int status;
+        double result;
+        calc_decode_reply_entry(frame, i, &frame_id, &status, &result);
+        BackendCall *call = inflight_find(conn->inflight_head, frame_id);
+        if (!call) {
+            LOG(DEBUG, "Dropping reply to frame %u from backend %s: its call is already over.", frame_id, conn->backend->name);
+            continue;
+        }
+        mux_detach(conn, call);
+        conn->requests_served++;
+        take_reply(call, frame, i);
+        LOG(INFO, "TCP received from backend %s: %zu-byte %s reply (frame %u)", conn->backend->name, size, CALC_PROTO_NAME, frame_id);
+        backend_call_complete(call, 0);
+    }
+}
+
+void mux_conn_on_event(PooledConn *conn, uint32_t events) {
+    if ((events & EPOLLOUT) && mux_flush(conn) < 0) {
+        mux_conn_fail(conn, "send data to", errno);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+
+    // Never full: what is left between reads is part of one frame
+    ssize_t n = recv(conn->src.fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        mux_conn_fail(conn, "receive data from", errno);
+        return;
+    }
+    if (n == 0) {
+        if (conn->inflight_count == 0) {
+            LOG(INFO, "Idle TCP connection to backend %s closed by peer.", conn->backend->name);
+            pool_close_conn(conn);
+        } else {
+            mux_conn_fail(conn, "receive data from", ECONNRESET);
+        }
+        return;
+    }
+    conn->last_used_ms = monotonic_ms();
+
+    // Replies may arrive split or several to a read
+    conn->in_len += n;
+    size_t used = 0;
+    for (;;) {
+        long size = calc_reply_frame_size(conn->in + used, conn->in_len - used);
+        if (size < 0) {
+            // Not a reply frame: the stream is out of step
+            mux_conn_fail(conn, "receive data from", EPROTO);
+            return;
+        }
+        if (size == 0 || (size_t)size > conn->in_len - used) break;
+        mux_deliver(conn, conn->in + used, size);
+        used += size;
+    }
+    conn->in_len -= used;
+    memmove(conn->in, conn->in + used, conn->in_len);
+    mux_fill(conn);
+}
+
+void pooled_conn_on_event(PooledConn *conn, uint32_t events) {
+    ConnPool *pool = pool_for(conn->backend);
+
+    if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->src.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+        if (err == 0 && !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        if (err != 0) {
+            RegisteredBackend *backend = conn->backend;
+            LOG(ERROR, "TCP connect to backend %s (%s:%d) failed: %s", backend->name, backend->host, backend->port, strerror(err));
+            pool_close_conn(conn);
+            BackendCall *call = pool_pop_waiter(pool);
+            if (call) backend_call_fail(call, "connect to", err);
+            pool_grow_for_waiters(pool, backend);
+            return;
+        }
+        pool->connecting_count--;
+        LOG(INFO, "TCP connected to backend %s (pool: %d open).", conn->backend->name, pool->open_count);
+        pool_release_conn(conn);
+        return;
+    }
+
+    if (conn->multiplexed) {
+        mux_conn_on_event(conn, events);
+        return;
+    }
+    if (conn->state == CONN_IDLE) {
+        LOG(INFO, "Idle TCP connection to backend %s closed by peer.", conn->backend->name);
+        pool_close_conn(conn);
+        return;
+    }
+
+    backend_call_on_event(conn->call, events);
+}
+
+// Closes idle connections that outlived the idle timeout and pre-opens
+// connections up to the configured minimum for every active TCP backend.
+void pool_maintain() {
+    long long now = monotonic_ms();
+    for (int i = 0; i < num_registered_backends; ++i) {
+        RegisteredBackend *backend = &registered_backends[i];
+        ConnPool *pool = &backend_pools[i];
+        if (!backend->is_active || strcmp(backend->type, "TCP") != 0) {
+            pool_drain_idle(backend);
+            continue;
+        }
+        while (pool->idle_count > 0 && pool->open_count > pool_min_size && pool->idle[0]->inflight_count == 0 &&
+               now - pool->idle[0]->last_used_ms >= pool_idle_timeout_ms) {
+            pool_close_conn(pool->idle[0]);
+            LOG(DEBUG, "Reaped idle TCP connection to backend %s (pool: %d open).", backend->name, pool->open_count);
+        }
+        while (pool->open_count < pool_min_size) {
+            if (pool_open_conn(backend) == NULL) break;
+        }
+    }
+}
+
+// Drops idle connections, e.g. after a backend re-registered with a new
+// address. Connections still busy are closed instead of reused once done.
+void pool_drain_idle(RegisteredBackend *backend) {
+    ConnPool *pool = pool_for(backend);
+    pool->generation++;
+    while (pool->idle_count > 0) {
+        PooledConn *conn = pool->idle[0];
+        if (conn->inflight_count > 0) pool_unlist_idle(pool, conn);
+        else pool_close_conn(conn);
+    }
+}
+
+void udp_channel_detach(UdpChannel *channel, BackendCall *call);
+
+void backend_call_free(BackendCall *call) {
+    timer_disarm(call);
+    if (call->sibling) call->sibling->sibling = NULL;
+    if (call->state == CALL_QUEUED) {
+        pool_remove_waiter(pool_for(call->backend), call);
+    }
+    if (call->conn && call->conn->multiplexed) {
+        // A reply that still comes is dropped by its frame id
+        PooledConn *conn = call->conn;
+        mux_detach(conn, call);
+        mux_fill(conn);
+    } else if (call->conn) {
+        // Still mid-exchange: the connection's state is unknown, so drop it
+        pool_close_conn(call->conn);
+    }
+    if (call->channel) udp_channel_detach(call->channel, call);
+    if (call->src.fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, call->src.fd, NULL);
+        close(call->src.fd);
+        call->src.fd = -1;
+    }
+    ClientConn *client = call->client;
+    call->backend->stats.in_flight--;
+    release_later(&call->src);
+    client->pending_calls--;
+    if (client->closed && client->pending_calls == 0) {
+        release_later(&client->src);
+    } else {
+        client_conn_update(client);
+    }
+}
+
+static int compare_latency(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void backend_stats_refresh_p99(BackendStats *stats, long long now) {
+    long long recent[LATENCY_WINDOW];
+    int count = 0;
+    for (int i = 0; i < stats->window_count; ++i) {
+        if (now - stats->window_at_ms[i] <= LATENCY_WINDOW_MS) recent[count++] = stats->window_latency_ms[i];
+    }
+    stats->hedge_delay_ms = 0;
+    stats->p99_samples = count;
+    if (count == 0) {
+        stats->p99_latency_ms = 0;
+        return;
+    }
+    qsort(recent, count, sizeof(recent[0]), compare_latency);
+    stats->p99_latency_ms = recent[(count * 99 + 99) / 100 - 1];
+    if (hedge_percentile > 0 && count >= HEDGE_MIN_SAMPLES) {
+        int rank = (int)(count * hedge_percentile / 100.0 + 0.999999);
+        stats->hedge_delay_ms = recent[(rank < 1 ? 1 : rank > count ? count : rank) - 1];
+        if (stats->hedge_delay_ms < 1) stats->hedge_delay_ms = 1; // Timers have ms resolution
+    }
+}
+
+// Folds one call outcome into the backend's selection inputs. A failed call
+// counts as a full timeout so that a backend refusing connections quickly
+// does not look fast.
+void backend_stats_record(RegisteredBackend *backend, long long latency_ms, int failed) {
+    BackendStats *stats = &backend->stats;
+    double sample = failed ? (double)backend_timeout_max_ms : (double)latency_ms;
+    if (failed) stats->failed++;
+    else stats->completed++;
+    if (stats->completed + stats->failed == 1) {
+        stats->ewma_latency_ms = sample;
+    } else {
+        stats->ewma_latency_ms += EWMA_ALPHA * (sample - stats->ewma_latency_ms);
+    }
+
+    long long now = monotonic_ms();
+    stats->window_latency_ms[stats->window_next] = (long long)sample;
+    stats->window_at_ms[stats->window_next] = now;
+    stats->window_next = (stats->window_next + 1) % LATENCY_WINDOW;
+    if (stats->window_count < LATENCY_WINDOW) stats->window_count++;
+    // A backend over the local-evaluation threshold only sees probe calls,
+    // so its p99 is kept exact to let it recover as soon as they are fast.
+    // A failure widens the backend's timeout right away, see backend_timeout_ms.
+    if (failed || stats->window_count < P99_REFRESH_SAMPLES || (stats->completed + stats->failed) % P99_REFRESH_SAMPLES == 0 ||
+        stats->p99_latency_ms > local_eval_p99_ms) {
+        backend_stats_refresh_p99(stats, now);
+    }
+}
+
+// How long a call to the backend may take: --timeout-factor times its recent
+// p99, within --timeout-min-ms and --timeout-max-ms. Until the backend has
+// enough recent samples it gets the maximum. A failed call is sampled as
+// the maximum, so after a timeout the backend gets the full time again
+// until that sample leaves the window.
+long long backend_timeout_ms(const RegisteredBackend *backend) {
+    const BackendStats *stats = &backend->stats;
+    if (backend_timeout_factor <= 0 || stats->p99_samples < ADAPTIVE_TIMEOUT_MIN_SAMPLES) return backend_timeout_max_ms;
+    long long timeout = (long long)(stats->p99_latency_ms * backend_timeout_factor + 0.5);
+    if (timeout < backend_timeout_min_ms) timeout = backend_timeout_min_ms;
+    if (timeout > backend_timeout_max_ms) timeout = backend_timeout_max_ms;
+    return timeout;
+}
+
+// Ejects active backends whose recent latency makes them outliers, see
+// backend_health.h
+void sweep_backend_outliers() {
+    BackendHealth *healths[MAX_REGISTERED_BACKENDS_CONFIG];
+    int slots[MAX_REGISTERED_BACKENDS_CONFIG];
+    int count = 0;
+    for (int i = 0; i < num_registered_backends; ++i) {
+        if (!registered_backends[i].is_active) continue;
+        slots[count] = i;
+        healths[count++] = &registered_backends[i].health;
+    }
+    int ejected[MAX_REGISTERED_BACKENDS_CONFIG];
+    int num_ejected = health_sweep_outliers(healths, count, monotonic_ms(), ejected);
+    for (int k = 0; k < num_ejected; ++k) {
+        RegisteredBackend *backend = &registered_backends[slots[ejected[k]]];
+        metrics_for(backend)->ejections++;
+        LOG(WARNING, "Ejected backend %s as a latency outlier for %lld ms (ejection #%d in a row).", backend->name,
+            backend->health.ejected_until_ms - monotonic_ms(), backend->health.ejection_count);
+    }
+}
+
+// Turns the outcome of a backend call into the JSON-RPC response for its client.
+// communication_status is 0 when call->response holds the backend's reply and
+// -1 when it holds a gateway error message.
+// Reads a call's answer in the protocol it was sent with
+int parse_call_response(const BackendCall *call, double *result_out, char *error_msg_out, size_t error_msg_out_size) {
+    if (call->binary) {
+        return parse_binary_response((const unsigned char *)call->response, call->response_len, call->frame_id,
+                                     result_out, error_msg_out, error_msg_out_size);
+    }
+    return parse_backend_response(call->response, result_out, error_msg_out, error_msg_out_size);
+}
+
+void backend_call_complete(BackendCall *call, int communication_status) {
+    char response_str[BUFFER_SIZE];
+    RegisteredBackend *backend = call->backend;
+    int id = call->request_id;
+    BackendMetrics *metrics = metrics_for(backend);
+    long long latency_us = monotonic_us() - call->started_us;
+    int succeeded = 0;
+    // Out of the client's time, or shed, rather than the backend's fault:
+    // not held against it
+    int abandoned = call->shed || (call->timed_out && call->deadline_from_client);
+
+    if (!abandoned) backend_stats_record(backend, latency_us / 1000, communication_status != 0);
+    if (!call->shed) metrics->requests++;
+    BreakerState breaker_before = backend->health.breaker;
+    if (abandoned) {
+        health_call_abandoned(&backend->health, call->breaker_trial);
+    } else {
+        health_record(&backend->health, communication_status != 0, latency_us / 1000.0, call->breaker_trial, monotonic_ms());
+    }
+    if (backend->health.breaker == BREAKER_OPEN && breaker_before == BREAKER_HALF_OPEN) {
+        metrics->circuit_opens++;
+        LOG(WARNING, "Circuit for backend %s reopened: trial call failed; no calls for %d ms.", backend->name, HEALTH_OPEN_MS);
+    } else if (backend->health.breaker == BREAKER_OPEN && breaker_before == BREAKER_CLOSED) {
+        metrics->circuit_opens++;
+        LOG(WARNING, "Circuit for backend %s opened: %d failures in a row, %d of the last %d calls; no calls for %d ms.",
+            backend->name, backend->health.consecutive_failures, health_window_failures(&backend->health),
+            backend->health.outcome_count, HEALTH_OPEN_MS);
+    } else if (backend->health.breaker == BREAKER_CLOSED && breaker_before == BREAKER_HALF_OPEN) {
+        LOG(INFO, "Circuit for backend %s closed: trial call succeeded.", backend->name);
+    }
+
+    if (communication_status != 0) {
+        LOG(ERROR, "Error communicating with backend %s (id: %d): %s", backend->name, id, call->response);
+        build_json_rpc_response(response_str, id, 0.0, call->response);
+    } else {
+        if (!call->binary) LOG(INFO, "Raw response from backend %s (id: %d): \"%s\"", backend->name, id, call->response);
+
+        double backend_result = 0.0;
+        char backend_error_msg[BUFFER_SIZE] = {0};
+        int parse_res_status = parse_call_response(call, &backend_result, backend_error_msg, sizeof(backend_error_msg));
+        // Only the backend's own answers are kept, not failures to get one.
+        // Text backends see operands cut to 6 decimals and answer with 2, so
+        // only exact bin1 answers may stand in for any later call.
+        if (call->binary && parse_res_status == 0) {
+            result_cache_store(&result_cache, call->op_code, call->params[0], call->params[1], backend_result, NULL);
+        } else if (call->binary && parse_res_status == 1) {
+            result_cache_store(&result_cache, call->op_code, call->params[0], call->params[1], 0.0, backend_error_msg);
+        }
+        histogram_record(&metrics->latency_us, latency_us > 0 ? (uint64_t)latency_us : 0);
+        if (parse_res_status == 0) {
+            // Success: include backend info in the result
+            char backend_label[BUFFER_SIZE];
+            snprintf(backend_label, sizeof(backend_label), "%s (%s:%d)", backend->name, backend->host, backend->port);
+            succeeded = build_result_response(response_str, id, backend_result, backend_label) == 0;
+        } else {
+            build_json_rpc_response(response_str, id, 0.0, backend_error_msg);
+        }
+        if (call->conn) {
+            call->conn->requests_served++;
+            pool_release_conn(call->conn);
+        }
+    }
+
+    if (!succeeded && !call->shed) metrics->errors++;
+
+    // Of a hedged pair, the first reply answers the client. A call that got
+    // none leaves the request to its sibling, which is still running.
+    BackendCall *sibling = call->sibling;
+    if (sibling) {
+        sibling->sibling = NULL;
+        call->sibling = NULL;
+        if (communication_status != 0) {
+            backend_call_free(call);
+            return;
+        }
+        sibling->orphaned = 1;
+        if (call->is_hedge) {
+            hedges_won++;
+            LOG(INFO, "Hedged call to backend %s answered first (id: %d).", backend->name, id);
+        }
+    }
+    if (call->orphaned) {
+        backend_call_free(call);
+        return;
+    }
+    method_metrics_record(call->op_code, call->request_started_us, !succeeded);
+    deliver_response(call->client, call->batch, call->batch_slot, response_str);
+    backend_call_free(call);
+}
+
+int backend_call_start(ClientConn *client, ClientBatch *batch, int batch_slot, RegisteredBackend *backend, int id,
+                       int op_code, const double *params, long long request_started_us, long long request_deadline_ms,
+                       BackendCall *hedge_of, int is_failover, char *err_out, size_t err_out_size);
+
+// Sends a call that failed before the backend could have acted on it (no
+// connection, nothing sent, or a UDP datagram refused) to another backend
+// for the method, within the retry budget. Returns 1 if the retry took over
+// the request, 0 if the call should answer with its own error.
+int backend_call_failover(BackendCall *call, const char *what, int err) {
+    int never_reached = strcmp(what, "connect to") == 0 || strcmp(what, "send data to") == 0 ||
+                        (err == ECONNREFUSED && strcmp(call->backend->type, "UDP") == 0);
+    // A running hedge sibling may still answer; a failover is not retried again
+    if (retry_budget_pct <= 0 || !never_reached || call->timed_out || call->sibling || call->orphaned || call->is_failover) return 0;
+    if (retry_tokens < 1.0) {
+        retries_over_budget++;
+        LOG(WARNING, "Not retrying call (id: %d) on another backend: retry budget used up.", call->request_id);
+        return 0;
+    }
+    char alternate_name[100];
+    RegisteredBackend *alternate = select_backend(backend_methods[call->op_code], call->backend, alternate_name, sizeof(alternate_name));
+    if (!alternate) return 0;
+
+    LOG(WARNING, "Retrying call (id: %d) on backend %s after backend %s failed.", call->request_id, alternate->name, call->backend->name);
+    char start_error[BUFFER_SIZE];
+    if (backend_call_start(call->client, call->batch, call->batch_slot, alternate, call->request_id, call->op_code,
+                           call->params, call->request_started_us, call->request_deadline_ms, NULL, 1,
+                           start_error, sizeof(start_error)) != 0) {
+        LOG(WARNING, "Could not retry call (id: %d): %s", call->request_id, start_error);
+        return 0;
+    }
+    retry_tokens -= 1.0;
+    retries_sent++;
+    return 1;
+}
+
+void backend_call_fail(BackendCall *call, const char *what, int err) {
+    PooledConn *conn = call->conn;
+
+    // A keep-alive connection the backend already dropped fails on first
+    // use; retry once on a fresh connection (calculator ops are idempotent).
+    if (conn && conn->requests_served > 0 && !call->stale_retry_used) {
+        LOG(WARNING, "Reused TCP connection to backend %s failed (%s); retrying on a new connection.", call->backend->name, strerror(err));
+        call->stale_retry_used = 1;
+        pool_close_conn(conn);
+        pool_dispatch(call);
+        return;
+    }
+
+    if (strcmp(what, "connect to") == 0 && !call->timed_out) metrics_for(call->backend)->connect_failures++;
+    const char *label = strcmp(call->backend->type, "UDP") == 0 ? "UDP backend" : "backend";
+    LOG(ERROR, "%s %s %s (%s:%d) failed: %s", call->backend->type, what, call->backend->name,
+        call->backend->host, call->backend->port, strerror(err));
+    snprintf(call->response, sizeof(call->response), "Gateway error: Failed to %s %s %s. Details: %s", what, label, call->backend->name, strerror(err));
+    // The failure is still recorded against this backend
+    if (backend_call_failover(call, what, err)) call->orphaned = 1;
+    backend_call_complete(call, -1);
+}
+
+// Points the call's timer at its next wake-up
+void backend_call_rearm(BackendCall *call) {
+    timer_disarm(call);
+    call->timer_ms = call->deadline_ms;
+    if (call->hedge_at_ms != 0 && call->hedge_at_ms < call->timer_ms) call->timer_ms = call->hedge_at_ms;
+    if (call->retransmit_at_ms != 0 && call->retransmit_at_ms < call->timer_ms) call->timer_ms = call->retransmit_at_ms;
+    timer_arm(call); // Cannot fail: the slot was just freed
+}
+
+long long backend_udp_rto_ms(const RegisteredBackend *backend) {
+    return backend->stats.udp_rto_ms ? backend->stats.udp_rto_ms : UDP_RTO_INITIAL_MS;
+}
+
+// Folds an answered UDP call's round trip into its backend's estimate and
+// recomputes the RTO from it as in RFC 6298, with a 1 ms clock granularity.
+// This also ends any backoff.
+void udp_rtt_record(BackendCall *call) {
+    // Karn's algorithm: the reply to a retransmitted request may answer any copy
+    if (call->retransmits > 0 || call->sent_us == 0) return;
+    double rtt_us = (double)(monotonic_us() - call->sent_us);
+    if (rtt_us < 1) rtt_us = 1;
+    BackendStats *stats = &call->backend->stats;
+    if (stats->udp_srtt_us == 0) {
+        stats->udp_srtt_us = rtt_us;
+        stats->udp_rttvar_us = rtt_us / 2;
+    } else {
+        double error_us = stats->udp_srtt_us > rtt_us ? stats->udp_srtt_us - rtt_us : rtt_us - stats->udp_srtt_us;
+        stats->udp_rttvar_us = 0.75 * stats->udp_rttvar_us + 0.25 * error_us;
+        stats->udp_srtt_us = 0.875 * stats->udp_srtt_us + 0.125 * rtt_us;
+    }
+    double variation_us = 4 * stats->udp_rttvar_us;
+    if (variation_us < 1000) variation_us = 1000;
+    long long rto_ms = (long long)((stats->udp_srtt_us + variation_us + 999) / 1000);
+    if (rto_ms < UDP_RTO_MIN_MS) rto_ms = UDP_RTO_MIN_MS;
+    if (rto_ms > UDP_RTO_MAX_MS) rto_ms = UDP_RTO_MAX_MS;
+    stats->udp_rto_ms = rto_ms;
+}
+
+// Plans the next retransmission of a UDP call, if it fits before the deadline
+void udp_arm_retransmit(BackendCall *call) {
+    long long now = monotonic_ms();
+    if (call->rto_ms == 0) call->rto_ms = backend_udp_rto_ms(call->backend);
+    call->retransmit_at_ms = now + call->rto_ms < call->deadline_ms ? now + call->rto_ms : 0;
+    backend_call_rearm(call);
+}
+
+// Resends a UDP request that had no reply within its RTO (calculator ops
+// are idempotent) and backs off: the RTO doubles for this call, and for the
+// backend until a round trip is measured again. Calls that time out together
+// back the backend off once, not once each. A call armed before a shorter
+// RTO was measured backs off from that one instead.
+void backend_call_retransmit(BackendCall *call) {
+    int fd = call->channel ? call->channel->src.fd : call->src.fd;
+    BackendStats *stats = &call->backend->stats;
+    LOG(INFO, "No reply from UDP backend %s within %lld ms (id: %d); retransmitting.", call->backend->name, call->rto_ms, call->request_id);
+    call->retransmits++;
+    metrics_for(call->backend)->udp_retransmits++;
+    long long backed_off = call->rto_ms * 2 > UDP_RTO_MAX_MS ? UDP_RTO_MAX_MS : call->rto_ms * 2;
+    if (call->rto_ms >= backend_udp_rto_ms(call->backend)) stats->udp_rto_ms = backed_off;
+    long long from_current = backend_udp_rto_ms(call->backend) << (call->retransmits < 16 ? call->retransmits : 16);
+    call->rto_ms = backed_off < from_current ? backed_off : from_current;
+    udp_arm_retransmit(call);
+    if (fd < 0) return; // The channel was closed; wait for the deadline
+    if (send(fd, call->request, call->request_len, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        backend_call_fail(call, "send data to", errno);
+    }
+}
+
+UdpChannel *udp_channel_for(RegisteredBackend *backend) {
+    int slot = backend - registered_backends;
+    if (udp_channels[slot]) return udp_channels[slot];
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(backend->port);
+    if (inet_pton(AF_INET, backend->host, &server_addr.sin_addr) <= 0) {
+        LOG(ERROR, "Invalid backend address %s for %s", backend->host, backend->name);
+        errno = EINVAL;
+        return NULL;
+    }
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0 || set_nonblocking(sock_fd) < 0 ||
+        connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        int err = errno;
+        if (sock_fd >= 0) close(sock_fd);
+        errno = err;
+        return NULL;
+    }
+    UdpChannel *channel = calloc(1, sizeof(UdpChannel));
+    if (!channel) {
+        close(sock_fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    channel->src.type = SRC_UDP_CHANNEL;
+    channel->src.fd = sock_fd;
+    channel->backend = backend;
+    if (watch_fd(&channel->src, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+        int err = errno;
+        close(sock_fd);
+        free(channel);
+        errno = err;
+        return NULL;
+    }
+    udp_channels[slot] = channel;
+    LOG(INFO, "Opened shared UDP socket to backend %s (%s:%d).", backend->name, backend->host, backend->port);
+    return channel;
+}
+
+// Frame ids are handed out in sequence, so the calls on a channel at once
+// mostly fall into buckets of their own
+BackendCall **udp_channel_bucket(UdpChannel *channel, uint32_t frame_id) {
+    return &channel->by_id[frame_id & (UDP_CHANNEL_ID_BUCKETS - 1)];
+}
+
+BackendCall *udp_channel_find(UdpChannel *channel, uint32_t frame_id) {
+    BackendCall *call = *udp_channel_bucket(channel, frame_id);
+    while (call && call->frame_id != frame_id) call = call->id_next;
+    return call;
+}
+
+void udp_channel_detach(UdpChannel *channel, BackendCall *call) {
+    if (!call->framed) channel->unframed_count--;
+    inflight_remove(&channel->inflight_head, &channel->inflight_tail, call);
+    BackendCall **link = udp_channel_bucket(channel, call->frame_id);
+    while (*link != call) link = &(*link)->id_next;
+    *link = call->id_next;
+    call->id_next = NULL;
+    call->channel = NULL;
+    channel->inflight_count--;
+}
+
+// Closes a backend's channel, e.g. after it moved. Calls still in flight on
+// it are not resent and run into their deadlines.
+void udp_channel_close(RegisteredBackend *backend) {
+    int slot = backend - registered_backends;
+    UdpChannel *channel = udp_channels[slot];
+    if (!channel) return;
+    while (channel->inflight_head) udp_channel_detach(channel, channel->inflight_head);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel->src.fd, NULL);
+    close(channel->src.fd);
+    channel->src.fd = -1;
+    release_later(&channel->src);
+    udp_channels[slot] = NULL;
+}
+
+void udp_channel_start(UdpChannel *channel, BackendCall *call) {
+    call->channel = channel;
+    inflight_append(&channel->inflight_head, &channel->inflight_tail, call);
+    BackendCall **bucket = udp_channel_bucket(channel, call->frame_id);
+    call->id_next = *bucket;
+    *bucket = call;
+    channel->inflight_count++;
+    channel->unframed_count++;
+    call->framed = 0;
+    call->state = CALL_RECEIVING;
+    call->request_sent = call->request_len;
+}
+
+// Queues a bin1 call on its backend's shared channel, which
+// udp_channel_flush sends, or in the backend's wait queue while the channel
+// is full
+void udp_channel_send(BackendCall *call) {
+    UdpChannel *channel = udp_channel_for(call->backend);
+    if (!channel) {
+        backend_call_fail(call, "create socket for", errno);
+        return;
+    }
+    ConnPool *pool = pool_for(call->backend);
+    if (channel->inflight_count < UDP_CHANNEL_MAX_IN_FLIGHT && pool->waiting_count == 0) {
+        codel_queue_empty(&pool->codel);
+        udp_channel_start(channel, call);
+        return;
+    }
+    pool_enqueue(pool, call, "UDP channel queue full");
+}
+
+// Moves waiting calls onto the channel while it has room
+void udp_channel_fill(UdpChannel *channel) {
+    ConnPool *pool = pool_for(channel->backend);
+    BackendCall *waiter;
+    while (channel->inflight_count < UDP_CHANNEL_MAX_IN_FLIGHT && (waiter = pool_next_waiter(pool)) != NULL) {
+        udp_channel_start(channel, waiter);
+    }
+}
+
+// Sends the channel's queued calls, up to the backend's batch size to a
+// datagram. Each call's round trip and retransmission timer start here;
+// a retransmission resends the call on its own.
+void udp_channel_flush(UdpChannel *channel) {
+    int max = channel->backend->batch_max > 0 ? channel->backend->batch_max : 1;
+    int remaining = channel->unframed_count;
+    BackendCall *call = unframed_calls(channel->inflight_tail, remaining);
+    channel->unframed_count = 0;
+    // Failing a call can start its failover, queued on a channel as a new
+    // unframed call, or close this channel
+    while (remaining > 0 && channel->src.fd >= 0) {
+        BackendCall *calls[CALC_BATCH_MAX];
+        unsigned char frame[CALC_MAX_REQUEST_SIZE];
+        int count = 0;
+        for (; count < remaining && count < max; call = call->mux_next) calls[count++] = call;
+        remaining -= count;
+        size_t size = encode_calls(calls, count, frame);
+        long long now_us = monotonic_us();
+        for (int i = 0; i < count; ++i) {
+            calls[i]->sent_us = now_us;
+            udp_arm_retransmit(calls[i]);
+        }
+        // A datagram the socket cannot take now counts as lost and is resent
+        if (send(channel->src.fd, frame, size, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+            int err = errno;
+            for (int i = 0; i < count; ++i) {
+                udp_channel_detach(channel, calls[i]);
+                backend_call_fail(calls[i], "send data to", err);
+            }
+            continue;
+        }
+        LOG(INFO, "UDP data sent to backend %s: %d call(s) in a %zu-byte datagram.", channel->backend->name, count, size);
+    }
+}
+
+// Sends what the shared channels queued, after topping them up from their
+// backends' wait queues; called before the loop waits
+void flush_udp_channels() {
+    int flushed;
+    do {
+        flushed = 0;
+        for (int i = 0; i < num_registered_backends; ++i) {
+            if (!udp_channels[i]) continue;
+            if (backend_pools[i].waiting_count > 0) udp_channel_fill(udp_channels[i]);
+            if (udp_channels[i]->unframed_count > 0) {
+                udp_channel_flush(udp_channels[i]);
+                flushed = 1;
+            }
+        }
+    } while (flushed);
+}
+
+void udp_channel_on_event(UdpChannel *channel) {
+    RegisteredBackend *backend = channel->backend;
+    // Bounded so one busy backend cannot hold up the rest of the loop
+    for (int i = 0; i < MAX_EPOLL_EVENTS; ++i) {
+        unsigned char datagram[CALC_MAX_REPLY_SIZE];
+        ssize_t n = recv(channel->src.fd, datagram, sizeof(datagram), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // An ICMP error, e.g. the port is closed: it concerns the backend, not one call
+            int err = errno;
+            LOG(WARNING, "Shared UDP socket to backend %s failed (%s) with %d calls in flight.", backend->name, strerror(err), channel->inflight_count);
+            BackendCall *calls = channel->inflight_head;
+            for (BackendCall *call = calls; call; call = call->mux_next) call->channel = NULL;
+            channel->inflight_head = channel->inflight_tail = NULL;
+            channel->inflight_count = 0;
+            channel->unframed_count = 0;
+            memset(channel->by_id, 0, sizeof(channel->by_id));
+            while (calls) {
+                BackendCall *call = calls;
+                calls = call->mux_next;
+                call->mux_prev = call->mux_next = NULL;
+                backend_call_fail(call, "receive data from", err);
+            }
+            return;
+        }
+        if (calc_reply_frame_size(datagram, n) != n) {
+            LOG(WARNING, "Dropping a %zd-byte datagram from backend %s: not a %s reply.", n, backend->name, CALC_PROTO_NAME);
+            continue;
+        }
+        size_t count = calc_reply_count(datagram);
+        for (size_t k = 0; k < count; ++k) {
+            uint32_t frame_id;
+            int status;
+            double result;
+            calc_decode_reply_entry(datagram, k, &frame_id, &status, &result);
+            BackendCall *call = udp_channel_find(channel, frame_id);
+            if (!call) {
+                // A duplicate from a retransmission, or its call is already over
+                LOG(DEBUG, "Dropping reply to frame %u from backend %s: no call waiting for it.", frame_id, backend->name);
+                continue;
+            }
+            udp_channel_detach(channel, call);
+            udp_rtt_record(call);
+            take_reply(call, datagram, k);
+            LOG(INFO, "UDP received from backend %s: %zd-byte %s reply (frame %u)", backend->name, n, CALC_PROTO_NAME, frame_id);
+            backend_call_complete(call, 0);
+        }
+    }
+}
+
+// Drives a backend call as far as its socket allows without blocking
+void backend_call_on_event(BackendCall *call, uint32_t events) {
+    int fd = call_fd(call);
+
+    if (call->state == CALL_SENDING) {
+        while (call->request_sent < call->request_len) {
+            ssize_t n = send(fd, call->request + call->request_sent, call->request_len - call->request_sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch_fd(call_source(call), EPOLL_CTL_MOD, EPOLLOUT);
+                    return;
+                }
+                backend_call_fail(call, "send data to", errno);
+                return;
+            }
+            call->request_sent += n;
+        }
+        LOG(INFO, "%s data sent to backend %s.", call->backend->type, call->backend->name);
+        call->state = CALL_RECEIVING;
+        watch_fd(call_source(call), EPOLL_CTL_MOD, EPOLLIN);
+        if (call->src.fd >= 0) {
+            // UDP: resent until answered
+            call->sent_us = monotonic_us();
+            udp_arm_retransmit(call);
+        }
+        return;
+    }
+    if (call->state != CALL_RECEIVING || !(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+
+    // The backend answers with a single message per request. A text answer
+    // comes in one read; a binary one is read until the frame is complete.
+    ssize_t n = recv(fd, call->response + call->response_len, sizeof(call->response) - 1 - call->response_len, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        backend_call_fail(call, "receive data from", errno);
+        return;
+    }
+    if (n == 0 && call->conn) {
+        backend_call_fail(call, "receive data from", ECONNRESET);
+        return;
+    }
+    call->response_len += n;
+    if (call->binary && call->conn && call->response_len < CALC_REPLY_SIZE) return;
+    call->response[call->response_len] = '\0';
+    if (call->binary) {
+        LOG(INFO, "%s received from backend %s: %zu-byte %s reply", call->backend->type, call->backend->name, call->response_len, CALC_PROTO_NAME);
+    } else {
+        LOG(INFO, "%s received from backend %s: %s", call->backend->type, call->backend->name, call->response);
+    }
+    if (call->src.fd >= 0) udp_rtt_record(call);
+    backend_call_complete(call, 0);
+}
+
+// Sends a copy of a call that has not been answered in time to another
+// backend; whichever answers first wins. Hedges are limited by the budget.
+void backend_call_hedge(BackendCall *call) {
+    if (call->sibling || call->orphaned) return;
+    if (hedge_tokens < 1.0) {
+        hedges_over_budget++;
+        return;
+    }
+    char alternate_name[100];
+    RegisteredBackend *alternate = select_backend(backend_methods[call->op_code], call->backend, alternate_name, sizeof(alternate_name));
+    if (!alternate) return;
+
+    LOG(INFO, "No reply from backend %s after %lld ms (id: %d); hedging to backend %s.",
+        call->backend->name, monotonic_ms() - call->started_us / 1000, call->request_id, alternate->name);
+    char start_error[BUFFER_SIZE];
+    if (backend_call_start(call->client, call->batch, call->batch_slot, alternate, call->request_id, call->op_code,
+                           call->params, call->request_started_us, call->request_deadline_ms, call, 0,
+                           start_error, sizeof(start_error)) != 0) {
+        LOG(WARNING, "Could not hedge call (id: %d): %s", call->request_id, start_error);
+        return;
+    }
+    hedge_tokens -= 1.0;
+    hedges_sent++;
+}
+
+void backend_call_timeout(BackendCall *call) {
+    long long now = monotonic_ms();
+    if (call->hedge_at_ms != 0 && now >= call->hedge_at_ms) {
+        // The hedge point, not the deadline: wait on for the deadline
+        call->hedge_at_ms = 0;
+        backend_call_rearm(call);
+        backend_call_hedge(call);
+        return;
+    }
+    if (call->retransmit_at_ms != 0 && now >= call->retransmit_at_ms) {
+        backend_call_retransmit(call);
+        return;
+    }
+    const char *label = strcmp(call->backend->type, "UDP") == 0 ? "UDP backend" : "backend";
+    call->stale_retry_used = 1; // Out of time: no retry
+    call->timed_out = 1;
+    if (call->deadline_from_client) {
+        deadlines_exceeded++;
+        LOG(WARNING, "Request (id: %d) ran out of its timeout_ms waiting on backend %s; abandoning it.", call->request_id, call->backend->name);
+        snprintf(call->response, sizeof(call->response), "Gateway error: Request timeout_ms exceeded.");
+        backend_call_complete(call, -1);
+        return;
+    }
+    metrics_for(call->backend)->timeouts++;
+    if (call->state == CALL_RECEIVING) {
+        LOG(ERROR, "%s recv from backend %s timed out.", call->backend->type, call->backend->name);
+        snprintf(call->response, sizeof(call->response), "Gateway error: Timeout receiving data from %s %s.", label, call->backend->name);
+        backend_call_complete(call, -1);
+    } else {
+        // A queued UDP call was waiting for room on its backend's shared socket
+        int waited_for_conn = call->state == CALL_QUEUED && strcmp(call->backend->type, "UDP") != 0;
+        backend_call_fail(call, waited_for_conn ? "connect to" : "send data to", ETIMEDOUT);
+    }
+}
+
+void expire_backend_calls() {
+    long long now = monotonic_ms();
+    while (timer_heap_len > 0 && timer_heap[0]->timer_ms <= now) {
+        backend_call_timeout(timer_heap[0]);
+    }
+}
+
+// Starts a call: TCP calls go through the backend's connection pool, UDP
+// calls get their own non-blocking socket. On failure returns -1 with a
+// client-facing message in err_out.
+// The call times out after backend_timeout_ms, or at request_deadline_ms
+// (monotonic, 0 for none) if that comes first. A non-NULL hedge_of makes
+// this a hedge of that call.
+int backend_call_start(ClientConn *client, ClientBatch *batch, int batch_slot, RegisteredBackend *backend, int id,
+                       int op_code, const double *params, long long request_started_us, long long request_deadline_ms,
+                       BackendCall *hedge_of, int is_failover, char *err_out, size_t err_out_size) {
+    char payload[256];
+    int is_udp = strcmp(backend->type, "UDP") == 0;
+    if (request_deadline_ms != 0 && request_deadline_ms <= monotonic_ms()) {
+        deadlines_exceeded++;
+        LOG(WARNING, "Request (id: %d) ran out of its timeout_ms before reaching backend %s.", id, backend->name);
+        snprintf(err_out, err_out_size, "Gateway error: Request timeout_ms exceeded.");
+        return -1;
+    }
+    snprintf(payload, sizeof(payload), "%d %lf %lf", op_code, params[0], params[1]);
+    LOG(INFO, "Attempting %s communication with %s at %s:%d. Payload: \"%s\"%s", backend->type, backend->name, backend->host, backend->port,
+        payload, backend->proto_bin1 ? " as " CALC_PROTO_NAME : "");
+
+    BackendCall *call = calloc(1, sizeof(BackendCall));
+    if (!call) {
+        snprintf(err_out, err_out_size, "Gateway error: Out of memory.");
+        return -1;
+    }
+    call->src.type = SRC_BACKEND;
+    call->src.fd = -1;
+    call->backend = backend;
+    call->client = client;
+    call->batch = batch;
+    call->batch_slot = batch_slot;
+    call->request_id = id;
+    call->op_code = op_code;
+    call->params[0] = params[0];
+    call->params[1] = params[1];
+    call->timer_slot = -1;
+    call->binary = backend->proto_bin1;
+    if (call->binary) {
+        call->frame_id = next_frame_id++;
+        calc_encode_request((unsigned char *)call->request, call->frame_id, op_code, params[0], params[1]);
+        call->request_len = CALC_REQUEST_SIZE;
+    } else {
+        snprintf(call->request, sizeof(call->request), "%s", payload);
+        call->request_len = strlen(call->request);
+    }
+    call->request_started_us = request_started_us;
+    call->started_us = monotonic_us();
+    call->deadline_ms = call->started_us / 1000 + backend_timeout_ms(backend);
+    call->request_deadline_ms = request_deadline_ms;
+    if (request_deadline_ms != 0 && request_deadline_ms < call->deadline_ms) {
+        call->deadline_ms = request_deadline_ms;
+        call->deadline_from_client = 1;
+    }
+    call->timer_ms = call->deadline_ms;
+    if (!hedge_of && hedge_percentile > 0) {
+        if (!is_failover) hedge_tokens += hedge_budget_pct / 100.0;
+        if (hedge_tokens > HEDGE_MAX_TOKENS) hedge_tokens = HEDGE_MAX_TOKENS;
+        long long delay = backend->stats.hedge_delay_ms;
+        if (delay > 0 && call->started_us / 1000 + delay < call->deadline_ms) {
+            call->hedge_at_ms = call->started_us / 1000 + delay;
+            call->timer_ms = call->hedge_at_ms;
+        }
+    }
+    if (timer_arm(call) < 0) {
+        free(call);
+        snprintf(err_out, err_out_size, "Gateway error: Failed to track call to backend %s.", backend->name);
+        return -1;
+    }
+    client->pending_calls++;
+    backend->stats.in_flight++;
+    call->breaker_trial = health_call_started(&backend->health);
+    call->is_failover = is_failover;
+    if (hedge_of) {
+        // Linked before anything can complete either call
+        call->is_hedge = 1;
+        call->sibling = hedge_of;
+        hedge_of->sibling = call;
+    }
+
+    if (!is_udp) {
+        pool_dispatch(call);
+        return 0;
+    }
+    if (call->binary) {
+        udp_channel_send(call);
+        return 0;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(backend->port);
+    if (inet_pton(AF_INET, backend->host, &server_addr.sin_addr) <= 0) {
+        LOG(ERROR, "Invalid backend address %s for %s", backend->host, backend->name);
+        snprintf(call->response, sizeof(call->response), "Gateway error: Invalid backend address %s for %s.", backend->host, backend->name);
+        backend_call_complete(call, -1);
+        return 0;
+    }
+
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0 || set_nonblocking(sock_fd) < 0) {
+        int err = errno;
+        if (sock_fd >= 0) close(sock_fd);
+        backend_call_fail(call, "create socket for", err);
+        return 0;
+    }
+    call->src.fd = sock_fd;
+    call->state = CALL_SENDING;
+    // connect() only fixes the peer so stray datagrams are filtered out
+    if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        watch_fd(&call->src, EPOLL_CTL_ADD, EPOLLOUT) < 0) {
+        backend_call_fail(call, "connect to", errno);
+        return 0;
+    }
+    return 0;
+}
+
+// Evaluates a request in-process with the same code the bin1 backends run,
+// on the exact operands, so answers do not depend on where a request ran.
+// Returns 0 with the result, or 1 with the error message a backend sends.
+int evaluate_locally(int op_code, double a, double b, double *result_out, char *error_msg_out, size_t error_msg_out_size) {
+    CalcStatus status = calc_evaluate(op_code, a, b, result_out);
+    if (status == CALC_OK) return 0;
+    snprintf(error_msg_out, error_msg_out_size, "%s", calc_error_message(status));
+    return 1;
+}
+
+// Answers a request without a backend, in the response format of a backend call
+void respond_locally(ClientConn *conn, ClientBatch *batch, int slot, int id, int op_code, const double *params,
+                     long long started_us, const char *reason) {
+    char response_str[BUFFER_SIZE];
+    double result;
+    char error_msg[256];
+
+    LOG(INFO, "Evaluating request (id: %d) in-process: %s.", id, reason);
+    int status = evaluate_locally(op_code, params[0], params[1], &result, error_msg, sizeof(error_msg));
+    if (status == 0) {
+        result_cache_store(&result_cache, op_code, params[0], params[1], result, NULL);
+        status = build_result_response(response_str, id, result, "gateway (in-process)");
+    } else {
+        result_cache_store(&result_cache, op_code, params[0], params[1], 0.0, error_msg);
+        build_json_rpc_response(response_str, id, 0.0, error_msg);
+    }
+    method_metrics_record(op_code, started_us, status != 0);
+    deliver_response(conn, batch, slot, response_str);
+}
+
+// Logs result_cache counters, when it has been used since the last time
+void log_result_cache_stats() {
+    static unsigned long last_lookups = 0;
+    unsigned long lookups = result_cache.hits + result_cache.misses;
+    if (lookups == last_lookups) return;
+    last_lookups = lookups;
+    LOG(INFO, "Result cache: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions.",
+        result_cache.hits, result_cache.misses, 100.0 * result_cache.hits / lookups, result_cache.evictions);
+}
+
+// Answers a request from result_cache if it holds the answer. Returns 1 if
+// the request was answered.
+int respond_from_cache(ClientConn *conn, ClientBatch *batch, int slot, int id, int op_code, const double *params,
+                       long long started_us) {
+    char response_str[BUFFER_SIZE];
+    double result;
+    char error_msg[RESULT_CACHE_MAX_ERROR];
+
+    int status = result_cache_lookup(&result_cache, op_code, params[0], params[1], &result, error_msg, sizeof(error_msg));
+    if (status < 0) return 0;
+    if (status == 0) {
+        status = build_result_response(response_str, id, result, "gateway (cache)");
+    } else {
+        build_json_rpc_response(response_str, id, 0.0, error_msg);
+    }
+    method_metrics_record(op_code, started_us, status != 0);
+    deliver_response(conn, batch, slot, response_str);
+    return 1;
+}
+
+// Whether the slow-backend local evaluation mode should bypass a backend.
+// One call per LOCAL_EVAL_PROBE_MS still goes through, so that the latency
+// window keeps moving and the backend is used again once it recovers.
+int backend_too_slow(RegisteredBackend *backend) {
+    BackendStats *stats = &backend->stats;
+    if (stats->p99_latency_ms <= local_eval_p99_ms) return 0;
+    long long now = monotonic_ms();
+    if (now - stats->last_probe_ms >= LOCAL_EVAL_PROBE_MS) {
+        stats->last_probe_ms = now;
+        return 0;
+    }
+    return 1;
+}
+
+// Reads one request object and either answers it directly or hands it to a
+// backend call that will answer once the backend replies. Batch elements
+// answer into their slot of the batch instead of directly to the client.
+void handle_single_request(ClientConn *conn, ClientBatch *batch, int slot, const char *js, const jsontok_token *tokens, int count, int obj) {
+    char response_str[BUFFER_SIZE];
+    char method[256];
+    double params[2];
+    int id = -1;
+    long long timeout_ms;
+    long long started_us = monotonic_us();
+    const char *request_text = js + tokens[obj].start;
+    int request_len = tokens[obj].end - tokens[obj].start;
+
+    LOG(DEBUG, "Received JSON-RPC request: %.*s", request_len, request_text);
+
+    if (parse_json_rpc_request(js, tokens, count, obj, method, params, &id, &timeout_ms) != 0) {
+        LOG(ERROR, "Failed to parse JSON-RPC request (id: %d). Body: %.*s", id, request_len, request_text);
+        build_json_rpc_response(response_str, id, 0.0, "Parse error. Invalid JSON-RPC request.");
+        method_metrics_record(0, started_us, 1);
+        deliver_response(conn, batch, slot, response_str);
+        return;
+    }
+
+    // Built-in methods are pure: repeated calls are answered from the cache,
+    // and they can be evaluated in-process, depending on --local-eval
+    int builtin_op_code = method_slot(method);
+    if (builtin_op_code != 0 && respond_from_cache(conn, batch, slot, id, builtin_op_code, params, started_us)) return;
+    int local_op_code = local_eval_mode != LOCAL_EVAL_OFF ? builtin_op_code : 0;
+    if (local_op_code != 0 && local_eval_mode == LOCAL_EVAL_ALWAYS) {
+        respond_locally(conn, batch, slot, id, local_op_code, params, started_us, "local evaluation is always on");
+        return;
+    }
+
+    char chosen_backend_name[100] = "N/A";
+    RegisteredBackend* selected_backend = select_backend(method, NULL, chosen_backend_name, sizeof(chosen_backend_name));
+    if (selected_backend == NULL && local_op_code != 0) {
+        respond_locally(conn, batch, slot, id, local_op_code, params, started_us, "no backend available");
+        return;
+    }
+    if (selected_backend != NULL && local_op_code != 0 && local_eval_mode == LOCAL_EVAL_SLOW_BACKEND &&
+        backend_too_slow(selected_backend)) {
+        char reason[256];
+        snprintf(reason, sizeof(reason), "backend %s p99 latency %lld ms is over %lld ms",
+                 selected_backend->name, selected_backend->stats.p99_latency_ms, local_eval_p99_ms);
+        respond_locally(conn, batch, slot, id, local_op_code, params, started_us, reason);
+        return;
+    }
+    if (selected_backend == NULL) {
+        LOG(ERROR, "Method '%s' (id: %d) not supported by any available backend or no backends available.", method, id);
+        build_json_rpc_response(response_str, id, 0.0, "Method not supported by any available backend or no backends available.");
+        method_metrics_record(builtin_op_code, started_us, 1);
+        deliver_response(conn, batch, slot, response_str);
+        return;
+    }
+
+    LOG(INFO, "Routing request for method '%s' (id: %d) to backend: %s (%s:%d)",
+        method, id, selected_backend->name, selected_backend->host, selected_backend->port);
+
+    int op_code = get_backend_op_code(method);
+    if (op_code == 0) {
+        LOG(CRITICAL, "Method '%s' (id: %d) mapped to op_code 0. This indicates an issue with the route index or get_backend_op_code logic.", method, id);
+        build_json_rpc_response(response_str, id, 0.0, "Internal server error: Method mapped to unknown operation code.");
+        method_metrics_record(builtin_op_code, started_us, 1);
+        deliver_response(conn, batch, slot, response_str);
+        return;
+    }
+    if (strcmp(selected_backend->type, "TCP") != 0 && strcmp(selected_backend->type, "UDP") != 0) {
+        LOG(ERROR, "Unknown backend type '%s' for backend %s (id: %d)", selected_backend->type, selected_backend->name, id);
+        build_json_rpc_response(response_str, id, 0.0, "Internal server error: Unknown backend type configured.");
+        method_metrics_record(builtin_op_code, started_us, 1);
+        deliver_response(conn, batch, slot, response_str);
+        return;
+    }
+
+    char start_error[BUFFER_SIZE];
+    long long request_deadline_ms = timeout_ms > 0 ? started_us / 1000 + timeout_ms : 0;
+    retry_tokens += retry_budget_pct / 100.0;
+    if (retry_tokens > RETRY_MAX_TOKENS) retry_tokens = RETRY_MAX_TOKENS;
+    if (backend_call_start(conn, batch, slot, selected_backend, id, op_code, params, started_us, request_deadline_ms, NULL, 0,
+                           start_error, sizeof(start_error)) != 0) {
+        build_json_rpc_response(response_str, id, 0.0, start_error);
+        method_metrics_record(builtin_op_code, started_us, 1);
+        deliver_response(conn, batch, slot, response_str);
+    }
+}
+
+// Handles one complete message: a single request object, or a batch array
+// whose elements are all dispatched at once and answered together.
+void handle_client_request(ClientConn *conn, const char *js, const jsontok_token *tokens, int count) {
+    char response_str[BUFFER_SIZE];
+
+    if (tokens[0].type == JSONTOK_OBJECT) {
+        handle_single_request(conn, NULL, 0, js, tokens, count, 0);
+        return;
+    }
+
+    int elements = tokens[0].size;
+    if (elements == 0 || elements > MAX_BATCH_SIZE) {
+        if (elements == 0) LOG(ERROR, "Rejecting empty JSON-RPC batch.");
+        else LOG(ERROR, "Rejecting JSON-RPC batch of %d elements (limit %d).", elements, MAX_BATCH_SIZE);
+        build_invalid_request_response(response_str, elements == 0 ? "Invalid Request. Empty batch." : "Invalid Request. Batch too large.");
+        client_conn_respond(conn, response_str);
+        return;
+    }
+
+    ClientBatch *batch = calloc(1, sizeof(ClientBatch));
+    char **responses = calloc(elements, sizeof(char *));
+    if (!batch || !responses) {
+        free(batch);
+        free(responses);
+        build_json_rpc_response(response_str, -1, 0.0, "Gateway error: Out of memory.");
+        client_conn_respond(conn, response_str);
+        return;
+    }
+    batch->client = conn;
+    batch->count = elements;
+    batch->responses = responses;
+    // Hold one extra reference so elements answered synchronously cannot
+    // complete the batch before every element has been dispatched
+    batch->remaining = elements + 1;
+
+    LOG(INFO, "Dispatching JSON-RPC batch of %d requests.", elements);
+
+    int element = 1;
+    for (int i = 0; i < elements; ++i) {
+        if (tokens[element].type != JSONTOK_OBJECT) {
+            build_invalid_request_response(response_str, "Invalid Request. Batch element is not an object.");
+            method_metrics_record(0, monotonic_us(), 1);
+            client_batch_fill(batch, i, response_str);
+        } else {
+            handle_single_request(conn, batch, i, js, tokens, count, element);
+        }
+        element = jsontok_skip(tokens, count, element);
+    }
+    batch->remaining--;
+    client_batch_send_if_complete(batch);
+}
+
+// Runs the connection's tokenizer over newly read bytes and answers every
+// message it completes. Parser state persists on the connection, so a
+// message split across reads continues where the last read stopped.
+void client_conn_process_input(ClientConn *conn) {
+    char response_str[BUFFER_SIZE];
+    size_t consumed = 0;
+    int too_large = 0;
+
+    while (!conn->closed && consumed < conn->in.len) {
+        const char *js = conn->in.data + consumed;
+        size_t avail = conn->in.len - consumed;
+
+        if (conn->discard_line) {
+            const char *newline = memchr(js, '\n', avail);
+            if (!newline) {
+                consumed = conn->in.len;
+                break;
+            }
+            consumed += newline - js + 1;
+            conn->discard_line = 0;
+            continue;
+        }
+
+        if (conn->parser.toknext == 0) {
+            // Start of a message: skip separators; only objects and arrays
+            // can be JSON-RPC, anything else is dropped up to the next newline
+            size_t skip = 0;
+            while (skip < avail && (js[skip] == ' ' || js[skip] == '\t' || js[skip] == '\r' || js[skip] == '\n')) skip++;
+            consumed += skip;
+            if (skip == avail) break;
+            if (js[skip] != '{' && js[skip] != '[') {
+                LOG(ERROR, "Discarding JSON-RPC client data that is not a JSON object or array.");
+                build_json_rpc_response(response_str, -1, 0.0, "Parse error. Invalid JSON-RPC request.");
+                client_conn_respond(conn, response_str);
+                conn->discard_line = 1;
+                continue;
+            }
+            js += skip;
+            avail -= skip;
+        }
+
+        int count;
+        while ((count = jsontok_parse(&conn->parser, js, avail, conn->tokens, conn->token_cap)) == JSONTOK_ERROR_NOMEM) {
+            int new_cap = conn->token_cap ? conn->token_cap * 2 : INITIAL_MESSAGE_TOKENS;
+            jsontok_token *grown = new_cap <= MAX_MESSAGE_TOKENS ? realloc(conn->tokens, new_cap * sizeof(jsontok_token)) : NULL;
+            if (!grown) break;
+            conn->tokens = grown;
+            conn->token_cap = new_cap;
+        }
+        if (count == JSONTOK_ERROR_PART) break;
+        if (count == JSONTOK_ERROR_NOMEM) {
+            too_large = 1;
+            break;
+        }
+        if (count == JSONTOK_ERROR_INVAL) {
+            LOG(ERROR, "Malformed JSON from client at byte %zu of message. Skipping to next line.", conn->parser.pos);
+            build_json_rpc_response(response_str, -1, 0.0, "Parse error. Invalid JSON-RPC request.");
+            client_conn_respond(conn, response_str);
+            consumed += conn->parser.pos;
+            jsontok_init(&conn->parser);
+            conn->discard_line = 1;
+            continue;
+        }
+
+        handle_client_request(conn, js, conn->tokens, count);
+        consumed += conn->parser.pos;
+        jsontok_init(&conn->parser);
+    }
+    if (conn->closed) return;
+    buffer_consume(&conn->in, consumed);
+
+    if (too_large || conn->in.len > MAX_CLIENT_MESSAGE_SIZE) {
+        LOG(ERROR, "JSON-RPC message exceeds %d bytes. Closing connection after pending responses.", MAX_CLIENT_MESSAGE_SIZE);
+        build_json_rpc_response(response_str, -1, 0.0, "Parse error. Request too large.");
+        conn->in.len = 0;
+        jsontok_init(&conn->parser);
+        conn->peer_done = 1;
+        client_conn_respond(conn, response_str);
+    }
+}
+
+void client_conn_on_event(ClientConn *conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        client_conn_close(conn);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        if (client_conn_flush(conn) < 0) {
+            client_conn_close(conn);
+            return;
+        }
+    }
+    if (events & (EPOLLIN | EPOLLHUP) && !conn->peer_done) {
+        while (1) {
+            if (buffer_reserve(&conn->in, 4096) < 0) {
+                LOG(ERROR, "Out of memory reading from JSON-RPC client. Closing connection.");
+                client_conn_close(conn);
+                return;
+            }
+            size_t room = conn->in.cap - conn->in.len;
+            ssize_t bytes_read = recv(conn->src.fd, conn->in.data + conn->in.len, room, 0);
+            if (bytes_read < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                LOG(ERROR, "Read from JSON-RPC client failed: %s", strerror(errno));
+                client_conn_close(conn);
+                return;
+            }
+            if (bytes_read == 0) {
+                LOG(INFO, "JSON-RPC client finished sending (read 0 bytes).");
+                conn->peer_done = 1;
+                break;
+            }
+            conn->in.len += bytes_read;
+            if ((size_t)bytes_read < room) break; // Socket drained for now
+        }
+        client_conn_process_input(conn);
+    } else if (events & EPOLLHUP) {
+        client_conn_close(conn);
+        return;
+    }
+    client_conn_update(conn);
+}
+
+void accept_clients(EventSource *listener) {
+    while (1) {
+        int client_fd = accept(listener->fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG(ERROR, "Accept for JSON-RPC failed: %s", strerror(errno));
+            return;
+        }
+        ClientConn *conn = calloc(1, sizeof(ClientConn));
+        if (!conn || set_nonblocking(client_fd) < 0) {
+            LOG(ERROR, "Failed to set up JSON-RPC client connection.");
+            free(conn);
+            close(client_fd);
+            continue;
+        }
+        conn->src.type = SRC_CLIENT;
+        conn->src.fd = client_fd;
+        jsontok_init(&conn->parser);
+        conn->watched_events = EPOLLIN;
+        if (watch_fd(&conn->src, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+            LOG(ERROR, "Failed to register JSON-RPC client with epoll.");
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        LOG(INFO, "JSON-RPC Connection accepted from a client.");
+    }
+}
+
+// Appends printf-style text to a buffer. Returns -1 if out of memory.
+int buffer_appendf(ByteBuffer *buf, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (needed < 0 || buffer_reserve(buf, (size_t)needed + 1) < 0) return -1;
+    va_start(args, fmt);
+    vsnprintf(buf->data + buf->len, (size_t)needed + 1, fmt, args);
+    va_end(args);
+    buf->len += needed;
+    return 0;
+}
+
+// Copies a backend name into a Prometheus label value, escaping it
+void escape_label_value(const char *value, char *out, size_t out_size) {
+    size_t len = 0;
+    for (const char *p = value; *p && len + 3 < out_size; ++p) {
+        if (*p == '"' || *p == '\\') out[len++] = '\\';
+        if (*p == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+}
+
+// Writes one histogram as the samples of a Prometheus summary in seconds
+void append_latency_summary(ByteBuffer *out, const char *name, const char *label, const char *value, const Histogram *hist) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (int i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); ++i) {
+        uint64_t us = histogram_value_at_percentile(hist, quantiles[i] * 100.0);
+        buffer_appendf(out, "%s{%s=\"%s\",quantile=\"%g\"} %.6f\n", name, label, value, quantiles[i], us / 1e6);
+    }
+    buffer_appendf(out, "%s_sum{%s=\"%s\"} %.6f\n", name, label, value, hist->sum / 1e6);
+    buffer_appendf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long)hist->total_count);
+}
+
+void append_backend_counter(ByteBuffer *out, const char *name, const char *help, size_t offset) {
+    char label[2 * sizeof(registered_backends[0].name)];
+    buffer_appendf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < num_registered_backends; ++i) {
+        escape_label_value(registered_backends[i].name, label, sizeof(label));
+        buffer_appendf(out, "%s{backend=\"%s\"} %lu\n", name, label,
+                       *(const unsigned long *)((const char *)&backend_metrics[i] + offset));
+    }
+}
+
+// Renders every metric in the Prometheus text exposition format
+void render_metrics(ByteBuffer *out) {
+    char label[2 * sizeof(registered_backends[0].name)];
+
+    buffer_appendf(out, "# HELP gateway_backend_latency_seconds Time for a backend to answer a call.\n"
+                        "# TYPE gateway_backend_latency_seconds summary\n");
+    for (int i = 0; i < num_registered_backends; ++i) {
+        escape_label_value(registered_backends[i].name, label, sizeof(label));
+        append_latency_summary(out, "gateway_backend_latency_seconds", "backend", label, &backend_metrics[i].latency_us);
+    }
+    append_backend_counter(out, "gateway_backend_requests_total", "Calls made to a backend.",
+                           offsetof(BackendMetrics, requests));
+    append_backend_counter(out, "gateway_backend_errors_total", "Backend calls that did not produce a result.",
+                           offsetof(BackendMetrics, errors));
+    append_backend_counter(out, "gateway_backend_timeouts_total", "Backend calls that ran out of time.",
+                           offsetof(BackendMetrics, timeouts));
+    append_backend_counter(out, "gateway_backend_connect_failures_total", "Backend calls that could not connect.",
+                           offsetof(BackendMetrics, connect_failures));
+    append_backend_counter(out, "gateway_backend_circuit_opens_total", "Times a backend's circuit breaker opened.",
+                           offsetof(BackendMetrics, circuit_opens));
+    append_backend_counter(out, "gateway_backend_ejections_total", "Times a backend was ejected as a latency outlier.",
+                           offsetof(BackendMetrics, ejections));
+    append_backend_counter(out, "gateway_backend_shed_queue_full_total", "Calls turned away because the backend's wait queue was full.",
+                           offsetof(BackendMetrics, shed_queue_full));
+    append_backend_counter(out, "gateway_backend_shed_codel_total", "Calls dropped from the backend's wait queue by CoDel.",
+                           offsetof(BackendMetrics, shed_codel));
+    append_backend_counter(out, "gateway_backend_udp_retransmits_total", "UDP requests resent after no reply within the retransmission timeout.",
+                           offsetof(BackendMetrics, udp_retransmits));
+    append_backend_counter(out, "gateway_backend_batch_frames_total", "bin1 batch frames sent to the backend.",
+                           offsetof(BackendMetrics, batch_frames));
+    append_backend_counter(out, "gateway_backend_batched_calls_total", "Calls sent to the backend in bin1 batch frames.",
+                           offsetof(BackendMetrics, batched_calls));
+    buffer_appendf(out, "# HELP gateway_backend_queue_depth Calls waiting for a connection to the backend, or for room on its shared UDP socket.\n"
+                        "# TYPE gateway_backend_queue_depth gauge\n");
+    for (int i = 0; i < num_registered_backends; ++i) {
+        escape_label_value(registered_backends[i].name, label, sizeof(label));
+        buffer_appendf(out, "gateway_backend_queue_depth{backend=\"%s\"} %d\n", label, backend_pools[i].waiting_count);
+    }
+    buffer_appendf(out, "# HELP gateway_backend_in_flight Calls started and not yet finished.\n"
+                        "# TYPE gateway_backend_in_flight gauge\n");
+    for (int i = 0; i < num_registered_backends; ++i) {
+        escape_label_value(registered_backends[i].name, label, sizeof(label));
+        buffer_appendf(out, "gateway_backend_in_flight{backend=\"%s\"} %d\n", label, registered_backends[i].stats.in_flight);
+    }
+    buffer_appendf(out, "# HELP gateway_backend_circuit_state Circuit breaker state: 0 closed, 1 open, 2 half-open.\n"
+                        "# TYPE gateway_backend_circuit_state gauge\n");
+    for (int i = 0; i < num_registered_backends; ++i) {
+        escape_label_value(registered_backends[i].name, label, sizeof(label));
+        buffer_appendf(out, "gateway_backend_circuit_state{backend=\"%s\"} %d\n", label, (int)registered_backends[i].health.breaker);
+    }
+    buffer_appendf(out, "# HELP gateway_backend_ejected Whether a backend is ejected as a latency outlier.\n"
+                        "# TYPE gateway_backend_ejected gauge\n");
+    for (int i = 0; i < num_registered_backends; ++i) {
+        escape_label_value(registered_backends[i].name, label, sizeof(label));
+        buffer_appendf(out, "gateway_backend_ejected{backend=\"%s\"} %d\n", label, registered_backends[i].health.ejected);
+    }
+
+    buffer_appendf(out, "# HELP gateway_hedges_total Duplicate calls sent to a second backend after no timely reply.\n"
+                        "# TYPE gateway_hedges_total counter\ngateway_hedges_total %lu\n"
+                        "# HELP gateway_hedge_wins_total Hedges that answered before the original call.\n"
+                        "# TYPE gateway_hedge_wins_total counter\ngateway_hedge_wins_total %lu\n"
+                        "# HELP gateway_hedges_over_budget_total Hedges not sent because the budget was used up.\n"
+                        "# TYPE gateway_hedges_over_budget_total counter\ngateway_hedges_over_budget_total %lu\n",
+                   hedges_sent, hedges_won, hedges_over_budget);
+    buffer_appendf(out, "# HELP gateway_deadline_exceeded_total Requests abandoned because their timeout_ms ran out.\n"
+                        "# TYPE gateway_deadline_exceeded_total counter\ngateway_deadline_exceeded_total %lu\n",
+                   deadlines_exceeded);
+    buffer_appendf(out, "# HELP gateway_failover_retries_total Calls retried on another backend after a connection-level failure.\n"
+                        "# TYPE gateway_failover_retries_total counter\ngateway_failover_retries_total %lu\n"
+                        "# HELP gateway_failover_retries_over_budget_total Retries not sent because the budget was used up.\n"
+                        "# TYPE gateway_failover_retries_over_budget_total counter\ngateway_failover_retries_over_budget_total %lu\n",
+                   retries_sent, retries_over_budget);
+
+    buffer_appendf(out, "# HELP gateway_request_latency_seconds Time from reading a client request to its response.\n"
+                        "# TYPE gateway_request_latency_seconds summary\n");
+    for (int i = 0; i < NUM_METHOD_SLOTS; ++i) {
+        append_latency_summary(out, "gateway_request_latency_seconds", "method", i ? backend_methods[i] : "other",
+                               &method_metrics[i].latency_us);
+    }
+    buffer_appendf(out, "# HELP gateway_requests_total Client requests answered.\n# TYPE gateway_requests_total counter\n");
+    for (int i = 0; i < NUM_METHOD_SLOTS; ++i) {
+        buffer_appendf(out, "gateway_requests_total{method=\"%s\"} %lu\n", i ? backend_methods[i] : "other", method_metrics[i].requests);
+    }
+    buffer_appendf(out, "# HELP gateway_request_errors_total Client requests answered with an error.\n"
+                        "# TYPE gateway_request_errors_total counter\n");
+    for (int i = 0; i < NUM_METHOD_SLOTS; ++i) {
+        buffer_appendf(out, "gateway_request_errors_total{method=\"%s\"} %lu\n", i ? backend_methods[i] : "other", method_metrics[i].errors);
+    }
+
+    buffer_appendf(out, "# HELP gateway_result_cache_hits_total Requests answered from the result cache.\n"
+                        "# TYPE gateway_result_cache_hits_total counter\ngateway_result_cache_hits_total %lu\n"
+                        "# HELP gateway_result_cache_misses_total Result cache lookups that found nothing.\n"
+                        "# TYPE gateway_result_cache_misses_total counter\ngateway_result_cache_misses_total %lu\n"
+                        "# HELP gateway_result_cache_evictions_total Results dropped to make room for new ones.\n"
+                        "# TYPE gateway_result_cache_evictions_total counter\ngateway_result_cache_evictions_total %lu\n",
+                   result_cache.hits, result_cache.misses, result_cache.evictions);
+}
+
+void admin_conn_close(AdminConn *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->src.fd, NULL);
+    close(conn->src.fd);
+    conn->src.fd = -1;
+    release_later(&conn->src);
+}
+
+// Sends what is left of the response, closing the connection once it is out
+void admin_conn_flush(AdminConn *conn) {
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n = send(conn->src.fd, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch_fd(&conn->src, EPOLL_CTL_MOD, EPOLLOUT);
+                return;
+            }
+            break;
+        }
+        conn->out_sent += n;
+    }
+    admin_conn_close(conn);
+}
+
+// Answers the request head in conn->request: GET /metrics, or 404
+void admin_conn_respond(AdminConn *conn) {
+    ByteBuffer body = {0};
+    const char *status = "200 OK";
+    const char *content_type = "text/plain; version=0.0.4; charset=utf-8";
+
+    if (strncmp(conn->request, "GET /metrics ", 13) == 0 || strncmp(conn->request, "GET /metrics?", 13) == 0) {
+        render_metrics(&body);
+    } else {
+        status = "404 Not Found";
+        content_type = "text/plain; charset=utf-8";
+        buffer_appendf(&body, "Not found. Metrics are served at /metrics.\n");
+    }
+    if (buffer_appendf(&conn->out, "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                       status, content_type, body.len) < 0 ||
+        buffer_reserve(&conn->out, body.len) < 0) {
+        LOG(ERROR, "Out of memory building admin response. Closing connection.");
+        free(body.data);
+        admin_conn_close(conn);
+        return;
+    }
+    if (body.len > 0) memcpy(conn->out.data + conn->out.len, body.data, body.len);
+    conn->out.len += body.len;
+    free(body.data);
+    admin_conn_flush(conn);
+}
+
+void admin_conn_on_event(AdminConn *conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        admin_conn_close(conn);
+        return;
+    }
+    if (conn->out.len > 0) {
+        admin_conn_flush(conn);
+        return;
+    }
+    while (1) {
+        size_t room = sizeof(conn->request) - 1 - conn->request_len;
+        if (room == 0) {
+            LOG(WARNING, "Admin request head over %d bytes. Closing connection.", MAX_ADMIN_REQUEST_SIZE);
+            admin_conn_close(conn);
+            return;
+        }
+        ssize_t n = recv(conn->src.fd, conn->request + conn->request_len, room, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            admin_conn_close(conn);
+            return;
+        }
+        if (n == 0) {
+            admin_conn_close(conn);
+            return;
+        }
+        conn->request_len += n;
+        conn->request[conn->request_len] = '\0';
+        if (strstr(conn->request, "\r\n\r\n") || strstr(conn->request, "\n\n")) {
+            admin_conn_respond(conn);
+            return;
+        }
+    }
+}
+
+void accept_admin_clients(EventSource *listener) {
+    while (1) {
+        int fd = accept(listener->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG(ERROR, "Accept on admin port failed: %s", strerror(errno));
+            return;
+        }
+        AdminConn *conn = calloc(1, sizeof(AdminConn));
+        if (!conn || set_nonblocking(fd) < 0) {
+            LOG(ERROR, "Failed to set up admin connection.");
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->src.type = SRC_ADMIN_CONN;
+        conn->src.fd = fd;
+        if (watch_fd(&conn->src, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+            LOG(ERROR, "Failed to register admin connection with epoll.");
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+// Opens the non-blocking HTTP listener for /metrics. Returns its fd, or -1.
+int setup_admin_socket(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 || set_nonblocking(fd) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+void drain_discovery_socket() {
+    while (1) {
+        char reg_buffer[1024];
+        struct sockaddr_in backend_client_addr;
+        socklen_t backend_addr_len = sizeof(backend_client_addr);
+
+        ssize_t len = recvfrom(discovery_fd, reg_buffer, sizeof(reg_buffer) - 1, 0,
+                               (struct sockaddr*)&backend_client_addr, &backend_addr_len);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG(ERROR, "Error receiving from discovery UDP socket: %s", strerror(errno));
+            }
+            return;
+        }
+        reg_buffer[len] = '\0';
+        char client_ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &backend_client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
+        LOG(DEBUG, "Received registration message from %s:%d : %s",
+            client_ip_str, ntohs(backend_client_addr.sin_port), reg_buffer);
+        process_registration_message(reg_buffer, len);
+    }
+}
+
+// Applies one --policy argument: "<policy>" sets every method, while
+// "<method>=<policy>" overrides a single one. Returns -1 if it is invalid.
+int parse_policy_option(const char *arg) {
+    const char *equals = strchr(arg, '=');
+    const char *name = equals ? equals + 1 : arg;
+    int policy = -1;
+    for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); ++i) {
+        if (strcmp(name, policy_names[i]) == 0) policy = i;
+    }
+    if (policy < 0) return -1;
+
+    if (!equals) {
+        for (int i = 0; i < NUM_METHOD_SLOTS; ++i) method_policies[i] = (SelectionPolicy)policy;
+        return 0;
+    }
+    char method[64];
+    size_t method_len = equals - arg;
+    if (method_len == 0 || method_len >= sizeof(method)) return -1;
+    memcpy(method, arg, method_len);
+    method[method_len] = '\0';
+    int slot = method_slot(method);
+    if (slot == 0) return -1;
+    method_policies[slot] = (SelectionPolicy)policy;
+    return 0;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--pool-min <n>] [--pool-max <n>] [--pool-idle-ms <ms>] [--policy [<method>=]<policy>]...\n"
+                    "       [--local-eval <mode>] [--local-p99-ms <ms>] [--cache-size <n>] [--log-level <level>]\n"
+                    "       [--admin-port <port>] [--hedge-percentile <p>] [--hedge-budget-pct <pct>]\n"
+                    "       [--timeout-factor <k>] [--timeout-min-ms <ms>] [--timeout-max-ms <ms>] [--retry-budget-pct <pct>]\n"
+                    "       [--queue-depth <n>] [--codel-target-ms <ms>] [--codel-interval-ms <ms>]\n", prog);
+    fprintf(stderr, "  --pool-min      Keep-alive connections kept open per TCP backend (default %d)\n", DEFAULT_POOL_MIN_SIZE);
+    fprintf(stderr, "  --pool-max      Maximum connections per TCP backend, 1-%d (default %d)\n", MAX_POOL_SIZE, DEFAULT_POOL_MAX_SIZE);
+    fprintf(stderr, "  --pool-idle-ms  Close idle connections above the minimum after this long (default %d)\n", DEFAULT_POOL_IDLE_TIMEOUT_MS);
+    fprintf(stderr, "  --policy        Backend selection: round-robin (default), p2c, least-outstanding or ewma.\n");
+    fprintf(stderr, "                  Prefix with a method (e.g. divide=ewma) to set it for that method only;\n");
+    fprintf(stderr, "                  later options override earlier ones.\n");
+    fprintf(stderr, "  --local-eval    Evaluate add/subtract/multiply/divide in the gateway: off (default), always,\n");
+    fprintf(stderr, "                  no-backend (when no backend serves the method) or slow-backend (also when\n");
+    fprintf(stderr, "                  the chosen backend's p99 latency is over --local-p99-ms)\n");
+    fprintf(stderr, "  --local-p99-ms  Latency threshold for slow-backend (default %d)\n", DEFAULT_LOCAL_EVAL_P99_MS);
+    fprintf(stderr, "  --cache-size    Results remembered for repeated calls, rounded up to a power of two;\n");
+    fprintf(stderr, "                  0 disables the cache (default %d)\n", DEFAULT_RESULT_CACHE_SIZE);
+    fprintf(stderr, "  --log-level     Least severe level logged: debug, info (default), warning, error or critical\n");
+    fprintf(stderr, "  --admin-port    HTTP port serving Prometheus metrics at /metrics; 0 disables it (default %d)\n", DEFAULT_ADMIN_PORT);
+    fprintf(stderr, "  --hedge-percentile  When a backend has not replied within this percentile (e.g. 95) of its\n");
+    fprintf(stderr, "                  recent latency, send the request to a second backend too; 0 disables (default)\n");
+    fprintf(stderr, "  --hedge-budget-pct  Hedges allowed per 100 backend calls (default %.0f)\n", DEFAULT_HEDGE_BUDGET_PCT);
+    fprintf(stderr, "  --timeout-factor  A backend call times out after this many times the backend's recent p99\n");
+    fprintf(stderr, "                  latency; 0 always waits --timeout-max-ms (default %.0f)\n", DEFAULT_BACKEND_TIMEOUT_FACTOR);
+    fprintf(stderr, "  --timeout-min-ms  Shortest backend call timeout (default %d)\n", DEFAULT_BACKEND_TIMEOUT_MIN_MS);
+    fprintf(stderr, "  --timeout-max-ms  Longest backend call timeout, also used until a backend has enough\n");
+    fprintf(stderr, "                  recent calls to measure (default %d)\n", DEFAULT_BACKEND_TIMEOUT_MAX_MS);
+    fprintf(stderr, "  --retry-budget-pct  Requests retried on another backend after a connection-level failure,\n");
+    fprintf(stderr, "                  per 100 requests; 0 disables retries (default %.0f)\n", DEFAULT_RETRY_BUDGET_PCT);
+    fprintf(stderr, "  --queue-depth   Calls that may wait for a connection per TCP backend; more are answered\n");
+    fprintf(stderr, "                  \"Server busy\" (default %d)\n", DEFAULT_MAX_QUEUE_DEPTH);
+    fprintf(stderr, "  --codel-target-ms  Shed waiting calls once every call has waited longer than this for a\n");
+    fprintf(stderr, "                  whole --codel-interval-ms; 0 disables (default %d)\n", DEFAULT_CODEL_TARGET_MS);
+    fprintf(stderr, "  --codel-interval-ms  See --codel-target-ms (default %d)\n", DEFAULT_CODEL_INTERVAL_MS);
+}
+
+int main(int argc, char *argv[]) {
+    struct option long_options[] = {
+        {"pool-min", required_argument, 0, 'n'},
+        {"pool-max", required_argument, 0, 'x'},
+        {"pool-idle-ms", required_argument, 0, 'i'},
+        {"policy", required_argument, 0, 'P'},
+        {"local-eval", required_argument, 0, 'L'},
+        {"local-p99-ms", required_argument, 0, 'T'},
+        {"cache-size", required_argument, 0, 'C'},
+        {"log-level", required_argument, 0, 'l'},
+        {"admin-port", required_argument, 0, 'A'},
+        {"hedge-percentile", required_argument, 0, 'H'},
+        {"hedge-budget-pct", required_argument, 0, 'B'},
+        {"timeout-factor", required_argument, 0, 'k'},
+        {"timeout-min-ms", required_argument, 0, 'm'},
+        {"timeout-max-ms", required_argument, 0, 'M'},
+        {"retry-budget-pct", required_argument, 0, 'R'},
+        {"queue-depth", required_argument, 0, 'q'},
+        {"codel-target-ms", required_argument, 0, 'g'},
+        {"codel-interval-ms", required_argument, 0, 'I'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+
+    int opt_char;
+    while ((opt_char = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt_char) {
+            case 'n':
+                pool_min_size = atoi(optarg);
+                break;
+            case 'x':
+                pool_max_size = atoi(optarg);
+                break;
+            case 'i':
+                pool_idle_timeout_ms = atoi(optarg);
+                break;
+            case 'P':
+                if (parse_policy_option(optarg) != 0) {
+                    fprintf(stderr, "Invalid --policy '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L': {
+                int mode = -1;
+                for (int i = 0; i < (int)(sizeof(local_eval_names) / sizeof(local_eval_names[0])); ++i) {
+                    if (strcmp(optarg, local_eval_names[i]) == 0) mode = i;
+                }
+                if (mode < 0) {
+                    fprintf(stderr, "Invalid --local-eval '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                local_eval_mode = (LocalEvalMode)mode;
+                break;
+            }
+            case 'T':
+                local_eval_p99_ms = atoll(optarg);
+                break;
+            case 'C':
+                result_cache_size = atol(optarg);
+                break;
+            case 'l': {
+                int level = log_level_from_name(optarg);
+                if (level < 0) {
+                    fprintf(stderr, "Invalid --log-level '%s'.\n", optarg);
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                log_min_level = (LogLevel)level;
+                break;
+            }
+            case 'A':
+                admin_port = atoi(optarg);
+                break;
+            case 'H':
+                hedge_percentile = atof(optarg);
+                break;
+            case 'B':
+                hedge_budget_pct = atof(optarg);
+                break;
+            case 'k':
+                backend_timeout_factor = atof(optarg);
+                break;
+            case 'm':
+                backend_timeout_min_ms = atoll(optarg);
+                break;
+            case 'M':
+                backend_timeout_max_ms = atoll(optarg);
+                break;
+            case 'R':
+                retry_budget_pct = atof(optarg);
+                break;
+            case 'q':
+                max_queue_depth = atoi(optarg);
+                break;
+            case 'g':
+                codel_target_ms = atoll(optarg);
+                break;
+            case 'I':
+                codel_interval_ms = atoll(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (pool_max_size < 1 || pool_max_size > MAX_POOL_SIZE || pool_min_size < 0 ||
+        pool_min_size > pool_max_size || pool_idle_timeout_ms < 0) {
+        fprintf(stderr, "Invalid pool configuration: need 0 <= pool-min <= pool-max <= %d and pool-idle-ms >= 0.\n", MAX_POOL_SIZE);
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (local_eval_p99_ms < 0) {
+        fprintf(stderr, "Invalid --local-p99-ms: must be >= 0.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (hedge_percentile < 0 || hedge_percentile > 100 || hedge_budget_pct < 0 || hedge_budget_pct > 100) {
+        fprintf(stderr, "Invalid hedging configuration: --hedge-percentile and --hedge-budget-pct must be between 0 and 100.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (max_queue_depth < 0 || codel_target_ms < 0 || codel_interval_ms < 1) {
+        fprintf(stderr, "Invalid queue configuration: need --queue-depth >= 0, --codel-target-ms >= 0 and --codel-interval-ms >= 1.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (retry_budget_pct < 0 || retry_budget_pct > 100) {
+        fprintf(stderr, "Invalid --retry-budget-pct: must be between 0 and 100.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (backend_timeout_factor < 0 || backend_timeout_min_ms < 1 || backend_timeout_max_ms < backend_timeout_min_ms) {
+        fprintf(stderr, "Invalid timeout configuration: need --timeout-factor >= 0 and 1 <= --timeout-min-ms <= --timeout-max-ms.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (admin_port < 0 || admin_port > 65535) {
+        fprintf(stderr, "Invalid --admin-port: must be between 0 and 65535.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (result_cache_size < 0 || result_cache_size > (1L << 24)) {
+        fprintf(stderr, "Invalid --cache-size: must be between 0 and %ld.\n", 1L << 24);
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (result_cache_init(&result_cache, (size_t)result_cache_size) != 0) {
+        perror("result cache allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Queued records are written out on any exit() as well
+    if (logger_start() != 0) {
+        fprintf(stderr, "Failed to start the log writer thread; logging synchronously.\n");
+    } else {
+        atexit(logger_stop);
+    }
+
+    // Any non-zero seed works; vary it so that gateways do not sample alike
+    selection_rng_state ^= (unsigned int)monotonic_ms() ^ ((unsigned int)getpid() << 16);
+    if (selection_rng_state == 0) selection_rng_state = 1;
+    route_index_init(&route_index);
+    LOG(INFO, "Backend selection: add=%s subtract=%s multiply=%s divide=%s other=%s",
+        policy_names[method_policies[1]], policy_names[method_policies[2]], policy_names[method_policies[3]],
+        policy_names[method_policies[4]], policy_names[method_policies[0]]);
+    if (local_eval_mode == LOCAL_EVAL_SLOW_BACKEND) {
+        LOG(INFO, "In-process evaluation: slow-backend (p99 over %lld ms)", local_eval_p99_ms);
+    } else {
+        LOG(INFO, "In-process evaluation: %s", local_eval_names[local_eval_mode]);
+    }
+    LOG(INFO, "Result cache: %zu entries", result_cache_capacity(&result_cache));
+    if (hedge_percentile > 0) {
+        LOG(INFO, "Hedging: after p%g of recent backend latency, up to %g%% extra calls", hedge_percentile, hedge_budget_pct);
+    } else {
+        LOG(INFO, "Hedging: off");
+    }
+    LOG(INFO, "Failover retries: up to %g per 100 requests", retry_budget_pct);
+    if (codel_target_ms > 0) {
+        LOG(INFO, "Connection queues: %d calls per backend, CoDel target %lld ms over %lld ms", max_queue_depth, codel_target_ms, codel_interval_ms);
+    } else {
+        LOG(INFO, "Connection queues: %d calls per backend, CoDel off", max_queue_depth);
+    }
+    if (backend_timeout_factor > 0) {
+        LOG(INFO, "Backend call timeouts: %g x p99, %lld-%lld ms", backend_timeout_factor, backend_timeout_min_ms, backend_timeout_max_ms);
+    } else {
+        LOG(INFO, "Backend call timeouts: %lld ms", backend_timeout_max_ms);
+    }
+
+    load_and_launch_backends("json_rpc/backends.conf");
+
+    if (num_managed_backends == 0) {
+        LOG(WARNING, "CRITICAL SETUP: No backends were successfully launched from backends.conf. Gateway may not be able to process any backend requests that rely on these managed backends.");
+    }
+
+    setup_discovery_socket();
+
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("TCP socket failed");
+        LOG(CRITICAL, "JSON-RPC TCP Socket creation failed. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt for TCP socket failed");
+        LOG(CRITICAL, "setsockopt for JSON-RPC TCP socket failed. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(DEFAULT_PORT);
+
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("TCP bind failed");
+        LOG(CRITICAL, "JSON-RPC TCP Bind failed for port %d: %s. Exiting.", DEFAULT_PORT, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Bursts of new clients wait in the backlog rather than being reset
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("TCP listen failed");
+        LOG(CRITICAL, "JSON-RPC TCP Listen failed. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if (set_nonblocking(server_fd) < 0) {
+        perror("fcntl O_NONBLOCK failed for JSON-RPC TCP socket");
+        LOG(CRITICAL, "Could not make JSON-RPC TCP socket non-blocking. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        LOG(CRITICAL, "epoll_create1 failed. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    EventSource listener = { SRC_LISTENER, server_fd };
+    EventSource discovery = { SRC_DISCOVERY, discovery_fd };
+    if (watch_fd(&listener, EPOLL_CTL_ADD, EPOLLIN) < 0 || watch_fd(&discovery, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+        perror("epoll_ctl failed");
+        LOG(CRITICAL, "Failed to register listening sockets with epoll. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    EventSource admin_listener = { SRC_ADMIN_LISTENER, -1 };
+    if (admin_port > 0) {
+        admin_listener.fd = setup_admin_socket(admin_port);
+        if (admin_listener.fd < 0 || watch_fd(&admin_listener, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+            perror("admin socket setup failed");
+            LOG(CRITICAL, "Could not serve metrics on admin port %d: %s. Exiting.", admin_port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        LOG(INFO, "Metrics served at http://0.0.0.0:%d/metrics", admin_port);
+    }
+
+    LOG(INFO, "JSON-RPC Server listening on port %d", DEFAULT_PORT);
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    long long last_backend_check = 0;
+    long long last_cache_stats = monotonic_ms();
+    long long last_outlier_sweep = monotonic_ms();
+
+    while(1) {
+        long long now = monotonic_ms();
+        if (now - last_backend_check >= HOUSEKEEPING_INTERVAL_MS) {
+            check_managed_backends();
+            expire_backend_leases();
+            pool_maintain();
+            last_backend_check = now;
+        }
+        if (now - last_cache_stats >= CACHE_STATS_INTERVAL_MS) {
+            log_result_cache_stats();
+            last_cache_stats = now;
+        }
+        if (now - last_outlier_sweep >= HEALTH_SWEEP_INTERVAL_MS) {
+            sweep_backend_outliers();
+            last_outlier_sweep = now;
+        }
+
+        flush_udp_channels();
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, next_timer_timeout(HOUSEKEEPING_INTERVAL_MS));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG(ERROR, "epoll_wait error: %s. Continuing...", strerror(errno));
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            EventSource *src = events[i].data.ptr;
+            if (src->fd < 0) continue; // Closed earlier in this batch
+            switch (src->type) {
+                case SRC_LISTENER:
+                    accept_clients(src);
+                    break;
+                case SRC_DISCOVERY:
+                    drain_discovery_socket();
+                    break;
+                case SRC_CLIENT:
+                    client_conn_on_event((ClientConn *)src, events[i].events);
+                    break;
+                case SRC_BACKEND:
+                    backend_call_on_event((BackendCall *)src, events[i].events);
+                    break;
+                case SRC_POOLED_CONN:
+                    pooled_conn_on_event((PooledConn *)src, events[i].events);
+                    break;
+                case SRC_UDP_CHANNEL:
+                    udp_channel_on_event((UdpChannel *)src);
+                    break;
+                case SRC_ADMIN_LISTENER:
+                    accept_admin_clients(src);
+                    break;
+                case SRC_ADMIN_CONN:
+                    admin_conn_on_event((AdminConn *)src, events[i].events);
+                    break;
+            }
+        }
+
+        expire_backend_calls();
+        release_pending_objects();
+    }
+
+    LOG(INFO, "Shutting down server.");
+    close(epoll_fd);
+    close(server_fd);
+    close(discovery_fd);
+    if (admin_listener.fd >= 0) close(admin_listener.fd);
+    return 0;
+}
+
+// Extracts method, the two numeric params and the integer id from the request
+// object at tokens[obj]. Members may come in any order with any spacing.
+// The optional timeout_ms member is the client's time budget for the request
+// in milliseconds; *timeout_ms is 0 without one.
+int parse_json_rpc_request(const char *js, const jsontok_token *tokens, int count, int obj, char *method, double *params, int *id,
+                           long long *timeout_ms) {
+    if (js == NULL || tokens == NULL || method == NULL || params == NULL || id == NULL || timeout_ms == NULL) {
+        LOG(CRITICAL, "NULL argument to parse_json_rpc_request");
+        return -1;
+    }
+    *id = -1;
+    *timeout_ms = 0;
+
+    const char *request_text = js + tokens[obj].start;
+    int request_len = tokens[obj].end - tokens[obj].start;
+    if (request_len > 1000) request_len = 1000;
+
+    // The id is read first so errors in the other members can still be
+    // answered with it
+    int id_index = jsontok_find_key(js, tokens, count, obj, "id");
+    if (id_index < 0) {
+        LOG(ERROR, "Parse error: id key not found. Request: %.*s", request_len, request_text);
+        return -1;
+    }
+    const jsontok_token *id_token = &tokens[id_index];
+    if (jsontok_to_int(js, id_token, id) != 0) {
+        if (id_token->type == JSONTOK_STRING) {
+             LOG(WARNING, "Parse warning: id is a string (\"%.*s\") but only integer IDs are supported. Treating as parse error for ID. Request: %.*s",
+                 id_token->end - id_token->start, js + id_token->start, request_len, request_text);
+        } else if (jsontok_equals(js, id_token, "null")) {
+             LOG(WARNING, "Parse warning: id is null. Treating as parse error for ID. Request: %.*s", request_len, request_text);
+        } else {
+            LOG(ERROR, "Parse error: could not parse id as integer. Request: %.*s", request_len, request_text);
+        }
+        *id = -1; // Ensure id is -1 on any parsing failure for it
+        return -1;
+    }
+
+    int method_index = jsontok_find_key(js, tokens, count, obj, "method");
+    if (method_index < 0 || tokens[method_index].type != JSONTOK_STRING) {
+        LOG(ERROR, "Parse error: method key not found or not a string in request: %.*s", request_len, request_text);
+        return -1;
+    }
+    int method_len = tokens[method_index].end - tokens[method_index].start;
+    if (method_len >= 256) {
+        LOG(ERROR, "Parse error: method value too long in request: %.*s", request_len, request_text);
+        return -1;
+    }
+    memcpy(method, js + tokens[method_index].start, method_len);
+    method[method_len] = '\0';
+
+    int params_index = jsontok_find_key(js, tokens, count, obj, "params");
+    if (params_index < 0) {
+        LOG(ERROR, "Parse error: params key not found for method '%s' in request: %.*s", method, request_len, request_text);
+        return -1;
+    }
+    if (tokens[params_index].type != JSONTOK_ARRAY || tokens[params_index].size != 2 ||
+        jsontok_to_double(js, &tokens[params_index + 1], &params[0]) != 0 ||
+        jsontok_to_double(js, &tokens[params_index + 2], &params[1]) != 0) {
+        LOG(ERROR, "Parse error: could not parse params array for method '%s' in request: %.*s", method, request_len, request_text);
+        return -1;
+    }
+
+    int timeout_index = jsontok_find_key(js, tokens, count, obj, "timeout_ms");
+    if (timeout_index >= 0) {
+        double timeout;
+        if (jsontok_to_double(js, &tokens[timeout_index], &timeout) != 0 || !(timeout >= 1.0 && timeout <= 86400000.0)) {
+            LOG(ERROR, "Parse error: timeout_ms must be a number of milliseconds from 1 to 86400000 in request: %.*s", request_len, request_text);
+            return -1;
+        }
+        *timeout_ms = (long long)timeout;
+    }
+    return 0;
+}
+
+void build_json_rpc_response(char *response_str, int id, double result, const char *error_message) {
+    if (response_str == NULL) {
+        LOG(CRITICAL, "build_json_rpc_response called with NULL response_str");
+        return;
+    }
+    char temp_buf[BUFFER_SIZE];
+
+    if (error_message) {
         char escaped_error_message[sizeof(temp_buf)];
         char *p_esc = escaped_error_message;
         const char *p_err = error_message;
@@ -1011,7 +3893,7 @@ void build_json_rpc_response(char *response_str, int id, double result, const ch
         }
     } else {
          if (id == -1) {
-            log_with_timestamp("WARNING", "Building successful JSON-RPC response but request ID was -1 (likely parse error). Sending id as null.");
+            LOG(WARNING, "Building successful JSON-RPC response but request ID was -1 (likely parse error). Sending id as null.");
             snprintf(temp_buf, sizeof(temp_buf), "{\"jsonrpc\": \"2.0\", \"result\": %f, \"id\": null}", result);
          } else {
             snprintf(temp_buf, sizeof(temp_buf), "{\"jsonrpc\": \"2.0\", \"result\": %f, \"id\": %d}", result, id);
@@ -1020,3 +3902,27 @@ void build_json_rpc_response(char *response_str, int id, double result, const ch
     strncpy(response_str, temp_buf, BUFFER_SIZE -1);
     response_str[BUFFER_SIZE -1] = '\0';
 }
+
+// The error for a message that is valid JSON but not a valid request
+// (-32600), e.g. an empty batch. Its id cannot be known, so it is null.
+// error_message is a literal and needs no escaping.
+void build_invalid_request_response(char *response_str, const char *error_message) {
+    snprintf(response_str, BUFFER_SIZE,
+        "{\"jsonrpc\": \"2.0\", \"error\": {\"code\": -32600, \"message\": \"%s\"}, \"id\": null}", error_message);
+}
+
+// The response to a calculation that produced a result, naming where it
+// ran. The value is printed with 17 significant digits, enough to read back
+// the exact double. JSON has no infinity or NaN, so an overflowing or
+// undefined result is answered with an error instead. Returns 0 if the
+// response holds the result, -1 if it is that error.
+int build_result_response(char *response_str, int id, double result, const char *backend_label) {
+    if (!isfinite(result)) {
+        build_json_rpc_response(response_str, id, 0.0, "Result is not a finite number.");
+        return -1;
+    }
+    snprintf(response_str, BUFFER_SIZE,
+        "{\"jsonrpc\": \"2.0\", \"result\": {\"value\": %.17g, \"backend\": \"%s\"}, \"id\": %d}",
+        result, backend_label, id);
+    return 0;
+}